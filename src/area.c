@@ -15,6 +15,7 @@
  *
  */
 
+#include <pthread.h>
 #include "fuzzy.h"
 #include "area.h"
 
@@ -159,7 +160,7 @@ bool fuzzy_area_inside(FuzzyArea * area, const FuzzyPoint * pivot, const FuzzyPo
     return ((*area)[locx][locy]);
 }
 
-void fuzzy_areadb_init()
+static void _areadb_generate()
 {
     fuzzy_debug("Generating area sets...");
 
@@ -168,3 +169,12 @@ void fuzzy_areadb_init()
 
     fuzzy_debug("Generation done");
 }
+
+/* prototypes are expanded in place, so this must happen only once.
+    Games are created by many server threads. */
+void fuzzy_areadb_init()
+{
+    static pthread_once_t generated = PTHREAD_ONCE_INIT;
+
+    fuzzy_nz_rerror(pthread_once(&generated, _areadb_generate));
+}
@@ -107,3 +107,199 @@ void * fuzzy_alloc(ssize_t size)
     fuzzy_iz_perror(ptr = malloc(size));
     return ptr;
 }
+
+int fuzzy_histogram_bucket(ulong value)
+{
+    int msb;
+
+    if (value < (1 << FUZZY_HISTOGRAM_SUB_BITS))
+        return value;
+    msb = 63 - __builtin_clzl(value);
+    if (msb >= FUZZY_HISTOGRAM_MAX_BITS)
+        return FUZZY_HISTOGRAM_BUCKETS - 1;
+
+    /* the bits after the most significant one select the linear bucket */
+    return ((msb - FUZZY_HISTOGRAM_SUB_BITS + 1) << FUZZY_HISTOGRAM_SUB_BITS)
+      + ((value >> (msb - FUZZY_HISTOGRAM_SUB_BITS)) & ((1 << FUZZY_HISTOGRAM_SUB_BITS) - 1));
+}
+
+ulong fuzzy_histogram_bucket_value(int bucket)
+{
+    int major = bucket >> FUZZY_HISTOGRAM_SUB_BITS;
+    ulong sub = bucket & ((1 << FUZZY_HISTOGRAM_SUB_BITS) - 1);
+
+    if (major == 0)
+        return sub;
+    return (((1UL << FUZZY_HISTOGRAM_SUB_BITS) + sub + 1) << (major - 1)) - 1;
+}
+
+/* relaxed stores: no locked instruction for the writer, no torn reads */
+void fuzzy_histogram_add(FuzzyHistogram * hist, ulong value)
+{
+    ulong * bucket = &hist->buckets[fuzzy_histogram_bucket(value)];
+
+    __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELAXED);
+    if (value > hist->max)
+        __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+}
+
+/* src can be updated meanwhile, dst must be private */
+void fuzzy_histogram_merge(FuzzyHistogram * dst, const FuzzyHistogram * src)
+{
+    ulong max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    int i;
+
+    for (i = 0; i < FUZZY_HISTOGRAM_BUCKETS; i++)
+        dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+    dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->max = fuzzy_max(dst->max, max);
+}
+
+/* the upper bound of the bucket holding the percentile, 0 if empty */
+ulong fuzzy_histogram_percentile(const FuzzyHistogram * hist, double pct)
+{
+    ulong rank = hist->count * pct / 100.0;
+    ulong seen = 0;
+    int i;
+
+    for (i = 0; i < FUZZY_HISTOGRAM_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen > rank)
+            return fuzzy_min(fuzzy_histogram_bucket_value(i), hist->max);
+    }
+    return hist->max;
+}
+
+void fuzzy_queue_init(FuzzyQueue * queue, size_t size)
+{
+    if (size & (size - 1))
+        fuzzy_critical("Queue size is not a power of 2");
+    queue->items = fuzzy_newarr(void *, size);
+    queue->size = size;
+    queue->head = queue->tail = 0;
+}
+
+void fuzzy_queue_free(FuzzyQueue * queue)
+{
+    free(queue->items);
+    queue->items = NULL;
+}
+
+/* the release store publishes the item to the consumer */
+bool fuzzy_queue_push(FuzzyQueue * queue, void * item)
+{
+    size_t tail = queue->tail;
+
+    if (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == queue->size)
+        return false;
+    queue->items[tail & (queue->size - 1)] = item;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* the release store gives the slot back to the producer */
+void * fuzzy_queue_pop(FuzzyQueue * queue)
+{
+    size_t head = queue->head;
+    void * item;
+
+    if (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    item = queue->items[head & (queue->size - 1)];
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+bool fuzzy_queue_empty(FuzzyQueue * queue)
+{
+    return queue->head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+}
+
+void fuzzy_wheel_init(FuzzyTimerWheel * wheel)
+{
+    bzero(wheel, sizeof(FuzzyTimerWheel));
+}
+
+void fuzzy_timer_init(FuzzyTimer * timer, void * data)
+{
+    timer->expires = 0;
+    timer->data = data;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+void fuzzy_timer_cancel(FuzzyTimer * timer)
+{
+    if (! fuzzy_timer_armed(timer))
+        return;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    *timer->pprev = timer->next;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/* the level is the highest base 64 digit where expires differs from now */
+static void _wheel_insert(FuzzyTimerWheel * wheel, FuzzyTimer * timer)
+{
+    ulong diff = timer->expires ^ wheel->now;
+    FuzzyTimer ** slot;
+    int level = 0;
+
+    while (level < FUZZY_WHEEL_LEVELS - 1 && (diff >> ((level + 1) * FUZZY_WHEEL_BITS)) != 0)
+        level++;
+    if ((diff >> (FUZZY_WHEEL_LEVELS * FUZZY_WHEEL_BITS)) != 0)
+        timer->expires = wheel->now | ((1UL << (FUZZY_WHEEL_LEVELS * FUZZY_WHEEL_BITS)) - 1);
+
+    slot = &wheel->slots[level][(timer->expires >> (level * FUZZY_WHEEL_BITS)) & (FUZZY_WHEEL_SLOTS - 1)];
+    timer->next = *slot;
+    if (*slot)
+        (*slot)->pprev = &timer->next;
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+void fuzzy_timer_arm(FuzzyTimerWheel * wheel, FuzzyTimer * timer, ulong expires)
+{
+    fuzzy_timer_cancel(timer);
+    timer->expires = fuzzy_max(expires, wheel->now + 1);
+    _wheel_insert(wheel, timer);
+}
+
+/* moves the timers of a slot to the lower levels */
+static void _wheel_cascade(FuzzyTimerWheel * wheel, int level)
+{
+    FuzzyTimer ** slot = &wheel->slots[level][(wheel->now >> (level * FUZZY_WHEEL_BITS)) & (FUZZY_WHEEL_SLOTS - 1)];
+    FuzzyTimer * timer;
+
+    while ((timer = *slot) != NULL) {
+        fuzzy_timer_cancel(timer);
+        _wheel_insert(wheel, timer);
+    }
+}
+
+void fuzzy_wheel_advance(FuzzyTimerWheel * wheel, ulong ticks, FuzzyTimerExpire expire)
+{
+    FuzzyTimer ** slot;
+    FuzzyTimer * timer;
+    int level;
+
+    while (ticks--) {
+        wheel->now++;
+
+        /* a level moves down when the digits below it wrap. The higher
+            levels go first, their timers can land on a lower slot which
+            is due now */
+        for (level = FUZZY_WHEEL_LEVELS - 1; level > 0; level--)
+            if ((wheel->now & ((1UL << (level * FUZZY_WHEEL_BITS)) - 1)) == 0)
+                _wheel_cascade(wheel, level);
+
+        /* expire can arm timers again, always on later slots */
+        slot = &wheel->slots[0][wheel->now & (FUZZY_WHEEL_SLOTS - 1)];
+        while ((timer = *slot) != NULL) {
+            fuzzy_timer_cancel(timer);
+            expire(timer);
+        }
+    }
+}
@@ -131,4 +131,74 @@ bool fuzzy_test_result();
 // Error checked malloc
 void * fuzzy_alloc(ssize_t size);
 
+/* Log-linear histogram: 8 linear buckets for each power of 2, like HDR
+    histograms with about 1 significant digit. Values from 2^40 on share the
+    last bucket. A single thread adds values, others can read it meanwhile. */
+#define FUZZY_HISTOGRAM_SUB_BITS 3
+#define FUZZY_HISTOGRAM_MAX_BITS 40
+#define FUZZY_HISTOGRAM_BUCKETS ((FUZZY_HISTOGRAM_MAX_BITS - FUZZY_HISTOGRAM_SUB_BITS + 1) << FUZZY_HISTOGRAM_SUB_BITS)
+
+typedef struct FuzzyHistogram {
+    ulong buckets[FUZZY_HISTOGRAM_BUCKETS];
+    ulong count;
+    ulong max;
+} FuzzyHistogram;
+
+int fuzzy_histogram_bucket(ulong value);
+// Highest value of the bucket
+ulong fuzzy_histogram_bucket_value(int bucket);
+void fuzzy_histogram_add(FuzzyHistogram * hist, ulong value);
+void fuzzy_histogram_merge(FuzzyHistogram * dst, const FuzzyHistogram * src);
+ulong fuzzy_histogram_percentile(const FuzzyHistogram * hist, double pct);
+
+/* Single producer, single consumer queue of pointers: one thread pushes and
+    another one pops, without locks. Size is a power of 2. */
+typedef struct FuzzyQueue {
+    void ** items;
+    size_t size;
+    size_t head;                                        // written by the consumer
+    size_t tail __attribute__((aligned(64)));           // written by the producer
+} FuzzyQueue;
+
+void fuzzy_queue_init(FuzzyQueue * queue, size_t size);
+void fuzzy_queue_free(FuzzyQueue * queue);
+// false if full
+bool fuzzy_queue_push(FuzzyQueue * queue, void * item);
+// NULL if empty
+void * fuzzy_queue_pop(FuzzyQueue * queue);
+// consumer side, like a pop without taking the item
+bool fuzzy_queue_empty(FuzzyQueue * queue);
+
+/* Hierarchical timing wheel: 4 levels of 64 slots, in ticks of the owner
+    clock. Arm and cancel are O(1); a timer waits on the level of the highest
+    base 64 digit where it differs from now and moves down as now reaches
+    it. Timers further than 2^24 ticks expire at the end of the wheel range,
+    their owner can arm them again. Single thread. */
+#define FUZZY_WHEEL_BITS 6
+#define FUZZY_WHEEL_SLOTS (1 << FUZZY_WHEEL_BITS)
+#define FUZZY_WHEEL_LEVELS 4
+
+typedef struct FuzzyTimer {
+    ulong expires;                      // tick
+    void * data;
+    struct FuzzyTimer * next;
+    struct FuzzyTimer ** pprev;         // NULL when not armed
+} FuzzyTimer;
+
+typedef void (*FuzzyTimerExpire)(FuzzyTimer * timer);
+
+typedef struct FuzzyTimerWheel {
+    ulong now;
+    FuzzyTimer * slots[FUZZY_WHEEL_LEVELS][FUZZY_WHEEL_SLOTS];
+} FuzzyTimerWheel;
+
+void fuzzy_wheel_init(FuzzyTimerWheel * wheel);
+void fuzzy_timer_init(FuzzyTimer * timer, void * data);
+// Rearms an armed timer. Ticks which are not in the future expire on the next one
+void fuzzy_timer_arm(FuzzyTimerWheel * wheel, FuzzyTimer * timer, ulong expires);
+void fuzzy_timer_cancel(FuzzyTimer * timer);
+#define fuzzy_timer_armed(timer) ((timer)->pprev != NULL)
+// Advances the clock by ticks, expired timers are disarmed and passed to expire
+void fuzzy_wheel_advance(FuzzyTimerWheel * wheel, ulong ticks, FuzzyTimerExpire expire);
+
 #endif
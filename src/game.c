@@ -15,13 +15,18 @@ FuzzyGame * fuzzy_game_new(char * mapname)
     FuzzyGame * game;
 
     fuzzy_areadb_init();
-    fuzzy_map_setup();
 
     game = fuzzy_new(FuzzyGame);
     game->players = NULL;
     game->_pctr = 0;
-    game->map = fuzzy_map_load(mapname);
-    fuzzy_map_update(game->map, 0);
+    game->_cctr = 1;
+    game->map = NULL;
+
+    if (mapname != NULL) {
+        fuzzy_map_setup();
+        game->map = fuzzy_map_load(mapname);
+        fuzzy_map_update(game->map, 0);
+    }
 
     return game;
 }
@@ -31,7 +36,8 @@ void fuzzy_game_free(FuzzyGame * game)
     #define _delete_callback(item) fuzzy_player_free(game, item)
     fuzzy_list_map(FuzzyPlayer, game->players, _delete_callback);
 
-    fuzzy_map_unload(game->map);
+    if (game->map)
+        fuzzy_map_unload(game->map);
     free(game);
 }
 
@@ -51,13 +57,15 @@ FuzzyChess * fuzzy_chess_add(FuzzyGame * game, FuzzyPlayer * pg, FuzzyFooes foo,
     }
 
     chess = fuzzy_new(FuzzyChess);
+    chess->id = (game->_cctr)++;
     chess->x = x;
     chess->y = y;
     chess->atkarea = atkarea;
     chess->owner = pg;
     fuzzy_list_null(chess);
 
-    fuzzy_sprite_create(game->map, FUZZY_LAYER_SPRITES, grp, x, y);
+    if (game->map)
+        fuzzy_sprite_create(game->map, FUZZY_LAYER_SPRITES, grp, x, y);
     fuzzy_list_append(FuzzyChess, pg->chess_l, chess);
 
     return chess;
@@ -88,13 +96,28 @@ static bool _pay_sp_requirement(FuzzyPlayer * player, uint sp_req)
     return true;
 }
 
+/* headless games have no sprites layer to look at */
+static bool _fuzzy_cell_taken(FuzzyGame * game, ulong x, ulong y)
+{
+    FuzzyPlayer * player;
+
+    if (game->map)
+        return fuzzy_map_spy(game->map, FUZZY_LAYER_SPRITES, x, y) != FUZZY_CELL_EMPTY;
+
+    for (player = game->players; player; fuzzy_list_next(player))
+        if (fuzzy_chess_at(game, player, x, y))
+            return true;
+    return false;
+}
+
 bool fuzzy_chess_move(FuzzyGame * game, FuzzyChess * chess, ulong nx, ulong ny)
 {
-    if (fuzzy_map_spy(game->map, FUZZY_LAYER_SPRITES, nx, ny) != FUZZY_CELL_EMPTY)
+    if (_fuzzy_cell_taken(game, nx, ny))
         // collision
         return false;
 
-    fuzzy_sprite_move(game->map, FUZZY_LAYER_SPRITES, chess->x, chess->y, nx, ny);
+    if (game->map)
+        fuzzy_sprite_move(game->map, FUZZY_LAYER_SPRITES, chess->x, chess->y, nx, ny);
     chess->x = nx;
     chess->y = ny;
     return true;
@@ -109,7 +132,8 @@ static void _fuzzy_chess_free(FuzzyGame * game, FuzzyChess * chess)
     fuzzy_list_remove(FuzzyChess, player->chess_l, chess);
 
     // remove from map
-    fuzzy_sprite_destroy(game->map, FUZZY_LAYER_SPRITES, chess->x, chess->y);
+    if (game->map)
+        fuzzy_sprite_destroy(game->map, FUZZY_LAYER_SPRITES, chess->x, chess->y);
 
     free(chess);
 }
@@ -202,6 +226,20 @@ FuzzyPlayer * fuzzy_player_new(FuzzyGame * game, FuzzyFuzzyPlayerType type, char
     return player;
 }
 
+/* Soul points are boosted every interval seconds, time is the game clock.
+    Returns the number of boosts */
+uint fuzzy_player_soul_update(FuzzyPlayer * player, double time, double interval)
+{
+    uint boosts = 0;
+
+    while (time - player->soul_time >= interval) {
+        player->soul_time += interval;
+        player->soul_points += SOUL_POINTS_BOOST;
+        boosts++;
+    }
+    return boosts;
+}
+
 /* also remove the player from game */
 void fuzzy_player_free(FuzzyGame * game, FuzzyPlayer * player)
 {
@@ -229,3 +267,37 @@ bool fuzzy_chess_local_move(FuzzyGame * game, FuzzyPlayer * player, FuzzyChess *
 
     return fuzzy_chess_move(game, chess, nx, ny);
 }
+
+/* Server rules, shared by the rooms and the journal replay */
+
+void fuzzy_game_spawn(FuzzyGame * game, double time)
+{
+    FuzzyPlayer * player;
+
+    for (player = game->players; player; fuzzy_list_next(player)) {
+        player->soul_time = time;
+        if (player->chess_l)
+            continue;
+        fuzzy_chess_add(game, player, FUZZY_FOO_LINK, 1, 1 + 2 * player->id);
+        fuzzy_chess_add(game, player, FUZZY_FOO_LINK, 3, 1 + 2 * player->id);
+    }
+}
+
+bool fuzzy_game_play(FuzzyGame * game, FuzzyPlayer * player, bool attack, ulong x, ulong y, long dx, long dy)
+{
+    FuzzyChess * chess;
+    long tx = (long)x + dx;
+    long ty = (long)y + dy;
+
+    chess = fuzzy_chess_at(game, player, x, y);
+    if (chess == NULL || tx < 0 || ty < 0)
+        return false;
+
+    if (attack) {
+        if (fuzzy_chess_inside_target_area(game, chess, tx, ty))
+            fuzzy_chess_local_attack(game, player, chess, tx, ty);
+    } else {
+        fuzzy_chess_local_move(game, player, chess, tx, ty);
+    }
+    return true;
+}
@@ -40,6 +40,7 @@ typedef enum FuzzyFuzzyPlayerType {
 }FuzzyFuzzyPlayerType;
 
 typedef struct FuzzyChess {
+    ulong id;                       // unique inside the game
     ulong x;
     ulong y;
     FuzzyArea * atkarea;
@@ -60,10 +61,12 @@ typedef struct FuzzyPlayer {
     fuzzy_list_link(struct FuzzyPlayer);
 }FuzzyPlayer;
 
+/* A game without map is headless: it only tracks the state, as the server does */
 typedef struct FuzzyGame {
     FuzzyMap * map;
     FuzzyPlayer * players;
     uint _pctr;
+    ulong _cctr;
 }FuzzyGame;
 
 /* Available fooes */
@@ -72,13 +75,14 @@ typedef enum FuzzyFooes {
 }FuzzyFooes;
 
 /* game related */
-FuzzyGame * fuzzy_game_new(char * mapname);
+FuzzyGame * fuzzy_game_new(char * mapname);         // NULL mapname for a headless game
 void fuzzy_game_free(FuzzyGame * game);
 
 /* player related */
 FuzzyPlayer * fuzzy_player_new(FuzzyGame * game, FuzzyFuzzyPlayerType type, char * name);
 void fuzzy_player_free(FuzzyGame * game, FuzzyPlayer * player);
 FuzzyPlayer * fuzzy_player_by_id(FuzzyGame * game, ubyte id);
+uint fuzzy_player_soul_update(FuzzyPlayer * player, double time, double interval);
 
 /* chess related */
 FuzzyChess * fuzzy_chess_add(FuzzyGame * game, FuzzyPlayer * pg, FuzzyFooes foo, ulong x, ulong y);
@@ -91,4 +95,11 @@ bool fuzzy_chess_inside_target_area(FuzzyGame * game, FuzzyChess * chess, ulong
 bool fuzzy_chess_local_attack(FuzzyGame * game, FuzzyPlayer * player, FuzzyChess * chess, ulong tx, ulong ty);
 bool fuzzy_chess_local_move(FuzzyGame * game, FuzzyPlayer * player, FuzzyChess * chess, ulong nx, ulong ny);
 
+/* server rules */
+// each player without chess gets its pieces, soul points start growing at time
+void fuzzy_game_spawn(FuzzyGame * game, double time);
+// moves or attacks with the player chess at x,y. False if it has none there,
+// true otherwise even if the action failed: soul points are paid anyway
+bool fuzzy_game_play(FuzzyGame * game, FuzzyPlayer * player, bool attack, ulong x, ulong y, long dx, long dy);
+
 #endif
@@ -0,0 +1,405 @@
+/*
+ * Emanuele Faranda         black.silver@hotmail.it
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "fuzzy.h"
+#include "server.h"
+#include "protocol.h"
+#include "journal.h"
+
+#define JOURNAL_IOV 64                          // batches written by one call
+
+/* a new file gets the header, an existing one must match it. A record cut
+    by a crash is dropped, so that the next ones are aligned */
+static void _journal_header(int fd, ubyte32 tick_rate)
+{
+    FuzzyJournalHeader header, old;
+    off_t size, excess;
+    ssize_t n;
+
+    memcpy(header.magic, FUZZY_JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = FUZZY_JOURNAL_VERSION;
+    header.tick_rate = tick_rate;
+    header.record_size = sizeof(FuzzyJournalRecord);
+
+    fuzzy_lz_perror(n = pread(fd, &old, sizeof(old), 0));
+    if (n == 0) {
+        if (write(fd, &header, sizeof(header)) != sizeof(header))
+            fuzzy_critical("Cannot write the journal header");
+        return;
+    }
+    if (n != sizeof(old) || memcmp(&old, &header, sizeof(header)) != 0)
+        fuzzy_critical("Journal header does not match, was it written at another tick rate?");
+
+    fuzzy_lz_perror(size = lseek(fd, 0, SEEK_END));
+    excess = (size - sizeof(header)) % sizeof(FuzzyJournalRecord);
+    if (excess) {
+        fuzzy_warning(fuzzy_sformat("Journal ends with a partial record, %ld bytes dropped", (long) excess));
+        fuzzy_lz_perror(ftruncate(fd, size - excess));
+    }
+}
+
+/* writes the batches and frees them */
+static void _journal_write(FuzzyJournal * journal, struct iovec * iov, FuzzyJournalBatch ** batches, int count)
+{
+    ssize_t done;
+    int i = 0;
+
+    while (i < count) {
+        fuzzy_lz_perror(done = writev(journal->fd, &iov[i], count - i));
+        while (i < count && (size_t) done >= iov[i].iov_len)
+            done -= iov[i++].iov_len;
+        if (i < count) {
+            iov[i].iov_base = (char *) iov[i].iov_base + done;
+            iov[i].iov_len -= done;
+        }
+    }
+    for (i = 0; i < count; i++)
+        free(batches[i]);
+    __atomic_store_n(&journal->writes, journal->writes + 1, __ATOMIC_RELAXED);
+}
+
+/* false if nothing was queued */
+static bool _journal_drain(FuzzyJournal * journal)
+{
+    struct iovec iov[JOURNAL_IOV];
+    FuzzyJournalBatch * batches[JOURNAL_IOV];
+    FuzzyJournalBatch * batch;
+    bool written = false;
+    int count = 0, p;
+
+    for (p = 0; p < journal->producers_count; p++) {
+        while ((batch = (FuzzyJournalBatch *) fuzzy_queue_pop(&journal->producers[p].queue)) != NULL) {
+            batches[count] = batch;
+            iov[count].iov_base = batch->records;
+            iov[count].iov_len = batch->count * sizeof(FuzzyJournalRecord);
+            if (++count == JOURNAL_IOV) {
+                _journal_write(journal, iov, batches, count);
+                count = 0;
+            }
+            written = true;
+        }
+    }
+    if (count)
+        _journal_write(journal, iov, batches, count);
+    return written;
+}
+
+static ulong _journal_clock()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/* one sync for everything queued within the window. Producers do not wake
+    the writer meanwhile, it is still signaled */
+static void * _journal_loop(void * args)
+{
+    FuzzyJournal * journal = (FuzzyJournal *) args;
+    eventfd_t count;
+    bool running = true;
+    ulong last = 0, now;
+
+    while (running) {
+        fuzzy_lz_perror(eventfd_read(journal->wakefd, &count));
+        running = __atomic_load_n(&journal->running, __ATOMIC_RELAXED);
+        now = _journal_clock();
+        if (running && now < last + FUZZY_JOURNAL_SYNC_MS * 1000)
+            usleep(last + FUZZY_JOURNAL_SYNC_MS * 1000 - now);
+        last = _journal_clock();
+
+        /* cleared before draining, batches queued meanwhile wake us again */
+        __atomic_store_n(&journal->signaled, false, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (_journal_drain(journal)) {
+            fuzzy_lz_perror(fdatasync(journal->fd));
+            __atomic_store_n(&journal->syncs, journal->syncs + 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+FuzzyJournal * fuzzy_journal_open(char * path, int producers, ubyte32 tick_rate)
+{
+    FuzzyJournal * journal = fuzzy_new(FuzzyJournal);
+    int p;
+
+    bzero(journal, sizeof(FuzzyJournal));
+    fuzzy_lz_perror(journal->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644));
+    _journal_header(journal->fd, tick_rate);
+
+    journal->producers = fuzzy_newarr(FuzzyJournalProducer, producers);
+    journal->producers_count = producers;
+    for (p = 0; p < producers; p++) {
+        fuzzy_queue_init(&journal->producers[p].queue, FUZZY_JOURNAL_QUEUE_SIZE);
+        journal->producers[p].batch = NULL;
+    }
+    journal->running = true;
+    fuzzy_lz_perror(journal->wakefd = eventfd(0, EFD_CLOEXEC));
+    fuzzy_nz_rerror(pthread_create(&journal->thread, NULL, _journal_loop, journal));
+    return journal;
+}
+
+/* once until the writer drains. The fence orders the queue push before
+    reading the flag, see _journal_loop */
+static void _journal_wake(FuzzyJournal * journal)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (! __atomic_exchange_n(&journal->signaled, true, __ATOMIC_SEQ_CST))
+        fuzzy_lz_perror(eventfd_write(journal->wakefd, 1));
+}
+
+void fuzzy_journal_flush(FuzzyJournal * journal, int producer)
+{
+    FuzzyJournalProducer * prod = &journal->producers[producer];
+
+    if (prod->batch == NULL)
+        return;
+    if (! fuzzy_queue_push(&prod->queue, prod->batch)) {
+        fuzzy_warning("Journal writer is behind, waiting for it");
+        do {
+            _journal_wake(journal);
+            usleep(100);
+        } while (! fuzzy_queue_push(&prod->queue, prod->batch));
+    }
+    prod->batch = NULL;
+    _journal_wake(journal);
+}
+
+void fuzzy_journal_append(FuzzyJournal * journal, int producer, const FuzzyJournalRecord * record)
+{
+    FuzzyJournalProducer * prod = &journal->producers[producer];
+
+    if (prod->batch == NULL) {
+        prod->batch = fuzzy_new(FuzzyJournalBatch);
+        prod->batch->count = 0;
+    }
+    prod->batch->records[prod->batch->count++] = *record;
+    if (prod->batch->count == FUZZY_JOURNAL_BATCH)
+        fuzzy_journal_flush(journal, producer);
+}
+
+void fuzzy_journal_close(FuzzyJournal * journal)
+{
+    int p;
+
+    for (p = 0; p < journal->producers_count; p++)
+        fuzzy_journal_flush(journal, p);
+    __atomic_store_n(&journal->running, false, __ATOMIC_RELAXED);
+    fuzzy_lz_perror(eventfd_write(journal->wakefd, 1));
+    fuzzy_nz_rerror(pthread_join(journal->thread, NULL));
+
+    fuzzy_debug(fuzzy_sformat("Journal closed after %lu writes and %lu syncs", journal->writes, journal->syncs));
+    for (p = 0; p < journal->producers_count; p++)
+        fuzzy_queue_free(&journal->producers[p].queue);
+    free(journal->producers);
+    close(journal->wakefd);
+    close(journal->fd);
+    free(journal);
+}
+
+bool fuzzy_journal_map(FuzzyJournalMap * map, char * path)
+{
+    struct stat st;
+    int fd;
+
+    bzero(map, sizeof(FuzzyJournalMap));
+    fuzzy_lz_perror(fd = open(path, O_RDONLY | O_CLOEXEC));
+    fuzzy_lz_perror(fstat(fd, &st));
+    if ((size_t) st.st_size < sizeof(FuzzyJournalHeader)) {
+        close(fd);
+        return false;
+    }
+    map->size = st.st_size;
+    map->base = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map->base == MAP_FAILED)
+        fuzzy_critical(fuzzy_strerror(errno));
+    madvise(map->base, map->size, MADV_SEQUENTIAL);
+
+    map->header = (const FuzzyJournalHeader *) map->base;
+    if (memcmp(map->header->magic, FUZZY_JOURNAL_MAGIC, sizeof(map->header->magic)) != 0 ||
+      map->header->version != FUZZY_JOURNAL_VERSION || map->header->record_size != sizeof(FuzzyJournalRecord) ||
+      map->header->tick_rate == 0) {
+        fuzzy_journal_unmap(map);
+        return false;
+    }
+    map->records = (const FuzzyJournalRecord *) (map->header + 1);
+    map->count = (map->size - sizeof(FuzzyJournalHeader)) / sizeof(FuzzyJournalRecord);
+    return true;
+}
+
+void fuzzy_journal_unmap(FuzzyJournalMap * map)
+{
+    if (map->base)
+        munmap(map->base, map->size);
+    bzero(map, sizeof(FuzzyJournalMap));
+}
+
+void fuzzy_replay_init(FuzzyReplay * replay, ubyte32 tick_rate)
+{
+    bzero(replay, sizeof(FuzzyReplay));
+    replay->tick_rate = tick_rate;
+    replay->digest = 14695981039346656037UL;    // FNV-1a offset basis
+}
+
+static void _digest(FuzzyReplay * replay, uint64_t value)
+{
+    int i;
+
+    for (i = 0; i < 8; i++, value >>= 8)
+        replay->digest = (replay->digest ^ (value & 0xff)) * 1099511628211UL;
+}
+
+static void _replay_close(FuzzyReplay * replay, int slot)
+{
+    FuzzyReplayRoom * room = replay->rooms[slot];
+    FuzzyPlayer * player;
+    FuzzyChess * chess;
+
+    _digest(replay, room->id);
+    for (player = room->game->players; player; fuzzy_list_next(player)) {
+        _digest(replay, player->id);
+        _digest(replay, player->soul_points);
+        for (chess = player->chess_l; chess; fuzzy_list_next(chess)) {
+            _digest(replay, chess->id);
+            _digest(replay, chess->x);
+            _digest(replay, chess->y);
+        }
+    }
+    if (replay->on_close)
+        replay->on_close(replay, room, replay->close_data);
+
+    fuzzy_game_free(room->game);
+    free(room);
+    replay->rooms[slot] = NULL;
+}
+
+static void _replay_create(FuzzyReplay * replay, int slot, const FuzzyJournalRecord * record)
+{
+    FuzzyReplayRoom * room;
+    int nsize;
+
+    if (slot >= replay->rooms_size) {
+        nsize = fuzzy_max(replay->rooms_size * 2, FUZZY_SERVER_CLIENTS_INITIAL);
+        while (nsize <= slot)
+            nsize *= 2;
+        fuzzy_iz_perror(replay->rooms = (FuzzyReplayRoom **) realloc(replay->rooms, nsize * sizeof(FuzzyReplayRoom *)));
+        bzero(&replay->rooms[replay->rooms_size], (nsize - replay->rooms_size) * sizeof(FuzzyReplayRoom *));
+        replay->rooms_size = nsize;
+    }
+    /* left open by a server which did not shut down */
+    if (replay->rooms[slot])
+        _replay_close(replay, slot);
+
+    room = fuzzy_new(FuzzyReplayRoom);
+    room->id = record->room;
+    room->game = fuzzy_game_new(NULL);
+    room->steps = 0;
+    room->started = false;
+    room->owner = record->player;
+    replay->rooms[slot] = room;
+    replay->rooms_created++;
+}
+
+/* soul points grow as they did on the server ticks */
+static void _replay_clock(FuzzyReplay * replay, FuzzyReplayRoom * room, uint64_t steps)
+{
+    FuzzyPlayer * player;
+
+    if (! room->started || steps <= room->steps)
+        return;
+    room->steps = steps;
+    for (player = room->game->players; player; fuzzy_list_next(player))
+        fuzzy_player_soul_update(player, (double) steps / replay->tick_rate, SOUL_TIME_INTERVAL);
+}
+
+void fuzzy_replay_record(FuzzyReplay * replay, const FuzzyJournalRecord * record)
+{
+    int slot = record->room & ((1 << FUZZY_ROOM_SLOT_BITS) - 1);
+    FuzzyReplayRoom * room;
+    FuzzyPlayer * player;
+
+    replay->records++;
+    if (record->type == FUZZY_COMMAND_GAME_CREATE)
+        _replay_create(replay, slot, record);
+
+    room = slot < replay->rooms_size ? replay->rooms[slot] : NULL;
+    if (room == NULL || room->id != record->room || record->steps < room->steps) {
+        replay->mismatches++;
+        return;
+    }
+    _replay_clock(replay, room, record->steps);
+
+    switch (record->type) {
+        case FUZZY_COMMAND_GAME_CREATE:
+        case FUZZY_COMMAND_GAME_JOIN:
+            player = fuzzy_player_new(room->game, FUZZY_PLAYER_REMOTE, "");
+            player->soul_time = (double) room->steps / replay->tick_rate;
+            if (player->id != record->player)
+                replay->mismatches++;
+            return;
+        case FUZZY_COMMAND_GAME_START:
+            fuzzy_game_spawn(room->game, (double) room->steps / replay->tick_rate);
+            room->started = true;
+            return;
+        default:
+            break;
+    }
+
+    if ((player = fuzzy_player_by_id(room->game, record->player)) == NULL) {
+        replay->mismatches++;
+        return;
+    }
+    switch (record->type) {
+        case FUZZY_COMMAND_GAME_LEAVE:
+            if (player->id == room->owner)
+                _replay_close(replay, slot);
+            else
+                fuzzy_player_free(room->game, player);
+            break;
+        case FUZZY_COMMAND_PLAYER_STEP:
+        case FUZZY_COMMAND_PLAYER_MOVE:
+        case FUZZY_COMMAND_PLAYER_ATTACK:
+            fuzzy_game_play(room->game, player, record->type == FUZZY_COMMAND_PLAYER_ATTACK,
+              record->x, record->y, record->dx, record->dy);
+            replay->actions++;
+            break;
+        default:
+            replay->mismatches++;
+    }
+}
+
+void fuzzy_replay_finish(FuzzyReplay * replay)
+{
+    int slot;
+
+    for (slot = 0; slot < replay->rooms_size; slot++)
+        if (replay->rooms[slot])
+            _replay_close(replay, slot);
+    free(replay->rooms);
+    replay->rooms = NULL;
+    replay->rooms_size = 0;
+}
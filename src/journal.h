@@ -0,0 +1,145 @@
+/*
+ * Emanuele Faranda         black.silver@hotmail.it
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+/*
+    Append-only journal of the room commands.
+
+    RECORD: a command accepted by a room, with the room clock when it
+        happened: creation, joins, leaves, game start and the player actions
+        as they are played on the ticks. The records of a room are in order,
+        rooms of different threads interleave. Replaying them on a headless
+        game rebuilds the room states, see replay.c.
+    FORMAT: a header, then fixed size records, both in host byte order.
+        A record cut by a crash is ignored.
+    WRITER: producers fill batches of records and hand them over through
+        single producer, single consumer queues. A background thread writes
+        whatever is queued and syncs the file once for all of it, at most
+        every FUZZY_JOURNAL_SYNC_MS: a record is on disk within that time
+        plus a sync. Records are never dropped: a producer waits for a
+        writer which falls behind.
+    REPLAY: the records of each room are played again on a headless game
+        with the server rules, see fuzzy_game_play. The room clock moves to
+        each record before it is played. A digest of the final room states
+        tells whether two replays, or two builds, agree.
+ */
+
+#ifndef __FUZZY_JOURNAL_H
+#define __FUZZY_JOURNAL_H
+
+#include <pthread.h>
+#include "fuzzy.h"
+#include "network.h"
+#include "game.h"
+
+#define FUZZY_JOURNAL_MAGIC "FZJ1"
+#define FUZZY_JOURNAL_VERSION 1
+#define FUZZY_JOURNAL_BATCH 128                 // records handed over at once
+#define FUZZY_JOURNAL_QUEUE_SIZE 1024           // batches waiting for each producer
+#define FUZZY_JOURNAL_SYNC_MS 10                // group commit window
+
+typedef struct FuzzyJournalHeader {
+    char magic[4];
+    ubyte32 version;
+    ubyte32 tick_rate;                  // room clock ticks per second
+    ubyte32 record_size;
+} FuzzyJournalHeader;
+
+/* type is the command, see FUZZY_MESSAGE_TYPES: GAME_CREATE is the owner
+    joining the room it created, GAME_LEAVE of the owner closes the room */
+typedef struct FuzzyJournalRecord {
+    uint64_t steps;                     // room clock, in ticks since the game start
+    ubyte32 room;
+    ubyte8 type;
+    ubyte8 player;
+    ubyte16 reserved;
+    ubyte32 x;                          // player actions only
+    ubyte32 y;
+    int32_t dx;
+    int32_t dy;
+} FuzzyJournalRecord;
+
+typedef struct FuzzyJournalBatch {
+    int count;
+    FuzzyJournalRecord records[FUZZY_JOURNAL_BATCH];
+} FuzzyJournalBatch;
+
+typedef struct FuzzyJournalProducer {
+    FuzzyQueue queue;                   // FuzzyJournalBatch, to the writer
+    FuzzyJournalBatch * batch;          // being filled, NULL if empty
+} FuzzyJournalProducer;
+
+typedef struct FuzzyJournal {
+    int fd;
+    pthread_t thread;
+    int wakefd;                         // eventfd: batches queued or stop
+    bool signaled;                      // woken, the writer has not drained yet
+    bool running;
+    FuzzyJournalProducer * producers;
+    int producers_count;
+    ulong writes;                       // written by the writer only
+    ulong syncs;
+} FuzzyJournal;
+
+typedef struct FuzzyJournalMap {
+    void * base;
+    size_t size;
+    const FuzzyJournalHeader * header;
+    const FuzzyJournalRecord * records;
+    size_t count;                       // whole records
+} FuzzyJournalMap;
+
+typedef struct FuzzyReplayRoom {
+    ulong id;
+    FuzzyGame * game;
+    uint64_t steps;                     // room clock
+    bool started;
+    ubyte8 owner;                       // player
+} FuzzyReplayRoom;
+
+struct FuzzyReplay;
+typedef void (*FuzzyReplayClose)(struct FuzzyReplay * replay, FuzzyReplayRoom * room, void * data);
+
+typedef struct FuzzyReplay {
+    ubyte32 tick_rate;
+    FuzzyReplayRoom ** rooms;           // open rooms, by room id slot
+    int rooms_size;
+    ulong records;
+    ulong rooms_created;
+    ulong actions;
+    ulong mismatches;                   // records which do not fit the replayed state
+    uint64_t digest;                    // of the room states when they close, in order
+    FuzzyReplayClose on_close;          // can be NULL
+    void * close_data;
+} FuzzyReplay;
+
+// Appends to path, which is created if missing. Its clock must tick at tick_rate
+FuzzyJournal * fuzzy_journal_open(char * path, int producers, ubyte32 tick_rate);
+// Only called by the thread of the producer
+void fuzzy_journal_append(FuzzyJournal * journal, int producer, const FuzzyJournalRecord * record);
+// Hands the appended records to the writer
+void fuzzy_journal_flush(FuzzyJournal * journal, int producer);
+// Producers must be done: their last records are written and synced
+void fuzzy_journal_close(FuzzyJournal * journal);
+// Read only, false if path is not a journal
+bool fuzzy_journal_map(FuzzyJournalMap * map, char * path);
+void fuzzy_journal_unmap(FuzzyJournalMap * map);
+
+void fuzzy_replay_init(FuzzyReplay * replay, ubyte32 tick_rate);
+void fuzzy_replay_record(FuzzyReplay * replay, const FuzzyJournalRecord * record);
+// Closes the rooms still open, into the digest
+void fuzzy_replay_finish(FuzzyReplay * replay);
+
+#endif
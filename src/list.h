@@ -56,6 +56,7 @@ do{\
                 head = _c->_next;\
             else\
                 _p->_next = _c->_next;\
+            break;\
         }\
         _p = _c;\
         _c = _c->_next;\
@@ -0,0 +1,322 @@
+/*
+ * Emanuele Faranda         black.silver@hotmail.it
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Synthetic load for the server: many connections grouped in rooms, driven
+ * through the protocol calls. Each thread runs its groups in turn, one
+ * request at a time, and records the latency of every command.
+ *
+ * A group cycle: the owner creates a room, the others join it, the owner
+ * starts the game (a percentage of the times) and leaves, which closes the
+ * room. Some groups reconnect and authenticate again before the next cycle.
+ *
+ */
+
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include "fuzzy.h"
+#include "network.h"
+#include "protocol.h"
+
+typedef enum LOADGEN_COMMANDS {
+    LOADGEN_AUTH,
+    LOADGEN_CREATE,
+    LOADGEN_JOIN,
+    LOADGEN_START,
+    LOADGEN_LEAVE,
+    LOADGEN_COMMANDS_COUNT
+} LOADGEN_COMMANDS;
+
+static const char * CommandNames[LOADGEN_COMMANDS_COUNT] = {"auth", "create", "join", "start", "leave"};
+
+typedef struct LoadThread {
+    pthread_t thread;
+    int first;                          // first connection of the thread
+    int count;
+    ulong cycles;
+    uint seed;
+    FuzzyHistogram hists[LOADGEN_COMMANDS_COUNT];
+    ulong errors[LOADGEN_COMMANDS_COUNT];
+} LoadThread;
+
+/* options */
+static char * Host = FUZZY_DEFAULT_SERVER_ADDRESS;
+static int Port = FUZZY_DEFAULT_SERVER_PORT;
+static char * UnixPath = NULL;
+static FuzzyAddress Address;            // resolved once, from Host or UnixPath
+static char * Key = NULL;
+static int ThreadsCount = 4;
+static int ConnectionsCount = 1000;
+static int GroupSize = 4;               // one owner, the others join
+static int StartPercent = 100;
+static int ReconnectPercent = 0;
+static int Duration = 10;
+static bool ServerStats = false;
+
+static int * Sockets;
+static bool Running = true;
+
+static ulong _now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void _record(LoadThread * lt, LOADGEN_COMMANDS command, ulong start, bool ok)
+{
+    fuzzy_histogram_add(&lt->hists[command], _now_ns() - start);
+    if (! ok)
+        lt->errors[command]++;
+}
+
+/* connects and authenticates, the connection time is part of the latency */
+static void _login(LoadThread * lt, FuzzyMessage * msg, int conn)
+{
+    ulong start = _now_ns();
+    bool ok;
+
+    Sockets[conn] = fuzzy_server_connect_address(&Address);
+    fuzzy_message_clear(msg);
+    ok = fuzzy_protocol_authenticate(Sockets[conn], msg, Key);
+    _record(lt, LOADGEN_AUTH, start, ok);
+}
+
+/* reads a message the server sends on its own, like game start */
+static void _expect(FuzzyMessage * msg, int sock, FUZZY_MESSAGE_TYPES type)
+{
+    FuzzyCommand cmd;
+
+    if (! fuzzy_message_recv(sock, msg))
+        fuzzy_critical("Server closed the connection");
+    if (! fuzzy_protocol_decode_message(msg, &cmd) || cmd.type != type)
+        fuzzy_critical(fuzzy_sformat("Unexpected message, waiting for command %d", type));
+}
+
+static void _group_cycle(LoadThread * lt, FuzzyMessage * msg, int first)
+{
+    int owner = Sockets[first];
+    ulong start, roomid;
+    bool ok;
+    int i, joined = 0;
+
+    start = _now_ns();
+    fuzzy_message_clear(msg);
+    roomid = fuzzy_protocol_create_room(owner, msg, "loadgen");
+    _record(lt, LOADGEN_CREATE, start, roomid != 0);
+    if (roomid == 0)
+        return;
+
+    for (i = 1; i < GroupSize; i++) {
+        start = _now_ns();
+        fuzzy_message_clear(msg);
+        ok = fuzzy_protocol_join(Sockets[first + i], msg, roomid);
+        _record(lt, LOADGEN_JOIN, start, ok);
+        if (! ok)
+            break;
+        joined++;
+    }
+
+    if (rand_r(&lt->seed) % 100 < StartPercent) {
+        start = _now_ns();
+        fuzzy_message_clear(msg);
+        ok = fuzzy_protocol_game_start(owner, msg);
+        _record(lt, LOADGEN_START, start, ok);
+
+        /* everybody is told, owner included */
+        for (i = 0; ok && i <= joined; i++)
+            _expect(msg, Sockets[first + i], FUZZY_COMMAND_GAME_START);
+    }
+
+    start = _now_ns();
+    fuzzy_message_clear(msg);
+    ok = fuzzy_protocol_leave(owner, msg);
+    _record(lt, LOADGEN_LEAVE, start, ok);
+    for (i = 1; ok && i <= joined; i++)
+        _expect(msg, Sockets[first + i], FUZZY_COMMAND_GAME_LEAVE);
+
+    if (rand_r(&lt->seed) % 100 < ReconnectPercent) {
+        for (i = 0; i < GroupSize; i++) {
+            close(Sockets[first + i]);
+            _login(lt, msg, first + i);
+        }
+    }
+    lt->cycles++;
+}
+
+static void * _load_thread(void * args)
+{
+    LoadThread * lt = (LoadThread *) args;
+    FuzzyMessage * msg = fuzzy_message_new();
+    int i;
+
+    for (i = lt->first; i < lt->first + lt->count; i++)
+        _login(lt, msg, i);
+
+    while (__atomic_load_n(&Running, __ATOMIC_RELAXED))
+        for (i = lt->first; i < lt->first + lt->count && __atomic_load_n(&Running, __ATOMIC_RELAXED); i += GroupSize)
+            _group_cycle(lt, msg, i);
+
+    for (i = lt->first; i < lt->first + lt->count; i++)
+        close(Sockets[i]);
+    fuzzy_message_del(msg);
+    fuzzy_message_pool_clear();
+    return NULL;
+}
+
+static void _report(LoadThread * threads, double elapsed)
+{
+    FuzzyHistogram hist;
+    ulong cycles = 0, total = 0, errors;
+    int c, t;
+
+    printf("%-8s %10s %8s %10s %10s %10s %10s %10s\n", "command", "count", "errors", "ops/s", "p50 us", "p99 us", "p999 us", "max us");
+    for (c = 0; c < LOADGEN_COMMANDS_COUNT; c++) {
+        bzero(&hist, sizeof(hist));
+        errors = 0;
+        for (t = 0; t < ThreadsCount; t++) {
+            fuzzy_histogram_merge(&hist, &threads[t].hists[c]);
+            errors += threads[t].errors[c];
+        }
+        if (hist.count == 0)
+            continue;
+        total += hist.count;
+
+        printf("%-8s %10lu %8lu %10.0f %10.1f %10.1f %10.1f %10.1f\n", CommandNames[c], hist.count, errors,
+          hist.count / elapsed, fuzzy_histogram_percentile(&hist, 50) / 1e3, fuzzy_histogram_percentile(&hist, 99) / 1e3,
+          fuzzy_histogram_percentile(&hist, 99.9) / 1e3, hist.max / 1e3);
+    }
+    for (t = 0; t < ThreadsCount; t++)
+        cycles += threads[t].cycles;
+    printf("%lu commands in %.1f s: %.0f ops/s, %.0f rooms/s\n", total, elapsed, total / elapsed, cycles / elapsed);
+}
+
+/* the server side view: processing time, without the network */
+static void _report_server()
+{
+    FuzzyServerStats * stats = fuzzy_new(FuzzyServerStats);
+    FuzzyMessage * msg = fuzzy_message_new();
+    FuzzyCommandStats * cs;
+    int sock = fuzzy_server_connect_address(&Address);
+    ulong messages = 0;
+    int c;
+
+    fuzzy_message_clear(msg);
+    if (! fuzzy_protocol_authenticate(sock, msg, Key))
+        fuzzy_critical("Authentication failed");
+    fuzzy_message_clear(msg);
+    if (fuzzy_protocol_server_stats(sock, msg, stats)) {
+        printf("\nserver: %lu clients, %lu rooms, %lu decode errors, %lu timeouts\n", stats->clients, stats->rooms,
+          stats->decode_errors, stats->timeouts);
+        printf("%-13s %10s %12s %10s %12s %10s %10s %10s\n", "type", "msgs in", "bytes in", "msgs out", "bytes out", "p50 us", "p99 us", "max us");
+        for (c = 0; c < FUZZY_STATS_COMMANDS; c++) {
+            cs = &stats->commands[c];
+            if (cs->messages_in == 0 && cs->messages_out == 0)
+                continue;
+            messages += cs->messages_in + cs->messages_out;
+            printf("%-13s %10lu %12zu %10lu %12zu %10.1f %10.1f %10.1f\n", fuzzy_protocol_command_name(c), cs->messages_in, cs->bytes_in, cs->messages_out, cs->bytes_out,
+              fuzzy_histogram_percentile(&cs->latency, 50) / 1e3, fuzzy_histogram_percentile(&cs->latency, 99) / 1e3, cs->latency.max / 1e3);
+        }
+        /* the loop system calls for each stream message in or out */
+        printf("%lu syscalls, %.3f per message\n", stats->syscalls, messages ? (double) stats->syscalls / messages : 0.0);
+    }
+    close(sock);
+    fuzzy_message_del(msg);
+    free(stats);
+}
+
+/* thousands of connections need more descriptors than the usual soft limit */
+static void _raise_fd_limit(int needed)
+{
+    struct rlimit rl;
+
+    fuzzy_lz_perror(getrlimit(RLIMIT_NOFILE, &rl));
+    if (rl.rlim_cur >= (rlim_t)needed)
+        return;
+    rl.rlim_cur = fuzzy_min(rl.rlim_max, (rlim_t)needed);
+    fuzzy_lz_perror(setrlimit(RLIMIT_NOFILE, &rl));
+    if (rl.rlim_cur < (rlim_t)needed)
+        fuzzy_warning(fuzzy_sformat("Descriptors limited to %lu", (ulong)rl.rlim_cur));
+}
+
+static void _usage(char * prog)
+{
+    fprintf(stderr, "Usage: %s [-a address] [-p port] [-u unix_socket] [-t threads] [-c connections]\n"
+      "    [-g group_size] [-s start_percent] [-r reconnect_percent] [-d seconds] [-S] key\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char * argv[])
+{
+    LoadThread * threads;
+    ulong start;
+    int opt, t, groups;
+
+    while ((opt = getopt(argc, argv, "a:p:u:t:c:g:s:r:d:S")) != -1) {
+        switch (opt) {
+            case 'a': Host = optarg; break;
+            case 'p': Port = atoi(optarg); break;
+            case 'u': UnixPath = optarg; break;
+            case 't': ThreadsCount = atoi(optarg); break;
+            case 'c': ConnectionsCount = atoi(optarg); break;
+            case 'g': GroupSize = atoi(optarg); break;
+            case 's': StartPercent = atoi(optarg); break;
+            case 'r': ReconnectPercent = atoi(optarg); break;
+            case 'd': Duration = atoi(optarg); break;
+            case 'S': ServerStats = true; break;
+            default: _usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || ThreadsCount <= 0 || GroupSize <= 0 || Duration <= 0)
+        _usage(argv[0]);
+    Key = argv[optind];
+    if (UnixPath)
+        Host = fuzzy_sformat(FUZZY_UNIX_PREFIX "%s", UnixPath);
+    fuzzy_server_address(&Address, Host, Port);
+
+    /* whole groups, spread among the threads */
+    groups = ConnectionsCount / GroupSize;
+    if (groups < ThreadsCount)
+        fuzzy_critical("Not enough connections for a group on each thread");
+    ConnectionsCount = groups * GroupSize;
+    _raise_fd_limit(ConnectionsCount + 64);
+
+    Sockets = fuzzy_newarr(int, ConnectionsCount);
+    threads = fuzzy_newarr(LoadThread, ThreadsCount);
+    bzero(threads, sizeof(LoadThread) * ThreadsCount);
+    printf("%d connections in rooms of %d, %d threads, %d s\n", ConnectionsCount, GroupSize, ThreadsCount, Duration);
+
+    start = _now_ns();
+    for (t = 0; t < ThreadsCount; t++) {
+        threads[t].seed = t + 1;
+        threads[t].first = (groups * t / ThreadsCount) * GroupSize;
+        threads[t].count = (groups * (t+1) / ThreadsCount) * GroupSize - threads[t].first;
+        fuzzy_nz_rerror(pthread_create(&threads[t].thread, NULL, _load_thread, &threads[t]));
+    }
+    sleep(Duration);
+    __atomic_store_n(&Running, false, __ATOMIC_RELAXED);
+    for (t = 0; t < ThreadsCount; t++)
+        fuzzy_nz_rerror(pthread_join(threads[t].thread, NULL));
+
+    _report(threads, (_now_ns() - start) / 1e9);
+    if (ServerStats)
+        _report_server();
+    free(threads);
+    free(Sockets);
+    return EXIT_SUCCESS;
+}
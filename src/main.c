@@ -16,6 +16,7 @@
  */
 
 #include <stdio.h>
+#include <unistd.h>
 #include <pthread.h>
 #include <allegro5/allegro.h>
 #include <allegro5/allegro_image.h>
@@ -25,6 +26,7 @@
 #include "network.h"
 #include "protocol.h"
 #include "server.h"
+#include "netthread.h"
 #include "tiles.h"
 #include "gids.h"
 #include "game.h"
@@ -36,6 +38,7 @@
 #define WINDOW_TITLE "FUZZY Tales!"
 #define WINDOW_WIDTH 640
 #define WINDOW_HEIGHT 480
+#define FUZZY_EVENT_NET ALLEGRO_GET_EVENT_TYPE('F', 'U', 'Z', 'N')
 
 #define _attack_area_on() do {\
     if (!showing_area && focus) {\
@@ -51,22 +54,182 @@
     }\
 }while(0)
 
-static void _chess_move(FuzzyGame * game, FuzzyPlayer * player, FuzzyChess * focus, ulong x, ulong y)
+/* the room connection: the network thread, or a link to the server running
+    inside the game for a CPU match */
+typedef struct NetRoom {
+    FuzzyNetThread * nt;
+    FuzzyLocalLink * link;
+} NetRoom;
+
+/* runs on the network thread, or the server one for a CPU match. The event
+    is read by the main loop */
+static void _net_notify(void * data)
+{
+    ALLEGRO_EVENT event;
+
+    event.user.type = FUZZY_EVENT_NET;
+    al_emit_user_event((ALLEGRO_EVENT_SOURCE *) data, &event, NULL);
+}
+
+/* tells the room, room is NULL outside of a room */
+static void _net_action(NetRoom * room, FUZZY_MESSAGE_TYPES type, ulong x, ulong y, ulong tx, ulong ty)
+{
+    struct FuzzyCommandPlayer action;
+    FuzzyMessage * msg;
+    bool sent;
+
+    if (! room)
+        return;
+    action.x = x;
+    action.y = y;
+    action.dx = tx - x;
+    action.dy = ty - y;
+    msg = fuzzy_message_new();
+    fuzzy_protocol_push_player_action(msg, type, &action);
+    if (room->link)
+        sent = fuzzy_server_local_send(room->link, msg);
+    else
+        sent = fuzzy_netthread_send(room->nt, msg);
+    if (! sent) {
+        fuzzy_warning("Network queue full, action not sent");
+        fuzzy_message_del(msg);
+    }
+}
+
+static void _net_command(FuzzyMessage * msg)
+{
+    FuzzyCommand cmd;
+
+    if (! fuzzy_protocol_decode_message(msg, &cmd))
+        return;
+
+    switch (cmd.type) {
+    case FUZZY_COMMAND_GAME_START:
+        fuzzy_debug("Game started");
+        break;
+    case FUZZY_COMMAND_GAME_LEAVE:
+        fuzzy_debug("Room closed by its owner");
+        break;
+    case FUZZY_COMMAND_PLAYER_STEP:
+    case FUZZY_COMMAND_PLAYER_MOVE:
+    case FUZZY_COMMAND_PLAYER_ATTACK:
+        fuzzy_debug(fuzzy_sformat("Remote action %d on %lu,%lu", cmd.type, cmd.data.player.x, cmd.data.player.y));
+        break;
+    default:
+        break;
+    }
+}
+
+/* server messages queued by the network thread, or the local server frames
+    read in place */
+static void _net_receive(NetRoom * net)
+{
+    FuzzyMessage * msg, view;
+    FuzzyFrame * frame;
+
+    if (net->link) {
+        while ((frame = fuzzy_server_local_recv(net->link)) != NULL) {
+            fuzzy_frame_view(frame, &view);
+            _net_command(&view);
+            fuzzy_frame_unref(frame);
+        }
+        return;
+    }
+
+    while ((msg = fuzzy_netthread_recv(net->nt)) != NULL) {
+        _net_command(msg);
+        fuzzy_message_del(msg);
+    }
+}
+
+static bool _net_closed(NetRoom * net)
+{
+    if (net->link)
+        return fuzzy_server_local_closed(net->link);
+    return fuzzy_netthread_closed(net->nt);
+}
+
+/* takes msg and waits for the local server reply.
+    \retval TRUE the server replied FUZZY_NETCODE_OK */
+static bool _local_request(FuzzyLocalLink * link, FuzzyMessage * msg)
+{
+    FuzzyMessage view;
+    FuzzyFrame * frame;
+    bool ok;
+
+    if (! fuzzy_server_local_send(link, msg))
+        fuzzy_critical("Local server queue full");
+    while ((frame = fuzzy_server_local_recv(link)) == NULL) {
+        if (fuzzy_server_local_closed(link))
+            return false;
+        usleep(1000);
+    }
+    fuzzy_frame_view(frame, &view);
+    ok = fuzzy_message_pop8(&view) == FUZZY_NETCODE_OK;
+    fuzzy_frame_unref(frame);
+    return ok;
+}
+
+/* a CPU match needs no server around: one runs on its own thread and the
+    game reaches it through a local link. The room is started at once */
+static FuzzyLocalLink * _local_match(pthread_t * thread, ALLEGRO_EVENT_SOURCE * netevents)
+{
+    char srvkey[FUZZY_SERVERKEY_LEN];
+    FuzzyLocalLink * link;
+    FuzzyMessage * msg;
+    FuzzyCommand cmd;
+
+    fuzzy_server_create(0, srvkey);
+    link = fuzzy_server_local_connect(_net_notify, netevents);
+    fuzzy_nz_rerror(pthread_create(thread, NULL, fuzzy_server_loop, NULL));
+
+    bzero(&cmd, sizeof(cmd));
+    cmd.type = FUZZY_COMMAND_GAME_CREATE;
+    strcpy(cmd.data.room.name, "CPU match");
+    msg = fuzzy_message_new();
+    fuzzy_protocol_push_command(msg, &cmd, FUZZY_CAP_VARSTR);
+    if (! _local_request(link, msg))
+        fuzzy_critical("Cannot create the local room");
+
+    msg = fuzzy_message_new();
+    fuzzy_message_push8(msg, FUZZY_COMMAND_GAME_START);
+    if (! _local_request(link, msg))
+        fuzzy_critical("Cannot start the local game");
+    return link;
+}
+
+static void _local_match_end(FuzzyLocalLink * link, pthread_t thread)
+{
+    FuzzyMessage * msg = fuzzy_message_new();
+
+    fuzzy_message_push8(msg, FUZZY_COMMAND_SHUTDOWN);
+    if (! fuzzy_server_local_send(link, msg))
+        fuzzy_critical("Local server queue full");
+    fuzzy_nz_rerror(pthread_join(thread, NULL));
+    fuzzy_server_destroy();
+    fuzzy_server_local_close(link);
+}
+
+static void _chess_move(FuzzyGame * game, FuzzyPlayer * player, FuzzyChess * focus, NetRoom * room, ulong x, ulong y)
 {
     if (focus) {
         ulong ox = focus->x, oy = focus->y;
-        if (fuzzy_chess_local_move(game, player, focus, x, y))
+        if (fuzzy_chess_local_move(game, player, focus, x, y)) {
             fuzzy_sprite_move(game->map, FUZZY_LAYER_BELOW, ox, oy, x, y);
+            _net_action(room, FUZZY_COMMAND_PLAYER_MOVE, ox, oy, x, y);
+        }
     }
 }
 
-static void _aaa_menu(FuzzyGame * game, int svsock)
+/* true when the client is inside a room */
+static bool _aaa_menu(FuzzyGame * game, int svsock)
 {
     bool run = false;
     FuzzyMessage * msg = fuzzy_message_new();
     char srvkey[FUZZY_SERVERKEY_LEN];
     int choice;
     ulong roomid, myroom = 0;
+    bool joined = false;
 
     while(! run) {
         puts("*** O P T I O N S ***");
@@ -101,7 +264,7 @@ static void _aaa_menu(FuzzyGame * game, int svsock)
         case 3:
             printf("Room id: ");
             scanf("%lu", &roomid);
-            fuzzy_protocol_join(svsock, msg, roomid);
+            joined = fuzzy_protocol_join(svsock, msg, roomid);
             break;
         case 4:
             fuzzy_protocol_server_shutdown(svsock, msg);
@@ -113,6 +276,7 @@ static void _aaa_menu(FuzzyGame * game, int svsock)
     }
 
     fuzzy_message_del(msg);
+    return myroom || joined;
 }
 
 int main(int argc, char *argv[])
@@ -129,6 +293,11 @@ int main(int argc, char *argv[])
     float soul_interval = SOUL_TIME_INTERVAL;
     FuzzyPlayer *player, *cpu;
     FuzzyGame * game;
+    ALLEGRO_EVENT_SOURCE netevents;
+    NetRoom net, * room;
+    pthread_t server_thread;
+    bool local = false;
+    int opt;
 
 	bool running = true;
 	bool redraw = true;
@@ -138,6 +307,15 @@ int main(int argc, char *argv[])
 	int screen_height = WINDOW_HEIGHT;
     double curtime;
 
+    /* -l plays against the CPU without a server around */
+    while ((opt = getopt(argc, argv, "l")) != -1) {
+        if (opt != 'l') {
+            fprintf(stderr, "Usage: %s [-l]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        local = true;
+    }
+
 	/* Initialization */
     fuzzy_iz_error(al_init(), "Failed to initialize allegro");
     fuzzy_load_addon("image", al_init_image_addon());
@@ -194,11 +372,24 @@ int main(int argc, char *argv[])
     fps = FPS;
 #endif
     /* Server connection */
-    int svsock;
+    int svsock = -1;
     //~ FuzzyMessage * sendmsg = fuzzy_message_new();
-    svsock = fuzzy_server_connect(FUZZY_DEFAULT_SERVER_ADDRESS, FUZZY_DEFAULT_SERVER_PORT);
-
-    _aaa_menu(game, svsock);
+    bzero(&net, sizeof(net));
+    room = NULL;
+    al_init_user_event_source(&netevents);
+    al_register_event_source(evqueue, &netevents);
+    if (local) {
+        net.link = _local_match(&server_thread, &netevents);
+        room = &net;
+    } else {
+        svsock = fuzzy_server_connect(FUZZY_DEFAULT_SERVER_ADDRESS, FUZZY_DEFAULT_SERVER_PORT);
+
+        /* the lobby blocks, then the network thread owns the socket */
+        if (_aaa_menu(game, svsock)) {
+            net.nt = fuzzy_netthread_start(svsock, _net_notify, &netevents);
+            room = &net;
+        }
+    }
 
 	/* MAIN loop */
     player->soul_time = al_get_time();
@@ -211,13 +402,8 @@ int main(int argc, char *argv[])
         case ALLEGRO_EVENT_TIMER:
             /* check soul ticks */
             curtime = al_get_time();
-            while (curtime - player->soul_time >= soul_interval) {
-                //~ fuzzy_debug("Soul tick!");
-                player->soul_time += soul_interval;
-                player->soul_points += SOUL_POINTS_BOOST;
-
+            if (fuzzy_player_soul_update(player, curtime, soul_interval))
                 clock_ray = 1;
-            }
             clock_angle = (curtime - player->soul_time)/soul_interval * FUZZY_2PI;
             if (clock_ray) {
                 clock_ray = (curtime - player->soul_time)/RAY_TIME_INTERVAL * 50 + 40;
@@ -261,16 +447,16 @@ int main(int argc, char *argv[])
 
             switch(event.keyboard.keycode) {
                 case ALLEGRO_KEY_W:
-                    _chess_move(game, player, focus, focus->x, focus->y-1);
+                    _chess_move(game, player, focus, room, focus->x, focus->y-1);
                     break;
                 case ALLEGRO_KEY_A:
-                    _chess_move(game, player, focus, focus->x-1, focus->y);
+                    _chess_move(game, player, focus, room, focus->x-1, focus->y);
                     break;
                 case ALLEGRO_KEY_S:
-                    _chess_move(game, player, focus, focus->x, focus->y+1);
+                    _chess_move(game, player, focus, room, focus->x, focus->y+1);
                     break;
                 case ALLEGRO_KEY_D:
-                    _chess_move(game, player, focus, focus->x+1, focus->y);
+                    _chess_move(game, player, focus, room, focus->x+1, focus->y);
                     break;
 
                 case ALLEGRO_KEY_K:
@@ -287,6 +473,13 @@ int main(int argc, char *argv[])
                     break;
             }
             break;
+        case FUZZY_EVENT_NET:
+            _net_receive(&net);
+            if (_net_closed(&net)) {
+                fuzzy_warning("Server connection lost");
+                room = NULL;
+            }
+            break;
         case ALLEGRO_EVENT_DISPLAY_CLOSE:
             running = false;
             break;
@@ -307,8 +500,10 @@ int main(int argc, char *argv[])
                 if(showing_area && fuzzy_chess_inside_target_area(game, focus, tx, ty)) {
                     /* select attack target */
                     if (fuzzy_map_spy(game->map, FUZZY_LAYER_SPRITES, tx, ty) == FUZZY_CELL_SPRITE) {
-                        if (fuzzy_chess_local_attack(game, player, focus, tx, ty))
+                        if (fuzzy_chess_local_attack(game, player, focus, tx, ty)) {
+                            _net_action(room, FUZZY_COMMAND_PLAYER_ATTACK, focus->x, focus->y, tx, ty);
                             _attack_area_off();
+                        }
                     }
                 } else {
                     /* select chess */
@@ -407,6 +602,13 @@ int main(int argc, char *argv[])
     //~ char srvkey[FUZZY_SERVERKEY_LEN];
     //~ fuzzy_protocol_server_shutdown(svsock, sendmsg, srvkey);
     //~ fuzzy_message_del(sendmsg);
+    if (net.nt)
+        fuzzy_netthread_stop(net.nt);
+    if (net.link)
+        _local_match_end(net.link, server_thread);
+    al_destroy_user_event_source(&netevents);
+    if (svsock >= 0)
+        close(svsock);
     fuzzy_game_free(game);
 
     al_destroy_event_queue(evqueue);
@@ -0,0 +1,229 @@
+/*
+ * Emanuele Faranda         black.silver@hotmail.it
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include "fuzzy.h"
+#include "network.h"
+#include "protocol.h"
+#include "netthread.h"
+
+static ulong _netthread_clock()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+/* tells the game, once until it drains the queue. The fence orders the queue
+    push before reading the flag, see fuzzy_netthread_recv */
+static void _netthread_notify(FuzzyNetThread * nt)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (! __atomic_exchange_n(&nt->signaled, true, __ATOMIC_SEQ_CST))
+        nt->notify(nt->notify_data);
+}
+
+static void _netthread_send_queued(FuzzyNetThread * nt)
+{
+    FuzzyMessage * msg;
+    uint64_t count;
+
+    if (read(nt->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        fuzzy_critical(fuzzy_strerror(errno));
+
+    while ((msg = (FuzzyMessage *) fuzzy_queue_pop(&nt->out)) != NULL) {
+        fuzzy_message_send(nt->socket, msg);
+        fuzzy_message_del(msg);
+        nt->sent_ms = _netthread_clock();
+    }
+}
+
+static void _netthread_ping(FuzzyNetThread * nt)
+{
+    FuzzyMessage * msg = fuzzy_message_new();
+
+    fuzzy_message_push8(msg, FUZZY_COMMAND_PING);
+    fuzzy_message_send(nt->socket, msg);
+    fuzzy_message_del(msg);
+    nt->sent_ms = _netthread_clock();
+}
+
+/* moves the complete messages to the game. False when the queue is full */
+static bool _netthread_extract(FuzzyNetThread * nt)
+{
+    FUZZY_FRAME_STATUS frame;
+    int count = 0;
+
+    while (true) {
+        if (nt->held == NULL) {
+            nt->held = fuzzy_message_new();
+            frame = fuzzy_message_extract(&nt->inbuf, nt->held);
+            if (frame == FUZZY_FRAME_INVALID)
+                __atomic_store_n(&nt->closed, true, __ATOMIC_RELAXED);
+            if (frame != FUZZY_FRAME_READY) {
+                fuzzy_message_del(nt->held);
+                nt->held = NULL;
+                break;
+            }
+            /* echo of a keepalive, not for the game */
+            if (nt->held->cursor == 1 && nt->held->buffer[0] == FUZZY_COMMAND_PING) {
+                fuzzy_message_del(nt->held);
+                nt->held = NULL;
+                continue;
+            }
+        }
+        if (! fuzzy_queue_push(&nt->in, nt->held))
+            break;
+        nt->held = NULL;
+        count++;
+    }
+
+    if (count)
+        _netthread_notify(nt);
+    return nt->held == NULL;
+}
+
+static void * _netthread_loop(void * args)
+{
+    FuzzyNetThread * nt = (FuzzyNetThread *) args;
+    struct pollfd pfds[2];
+    long wait;
+    ulong now;
+    int rv;
+
+    pfds[0].events = POLLIN;
+    pfds[1].fd = nt->wakefd;
+    pfds[1].events = POLLIN;
+    nt->sent_ms = nt->heard_ms = _netthread_clock();
+
+    while (__atomic_load_n(&nt->running, __ATOMIC_RELAXED) && ! __atomic_load_n(&nt->closed, __ATOMIC_RELAXED)) {
+        /* a full in queue stops the reads until the game catches up */
+        pfds[0].fd = nt->held ? -1 : nt->socket;
+        wait = fuzzy_max((long)(nt->sent_ms + FUZZY_NETTHREAD_PING_INTERVAL - _netthread_clock()), 0L);
+        do {
+            rv = poll(pfds, 2, nt->held ? 10 : wait);
+        } while (rv < 0 && errno == EINTR);
+        fuzzy_lz_perror(rv);
+
+        if (pfds[1].revents & POLLIN)
+            _netthread_send_queued(nt);
+        if (nt->held && ! _netthread_extract(nt))
+            continue;
+
+        if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            /* the socket is readable, a single read does not block */
+            if (fuzzy_ring_recv(nt->socket, &nt->inbuf) == FUZZY_RECV_CLOSED)
+                __atomic_store_n(&nt->closed, true, __ATOMIC_RELAXED);
+            nt->heard_ms = _netthread_clock();
+            _netthread_extract(nt);
+        }
+
+        /* the socket is not read while held, silence would be ours */
+        now = _netthread_clock();
+        if (! nt->held && now - nt->heard_ms >= FUZZY_NETTHREAD_TIMEOUT) {
+            fuzzy_warning("Server silent, giving up");
+            __atomic_store_n(&nt->closed, true, __ATOMIC_RELAXED);
+        } else if (now - nt->sent_ms >= FUZZY_NETTHREAD_PING_INTERVAL) {
+            _netthread_ping(nt);
+        }
+    }
+
+    if (__atomic_load_n(&nt->closed, __ATOMIC_RELAXED)) {
+        /* even if the game did not drain yet */
+        fuzzy_debug("Server connection closed");
+        nt->notify(nt->notify_data);
+    }
+    fuzzy_message_pool_clear();
+    return NULL;
+}
+
+FuzzyNetThread * fuzzy_netthread_start(int svsock, FuzzyNetNotify notify, void * data)
+{
+    FuzzyNetThread * nt = fuzzy_new(FuzzyNetThread);
+
+    bzero(nt, sizeof(FuzzyNetThread));
+    nt->socket = svsock;
+    nt->notify = notify;
+    nt->notify_data = data;
+    nt->running = true;
+    fuzzy_lz_perror(nt->wakefd = eventfd(0, EFD_NONBLOCK));
+    fuzzy_queue_init(&nt->in, FUZZY_NETTHREAD_QUEUE_SIZE);
+    fuzzy_queue_init(&nt->out, FUZZY_NETTHREAD_QUEUE_SIZE);
+    fuzzy_ring_init(&nt->inbuf, FUZZY_RING_DEFAULT_SIZE);
+    nt->inbuf.inflate = (fuzzy_protocol_peer_caps(svsock) & FUZZY_CAP_DEFLATE) != 0;
+    fuzzy_nz_rerror(pthread_create(&nt->thread, NULL, _netthread_loop, nt));
+    return nt;
+}
+
+static void _netthread_wake(FuzzyNetThread * nt)
+{
+    uint64_t one = 1;
+
+    fuzzy_lz_perror(write(nt->wakefd, &one, sizeof(one)));
+}
+
+void fuzzy_netthread_stop(FuzzyNetThread * nt)
+{
+    FuzzyMessage * msg;
+
+    __atomic_store_n(&nt->running, false, __ATOMIC_RELAXED);
+    _netthread_wake(nt);
+    fuzzy_nz_rerror(pthread_join(nt->thread, NULL));
+
+    while ((msg = (FuzzyMessage *) fuzzy_queue_pop(&nt->in)) != NULL)
+        fuzzy_message_del(msg);
+    while ((msg = (FuzzyMessage *) fuzzy_queue_pop(&nt->out)) != NULL)
+        fuzzy_message_del(msg);
+    if (nt->held)
+        fuzzy_message_del(nt->held);
+    fuzzy_queue_free(&nt->in);
+    fuzzy_queue_free(&nt->out);
+    fuzzy_ring_free(&nt->inbuf);
+    close(nt->wakefd);
+    free(nt);
+}
+
+bool fuzzy_netthread_send(FuzzyNetThread * nt, FuzzyMessage * msg)
+{
+    if (! fuzzy_queue_push(&nt->out, msg))
+        return false;
+    _netthread_wake(nt);
+    return true;
+}
+
+/* on an empty queue the flag is cleared, then the queue checked again: a
+    message pushed meanwhile is either returned here or notified again */
+FuzzyMessage * fuzzy_netthread_recv(FuzzyNetThread * nt)
+{
+    FuzzyMessage * msg;
+
+    if ((msg = (FuzzyMessage *) fuzzy_queue_pop(&nt->in)) != NULL)
+        return msg;
+
+    __atomic_store_n(&nt->signaled, false, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return (FuzzyMessage *) fuzzy_queue_pop(&nt->in);
+}
+
+bool fuzzy_netthread_closed(FuzzyNetThread * nt)
+{
+    return __atomic_load_n(&nt->closed, __ATOMIC_RELAXED);
+}
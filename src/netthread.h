@@ -0,0 +1,77 @@
+/*
+ * Emanuele Faranda         black.silver@hotmail.it
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+    Client network thread.
+
+    The thread owns the server socket: it sends the messages queued by the
+    game and queues the messages it reads, so the render loop never waits
+    for the network. Both queues are single producer, single consumer.
+    Messages change owner with the queue: the game allocates the ones it
+    sends and frees the ones it gets.
+
+    NOTIFY: called from the network thread when messages are ready and the
+        previous notification has not been seen yet, meaning the game has not
+        called fuzzy_netthread_recv until it returned NULL. A game loop emits
+        an event from it, like an Allegro user event.
+
+    KEEPALIVE: the thread pings the server when the game sent nothing for
+        FUZZY_NETTHREAD_PING_INTERVAL, so it is not closed for being idle, and
+        takes the echoes itself. A server silent for FUZZY_NETTHREAD_TIMEOUT
+        is considered gone.
+ */
+
+#ifndef __FUZZY_NETTHREAD_H
+#define __FUZZY_NETTHREAD_H
+
+#include <pthread.h>
+#include "fuzzy.h"
+#include "network.h"
+
+#define FUZZY_NETTHREAD_QUEUE_SIZE 256
+#define FUZZY_NETTHREAD_PING_INTERVAL 10000     // ms
+#define FUZZY_NETTHREAD_TIMEOUT 30000           // ms
+
+typedef void (*FuzzyNetNotify)(void * data);
+
+typedef struct FuzzyNetThread {
+    pthread_t thread;
+    int socket;
+    int wakefd;                         // eventfd: messages to send or stop
+    FuzzyQueue in;                      // to the game
+    FuzzyQueue out;                     // from the game
+    FuzzyRingBuffer inbuf;
+    FuzzyMessage * held;                // read while the in queue was full
+    FuzzyNetNotify notify;
+    void * notify_data;
+    ulong sent_ms;                      // monotonic clock of the last message sent
+    ulong heard_ms;                     // monotonic clock of the last data received
+    bool signaled;                      // notified, the game has not drained yet
+    bool running;
+    bool closed;                        // connection closed or broken
+} FuzzyNetThread;
+
+FuzzyNetThread * fuzzy_netthread_start(int svsock, FuzzyNetNotify notify, void * data);
+// Joins the thread, the socket is left open
+void fuzzy_netthread_stop(FuzzyNetThread * nt);
+// Takes msg, false if the queue is full and msg is still owned by the caller
+bool fuzzy_netthread_send(FuzzyNetThread * nt, FuzzyMessage * msg);
+// Next server message or NULL, to be freed by the caller
+FuzzyMessage * fuzzy_netthread_recv(FuzzyNetThread * nt);
+bool fuzzy_netthread_closed(FuzzyNetThread * nt);
+
+#endif
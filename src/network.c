@@ -18,20 +18,123 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/time.h>
+#include <poll.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
+#include <zlib.h>
 #include "network.h"
 #include "fuzzy.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+    #define FUZZY_X86_SIMD
+    #include <immintrin.h>
+#endif
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    #define FUZZY_BIG_ENDIAN
+#endif
+
+/* free list node, stored inside the cached buffer */
+typedef struct _PoolBuffer {
+    struct _PoolBuffer * _next;
+}_PoolBuffer;
+
+typedef struct _MessagePool {
+    _PoolBuffer * buffers[FUZZY_POOL_CLASSES];
+    uint cached[FUZZY_POOL_CLASSES];
+    FuzzyMessage * messages;            // linked through their buffer field
+    uint nmessages;
+    FuzzyPoolStats stats;
+}_MessagePool;
+
+static __thread _MessagePool Pool;
+
+/* deflated payloads, the streams are reset for each message */
+typedef struct _ZStreams {
+    z_stream deflate;
+    z_stream inflate;
+    bool deflate_ready;
+    bool inflate_ready;
+    FuzzyMessage * scratch;             // compressed payload
+}_ZStreams;
+
+static __thread _ZStreams ZStreams;
+
+/* real block size for a request: next size class, or exact when too big */
+static size_t _fuzzy_pool_fit(size_t size)
+{
+    size_t fit = 1 << FUZZY_POOL_MIN_SHIFT;
+
+    if (size > (1 << FUZZY_POOL_MAX_SHIFT))
+        return size;
+    while (fit < size)
+        fit <<= 1;
+    return fit;
+}
+
+static int _fuzzy_pool_class(size_t fit)
+{
+    int cls = 0;
+
+    if (fit > (1 << FUZZY_POOL_MAX_SHIFT) || (fit & (fit-1)))
+        return -1;
+    while (((size_t)1 << (cls + FUZZY_POOL_MIN_SHIFT)) < fit)
+        cls++;
+    return cls;
+}
+
+/* get a block of _fuzzy_pool_fit(size) bytes */
+static void * _fuzzy_pool_get(size_t size)
+{
+    size_t fit = _fuzzy_pool_fit(size);
+    int cls = _fuzzy_pool_class(fit);
+    _PoolBuffer * buf;
+
+    if (cls >= 0 && (buf = Pool.buffers[cls]) != NULL) {
+        Pool.buffers[cls] = buf->_next;
+        Pool.cached[cls]--;
+        Pool.stats.cached_bytes -= fit;
+        Pool.stats.hits++;
+        return buf;
+    }
+
+    Pool.stats.misses++;
+    return fuzzy_alloc(fit);
+}
+
+/* give back a block obtained with a request of size bytes */
+static void _fuzzy_pool_put(void * ptr, size_t size)
+{
+    size_t fit = _fuzzy_pool_fit(size);
+    int cls = _fuzzy_pool_class(fit);
+    _PoolBuffer * buf = ptr;
+
+    if (cls < 0 || Pool.cached[cls] >= FUZZY_POOL_MAX_CACHED) {
+        free(ptr);
+        return;
+    }
+
+    buf->_next = Pool.buffers[cls];
+    Pool.buffers[cls] = buf;
+    Pool.cached[cls]++;
+    Pool.stats.cached_bytes += fit;
+}
+
 static FuzzyMessage * _fuzzy_message_allocate(ssize_t buflen)
 {
     FuzzyMessage * msg;
 
-    fuzzy_iz_perror(msg = (FuzzyMessage *) malloc(sizeof(FuzzyMessage)));
-    fuzzy_iz_perror(msg->buffer = (ubyte8 *) malloc(buflen));
-    msg->buflen = buflen;
+    if ((msg = Pool.messages) != NULL) {
+        Pool.messages = (FuzzyMessage *) msg->buffer;
+        Pool.nmessages--;
+    } else {
+        msg = fuzzy_new(FuzzyMessage);
+    }
+
+    msg->buffer = _fuzzy_pool_get(buflen);
+    msg->buflen = _fuzzy_pool_fit(buflen);
     msg->cursor = 0;
     return msg;
 }
@@ -48,11 +151,11 @@ static void _fuzzy_message_expand(FuzzyMessage * msg, ssize_t nbuflen)
     if (msg->cursor > nbuflen)
         fuzzy_critical(fuzzy_sformat("Cursor %d bytes outside valid area", msg->cursor-nbuflen));
 
-    fuzzy_iz_perror(newbuf = (ubyte8 *) malloc(nbuflen));
+    newbuf = _fuzzy_pool_get(nbuflen);
     memcpy(newbuf, msg->buffer, msg->cursor);
-    free(msg->buffer);
+    _fuzzy_pool_put(msg->buffer, msg->buflen);
     msg->buffer = newbuf;
-    msg->buflen = nbuflen;
+    msg->buflen = _fuzzy_pool_fit(nbuflen);
 }
 
 FuzzyMessage * fuzzy_message_new()
@@ -62,14 +165,291 @@ FuzzyMessage * fuzzy_message_new()
 
 void fuzzy_message_del(FuzzyMessage * msg)
 {
-    free(msg->buffer);
-    free(msg);
+    _fuzzy_pool_put(msg->buffer, msg->buflen);
+
+    if (Pool.nmessages >= FUZZY_POOL_MAX_CACHED) {
+        free(msg);
+        return;
+    }
+    msg->buffer = (ubyte8 *) Pool.messages;
+    Pool.messages = msg;
+    Pool.nmessages++;
+}
+
+/* ensure space for len more bytes, growing geometrically */
+void fuzzy_message_reserve(FuzzyMessage * msg, ssize_t len)
+{
+    if (msg->buflen - msg->cursor >= len)
+        return;
+
+    _fuzzy_message_expand(msg, fuzzy_max(msg->buflen * 2, msg->cursor + len));
+}
+
+void fuzzy_message_pool_stats(FuzzyPoolStats * stats)
+{
+    *stats = Pool.stats;
+}
+
+static FuzzyMessage * _fuzzy_z_scratch(ssize_t len)
+{
+    if (ZStreams.scratch == NULL)
+        ZStreams.scratch = fuzzy_message_new();
+    ZStreams.scratch->cursor = 0;
+    fuzzy_message_reserve(ZStreams.scratch, len);
+    return ZStreams.scratch;
+}
+
+/* deflates msg into the scratch message: inflated size, then raw deflate data.
+    \retval FALSE not worth it, msg is too small or does not shrink */
+static bool _fuzzy_deflate(FuzzyMessage * msg)
+{
+    z_stream * zs = &ZStreams.deflate;
+    FuzzyMessage * out;
+    ubyte32 header;
+    uLong bound;
+
+    if (msg->cursor < FUZZY_COMPRESS_MIN_SIZE)
+        return false;
+
+    if (! ZStreams.deflate_ready) {
+        bzero(zs, sizeof(z_stream));
+        if (deflateInit2(zs, FUZZY_COMPRESS_LEVEL, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            fuzzy_critical("Cannot initialize deflate");
+        ZStreams.deflate_ready = true;
+    } else {
+        deflateReset(zs);
+    }
+
+    bound = deflateBound(zs, msg->cursor);
+    out = _fuzzy_z_scratch(FUZZY_FRAME_HEADER_SIZE + bound);
+    header = htonl((ubyte32)msg->cursor);
+    memcpy(out->buffer, &header, FUZZY_FRAME_HEADER_SIZE);
+
+    zs->next_in = msg->buffer;
+    zs->avail_in = msg->cursor;
+    zs->next_out = &out->buffer[FUZZY_FRAME_HEADER_SIZE];
+    zs->avail_out = bound;
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END)
+        fuzzy_critical("Deflate failed");
+
+    out->cursor = FUZZY_FRAME_HEADER_SIZE + bound - zs->avail_out;
+    return out->cursor < msg->cursor;
+}
+
+/* inflates the scratch message into msg.
+    \retval FALSE corrupted payload */
+static bool _fuzzy_inflate(FuzzyMessage * msg)
+{
+    z_stream * zs = &ZStreams.inflate;
+    FuzzyMessage * in = ZStreams.scratch;
+    ubyte32 len;
+
+    if (in->cursor < FUZZY_FRAME_HEADER_SIZE)
+        return false;
+    memcpy(&len, in->buffer, FUZZY_FRAME_HEADER_SIZE);
+    len = ntohl(len);
+    if (len > FUZZY_MESSAGE_MAX_SIZE)
+        return false;
+    /* a tiny payload cannot claim a huge inflated size */
+    if (len > (in->cursor - FUZZY_FRAME_HEADER_SIZE) * FUZZY_INFLATE_MAX_RATIO)
+        return false;
+
+    if (! ZStreams.inflate_ready) {
+        bzero(zs, sizeof(z_stream));
+        if (inflateInit2(zs, -MAX_WBITS) != Z_OK)
+            fuzzy_critical("Cannot initialize inflate");
+        ZStreams.inflate_ready = true;
+    } else {
+        inflateReset(zs);
+    }
+
+    msg->cursor = 0;
+    fuzzy_message_reserve(msg, len);
+    zs->next_in = &in->buffer[FUZZY_FRAME_HEADER_SIZE];
+    zs->avail_in = in->cursor - FUZZY_FRAME_HEADER_SIZE;
+    zs->next_out = msg->buffer;
+    zs->avail_out = len;
+    if (inflate(zs, Z_FINISH) != Z_STREAM_END || zs->avail_out != 0 || zs->avail_in != 0)
+        return false;
+
+    msg->cursor = len;
+    return true;
+}
+
+/* release any cached buffer of the calling thread */
+void fuzzy_message_pool_clear()
+{
+    FuzzyMessage * msg;
+    _PoolBuffer * buf;
+    int i;
+
+    /* zlib streams first, their scratch goes back to the pool */
+    if (ZStreams.deflate_ready)
+        deflateEnd(&ZStreams.deflate);
+    if (ZStreams.inflate_ready)
+        inflateEnd(&ZStreams.inflate);
+    if (ZStreams.scratch)
+        fuzzy_message_del(ZStreams.scratch);
+    bzero(&ZStreams, sizeof(_ZStreams));
+
+    for (i = 0; i < FUZZY_POOL_CLASSES; i++) {
+        while ((buf = Pool.buffers[i]) != NULL) {
+            Pool.buffers[i] = buf->_next;
+            free(buf);
+        }
+        Pool.cached[i] = 0;
+    }
+    while ((msg = Pool.messages) != NULL) {
+        Pool.messages = (FuzzyMessage *) msg->buffer;
+        free(msg);
+    }
+    Pool.nmessages = 0;
+    Pool.stats.cached_bytes = 0;
+}
+
+/* Block byte swapping kernels: dst and src hold n elements, any alignment */
+typedef void (*_bswap_kernel)(void * dst, const void * src, size_t n);
+
+static void _fuzzy_bswap16_scalar(void * dst, const void * src, size_t n)
+{
+    const ubyte8 * s = src;
+    ubyte8 * d = dst;
+    ubyte16 v;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        memcpy(&v, &s[i*2], 2);
+#ifndef FUZZY_BIG_ENDIAN
+        v = __builtin_bswap16(v);
+#endif
+        memcpy(&d[i*2], &v, 2);
+    }
+}
+
+static void _fuzzy_bswap32_scalar(void * dst, const void * src, size_t n)
+{
+    const ubyte8 * s = src;
+    ubyte8 * d = dst;
+    ubyte32 v;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        memcpy(&v, &s[i*4], 4);
+#ifndef FUZZY_BIG_ENDIAN
+        v = __builtin_bswap32(v);
+#endif
+        memcpy(&d[i*4], &v, 4);
+    }
+}
+
+#ifdef FUZZY_X86_SIMD
+__attribute__((target("sse2")))
+static void _fuzzy_bswap16_sse2(void * dst, const void * src, size_t n)
+{
+    const ubyte8 * s = src;
+    ubyte8 * d = dst;
+    __m128i v;
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        v = _mm_loadu_si128((const __m128i *) &s[i*2]);
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *) &d[i*2], v);
+    }
+    _fuzzy_bswap16_scalar(&d[i*2], &s[i*2], n - i);
+}
+
+__attribute__((target("sse2")))
+static void _fuzzy_bswap32_sse2(void * dst, const void * src, size_t n)
+{
+    const ubyte8 * s = src;
+    ubyte8 * d = dst;
+    __m128i v;
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        v = _mm_loadu_si128((const __m128i *) &s[i*4]);
+        /* swap the 16 bit halves, then the bytes inside them */
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *) &d[i*4], v);
+    }
+    _fuzzy_bswap32_scalar(&d[i*4], &s[i*4], n - i);
+}
+
+__attribute__((target("avx2")))
+static void _fuzzy_bswap16_avx2(void * dst, const void * src, size_t n)
+{
+    const ubyte8 * s = src;
+    ubyte8 * d = dst;
+    const __m256i mask = _mm256_setr_epi8(
+        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    __m256i v;
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        v = _mm256_loadu_si256((const __m256i *) &s[i*2]);
+        _mm256_storeu_si256((__m256i *) &d[i*2], _mm256_shuffle_epi8(v, mask));
+    }
+    _fuzzy_bswap16_sse2(&d[i*2], &s[i*2], n - i);
+}
+
+__attribute__((target("avx2")))
+static void _fuzzy_bswap32_avx2(void * dst, const void * src, size_t n)
+{
+    const ubyte8 * s = src;
+    ubyte8 * d = dst;
+    const __m256i mask = _mm256_setr_epi8(
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256i v;
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        v = _mm256_loadu_si256((const __m256i *) &s[i*4]);
+        _mm256_storeu_si256((__m256i *) &d[i*4], _mm256_shuffle_epi8(v, mask));
+    }
+    _fuzzy_bswap32_sse2(&d[i*4], &s[i*4], n - i);
+}
+#endif
+
+static _bswap_kernel Bswap16 = NULL;
+static _bswap_kernel Bswap32 = NULL;
+static FUZZY_SIMD_LEVEL SimdLevel;
+
+/* picks the best kernels supported by both the cpu and the limit */
+FUZZY_SIMD_LEVEL fuzzy_message_simd_limit(FUZZY_SIMD_LEVEL limit)
+{
+    Bswap16 = _fuzzy_bswap16_scalar;
+    Bswap32 = _fuzzy_bswap32_scalar;
+    SimdLevel = FUZZY_SIMD_NONE;
+
+#if defined(FUZZY_X86_SIMD) && ! defined(FUZZY_BIG_ENDIAN)
+    __builtin_cpu_init();
+    if (limit >= FUZZY_SIMD_AVX2 && __builtin_cpu_supports("avx2")) {
+        Bswap16 = _fuzzy_bswap16_avx2;
+        Bswap32 = _fuzzy_bswap32_avx2;
+        SimdLevel = FUZZY_SIMD_AVX2;
+    } else if (limit >= FUZZY_SIMD_SSE2 && __builtin_cpu_supports("sse2")) {
+        Bswap16 = _fuzzy_bswap16_sse2;
+        Bswap32 = _fuzzy_bswap32_sse2;
+        SimdLevel = FUZZY_SIMD_SSE2;
+    }
+#endif
+    return SimdLevel;
+}
+
+static void _fuzzy_simd_init()
+{
+    if (Bswap16 == NULL)
+        fuzzy_message_simd_limit(FUZZY_SIMD_AVX2);
 }
 
 void fuzzy_message_push8(FuzzyMessage * msg, ubyte8 data)
 {
-    if ((msg->buflen - msg->cursor) < 1)
-        _fuzzy_message_expand(msg, fuzzy_max(msg->buflen * 2, 1));
+    fuzzy_message_reserve(msg, 1);
 
     msg->buffer[msg->cursor] = data;
     msg->cursor++;
@@ -77,9 +457,9 @@ void fuzzy_message_push8(FuzzyMessage * msg, ubyte8 data)
 
 void fuzzy_message_push16(FuzzyMessage * msg, ubyte16 data)
 {
-    if ((msg->buflen - msg->cursor) < 2)
-        _fuzzy_message_expand(msg, fuzzy_max(msg->buflen*2, 2));
+    fuzzy_message_reserve(msg, 2);
 
+    /* protocol version 1 layout, arrays use true network order */
     data = htons(data);
     msg->buffer[msg->cursor+0] = data >> 8;
     msg->buffer[msg->cursor+1] = data >> 0;
@@ -88,8 +468,7 @@ void fuzzy_message_push16(FuzzyMessage * msg, ubyte16 data)
 
 void fuzzy_message_push32(FuzzyMessage * msg, ubyte32 data)
 {
-    if ((msg->buflen - msg->cursor) < 4)
-        _fuzzy_message_expand(msg, fuzzy_max(msg->buflen*2, 4));
+    fuzzy_message_reserve(msg, 4);
 
     data = htonl(data);
     msg->buffer[msg->cursor+0] = data >> 24;
@@ -99,12 +478,28 @@ void fuzzy_message_push32(FuzzyMessage * msg, ubyte32 data)
     msg->cursor += 4;
 }
 
+/* n values, in network order. A single capacity check for the whole block */
+void fuzzy_message_push16_array(FuzzyMessage * msg, const ubyte16 * data, size_t n)
+{
+    _fuzzy_simd_init();
+    fuzzy_message_reserve(msg, n * 2);
+    Bswap16(&msg->buffer[msg->cursor], data, n);
+    msg->cursor += n * 2;
+}
+
+void fuzzy_message_push32_array(FuzzyMessage * msg, const ubyte32 * data, size_t n)
+{
+    _fuzzy_simd_init();
+    fuzzy_message_reserve(msg, n * 4);
+    Bswap32(&msg->buffer[msg->cursor], data, n);
+    msg->cursor += n * 4;
+}
+
 void fuzzy_message_pushstr(FuzzyMessage * msg, const char * data, ssize_t len)
 {
     ssize_t slen;
 
-    if((msg->buflen - msg->cursor) < len)
-        _fuzzy_message_expand(msg, len + msg->cursor);
+    fuzzy_message_reserve(msg, len);
 
     slen = strnlen(data, len);
     memcpy(&msg->buffer[msg->cursor], data, slen);
@@ -114,6 +509,119 @@ void fuzzy_message_pushstr(FuzzyMessage * msg, const char * data, ssize_t len)
     msg->cursor += len;
 }
 
+/* LEB128 encoding, bytes are stacked so that pops read the lowest group first */
+void fuzzy_message_pushvar(FuzzyMessage * msg, ubyte32 data)
+{
+    ssize_t n = 1;
+    ubyte32 v;
+    ssize_t i;
+
+    for (v = data >> 7; v; v >>= 7)
+        n++;
+    fuzzy_message_reserve(msg, n);
+
+    for (i = 1; i <= n; i++) {
+        msg->buffer[msg->cursor + n - i] = (data & 0x7f) | (i < n ? 0x80 : 0);
+        data >>= 7;
+    }
+    msg->cursor += n;
+}
+
+/* same encoding, for counters which can outgrow 32 bits */
+void fuzzy_message_pushvar64(FuzzyMessage * msg, uint64_t data)
+{
+    ssize_t n = 1;
+    uint64_t v;
+    ssize_t i;
+
+    for (v = data >> 7; v; v >>= 7)
+        n++;
+    fuzzy_message_reserve(msg, n);
+
+    for (i = 1; i <= n; i++) {
+        msg->buffer[msg->cursor + n - i] = (data & 0x7f) | (i < n ? 0x80 : 0);
+        data >>= 7;
+    }
+    msg->cursor += n;
+}
+
+void fuzzy_message_pushsvar(FuzzyMessage * msg, int32_t data)
+{
+    /* zigzag: 0, -1, 1, -2, 2... -> 0, 1, 2, 3, 4... */
+    fuzzy_message_pushvar(msg, ((ubyte32)data << 1) ^ (ubyte32)(data >> 31));
+}
+
+/* \retval FALSE truncated or overflowing value. Message is not consumed. */
+bool fuzzy_message_popvar(FuzzyMessage * msg, ubyte32 * out)
+{
+    ubyte32 data = 0;
+    ssize_t cursor = msg->cursor;
+    ubyte8 byte;
+    int shift = 0;
+
+    do {
+        if (cursor < 1 || shift > 28)
+            return false;
+
+        byte = msg->buffer[--cursor];
+        if (shift == 28 && (byte & 0x70))
+            /* more than 32 bits */
+            return false;
+        data |= (ubyte32)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    msg->cursor = cursor;
+    *out = data;
+    return true;
+}
+
+bool fuzzy_message_popvar64(FuzzyMessage * msg, uint64_t * out)
+{
+    uint64_t data = 0;
+    ssize_t cursor = msg->cursor;
+    ubyte8 byte;
+    int shift = 0;
+
+    do {
+        if (cursor < 1 || shift > 63)
+            return false;
+
+        byte = msg->buffer[--cursor];
+        if (shift == 63 && (byte & 0x7e))
+            /* more than 64 bits */
+            return false;
+        data |= (uint64_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    msg->cursor = cursor;
+    *out = data;
+    return true;
+}
+
+bool fuzzy_message_popsvar(FuzzyMessage * msg, int32_t * out)
+{
+    ubyte32 data;
+
+    if (! fuzzy_message_popvar(msg, &data))
+        return false;
+
+    *out = (int32_t)(data >> 1) ^ -(int32_t)(data & 1);
+    return true;
+}
+
+/* only the string characters are sent, up to maxlen */
+void fuzzy_message_pushvarstr(FuzzyMessage * msg, const char * data, ssize_t maxlen)
+{
+    ssize_t slen = strnlen(data, maxlen);
+
+    fuzzy_message_reserve(msg, slen + 5);
+    memcpy(&msg->buffer[msg->cursor], data, slen);
+    msg->cursor += slen;
+    fuzzy_message_pushvar(msg, slen);
+}
+
 ubyte8 fuzzy_message_pop8(FuzzyMessage * msg)
 {
     ubyte8 data;
@@ -152,13 +660,35 @@ ubyte32 fuzzy_message_pop32(FuzzyMessage * msg)
     data = msg->buffer[msg->cursor-1];
     data |= msg->buffer[msg->cursor-2] << 8;
     data |= msg->buffer[msg->cursor-3] << 16;
-    data |= msg->buffer[msg->cursor-4] << 24;
+    data |= (ubyte32)msg->buffer[msg->cursor-4] << 24;
     data = ntohl(data);
     msg->cursor-=4;
 
     return data;
 }
 
+/* pops n values pushed with the matching array push, in the same order.
+    Not compatible with the scalar pops */
+void fuzzy_message_pop16_array(FuzzyMessage * msg, ubyte16 * out, size_t n)
+{
+    if ((size_t)msg->cursor < n * 2)
+        fuzzy_critical(fuzzy_sformat("Message buffer does not hold %zu 16 bit values", n));
+
+    _fuzzy_simd_init();
+    msg->cursor -= n * 2;
+    Bswap16(out, &msg->buffer[msg->cursor], n);
+}
+
+void fuzzy_message_pop32_array(FuzzyMessage * msg, ubyte32 * out, size_t n)
+{
+    if ((size_t)msg->cursor < n * 4)
+        fuzzy_critical(fuzzy_sformat("Message buffer does not hold %zu 32 bit values", n));
+
+    _fuzzy_simd_init();
+    msg->cursor -= n * 4;
+    Bswap32(out, &msg->buffer[msg->cursor], n);
+}
+
 /* strings are sent entirely! only use with short data */
 void fuzzy_message_popstr(FuzzyMessage * msg, char * out, ssize_t len)
 {
@@ -172,6 +702,23 @@ void fuzzy_message_popstr(FuzzyMessage * msg, char * out, ssize_t len)
     msg->cursor-=len;
 }
 
+/* out is always null terminated.
+    \retval FALSE malformed data or string not fitting outlen */
+bool fuzzy_message_popvarstr(FuzzyMessage * msg, char * out, ssize_t outlen)
+{
+    ubyte32 slen;
+
+    if (! fuzzy_message_popvar(msg, &slen))
+        return false;
+    if (slen >= outlen || slen > msg->cursor)
+        return false;
+
+    memcpy(out, &msg->buffer[msg->cursor-slen], slen);
+    out[slen] = '\0';
+    msg->cursor -= slen;
+    return true;
+}
+
 void fuzzy_message_push8uint(FuzzyMessage * msg, uint data)
 {
     if (data > 255)
@@ -201,30 +748,92 @@ void fuzzy_message_clear(FuzzyMessage * msg)
     msg->cursor = 0;
 }
 
-/* send entire message */
-void fuzzy_message_send(int sock, FuzzyMessage * msg)
+/* writes the whole iovec, waiting for the socket when it would block.
+    \retval FALSE peer disconnected */
+static bool _fuzzy_send_all(int sock, struct iovec * iov, int iovcnt)
 {
-    const ssize_t realen = msg->cursor;
+    struct msghdr mh;
+    struct pollfd single;
     ssize_t sent;
 
-    fuzzy_lz_perror(send(sock, &realen, 4, MSG_NOSIGNAL));
-    fuzzy_lz_perror(sent = send(sock, msg->buffer, realen, MSG_NOSIGNAL));
-    if (sent != realen)
-        fuzzy_critical("Partial message send");
+    bzero(&mh, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = iovcnt;
+
+    while (mh.msg_iovlen > 0) {
+        sent = sendmsg(sock, &mh, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                single.fd = sock;
+                single.events = POLLOUT;
+                fuzzy_lz_perror(poll(&single, 1, -1));
+                continue;
+            }
+            if (errno == EPIPE || errno == ECONNRESET)
+                return false;
+            fuzzy_critical(fuzzy_strerror(errno));
+        }
+
+        /* skip sent data */
+        while (mh.msg_iovlen > 0 && (size_t)sent >= mh.msg_iov->iov_len) {
+            sent -= mh.msg_iov->iov_len;
+            mh.msg_iov++;
+            mh.msg_iovlen--;
+        }
+        if (mh.msg_iovlen > 0) {
+            mh.msg_iov->iov_base = (ubyte8 *)mh.msg_iov->iov_base + sent;
+            mh.msg_iov->iov_len -= sent;
+        }
+    }
+    return true;
 }
 
+static bool _fuzzy_send_payload(int sock, FuzzyMessage * msg, ubyte32 flags)
+{
+    ubyte32 header;
+    struct iovec iov[2];
+
+    header = htonl((ubyte32)msg->cursor | flags);
+    iov[0].iov_base = &header;
+    iov[0].iov_len = FUZZY_FRAME_HEADER_SIZE;
+    iov[1].iov_base = msg->buffer;
+    iov[1].iov_len = msg->cursor;
+
+    return _fuzzy_send_all(sock, iov, 2);
+}
+
+/* send entire message
+    \retval TRUE sent
+    \retval FALSE peer disconnected
+ */
+bool fuzzy_message_send(int sock, FuzzyMessage * msg)
+{
+    return _fuzzy_send_payload(sock, msg, 0);
+}
+
+/* like fuzzy_message_send, deflating big messages. The peer must have agreed */
+bool fuzzy_message_send_compressed(int sock, FuzzyMessage * msg)
+{
+    if (_fuzzy_deflate(msg))
+        return _fuzzy_send_payload(sock, ZStreams.scratch, FUZZY_FRAME_COMPRESSED);
+    return _fuzzy_send_payload(sock, msg, 0);
+}
+
+/* checks if sock has pending data, without waiting.
+    poll is used instead of select, so sockets beyond FD_SETSIZE are supported */
 bool fuzzy_message_poll(int sock)
 {
-    fd_set single;
-    struct timeval tv;
+    struct pollfd single;
     int retval;
 
-    FD_ZERO(&single);
-    FD_SET(sock, &single);
+    single.fd = sock;
+    single.events = POLLIN;
+    single.revents = 0;
 
     /* do not wait */
-    bzero(&tv, sizeof(tv));
-    fuzzy_lz_perror(retval = select(FD_SETSIZE, &single, NULL, NULL, &tv));
+    fuzzy_lz_perror(retval = poll(&single, 1, 0));
     if (retval == 1)
         return 1;
     return 0;
@@ -239,24 +848,409 @@ bool fuzzy_message_poll(int sock)
  */
 bool fuzzy_message_recv(int sock, FuzzyMessage * msg)
 {
+    FuzzyMessage * payload = msg;
     ssize_t recved;
     ubyte32 len;
 
-    recved = recv(sock, &len, 4, 0);
+    do {
+        recved = recv(sock, &len, FUZZY_FRAME_HEADER_SIZE, MSG_WAITALL);
+    } while (recved < 0 && errno == EINTR);
+
     if (recved == 0)
         // disconnected
         return false;
     else if (recved < 0)
         fuzzy_critical(fuzzy_strerror(errno));
+    else if (recved != FUZZY_FRAME_HEADER_SIZE)
+        fuzzy_critical("Partial message header");
+
+    len = ntohl(len);
+    if (len & FUZZY_FRAME_COMPRESSED) {
+        len &= ~FUZZY_FRAME_COMPRESSED;
+        payload = _fuzzy_z_scratch(0);
+    }
+    if (len > FUZZY_MESSAGE_MAX_SIZE)
+        fuzzy_critical(fuzzy_sformat("Message too big: %u bytes", len));
+
+    payload->cursor = 0;
+    fuzzy_message_reserve(payload, len);
 
-    if (msg->buflen < len)
-        _fuzzy_message_expand(msg, len);
+    do {
+        recved = recv(sock, payload->buffer, len, MSG_WAITALL);
+    } while (recved < 0 && errno == EINTR);
 
-    fuzzy_lz_perror(recved = recv(sock, msg->buffer, len, 0));
+    fuzzy_lz_perror(recved);
     if (recved != len)
         fuzzy_critical("Partial message receive");
 
-    msg->buflen = len;
-    msg->cursor = len;
+    payload->cursor = len;
+    if (payload != msg && ! _fuzzy_inflate(msg))
+        fuzzy_critical("Corrupted compressed message");
+    return true;
+}
+
+/* sends the message as a single datagram, without size header.
+    addr can be NULL on connected sockets. Datagrams are not retried.
+
+    \retval TRUE sent
+    \retval FALSE dropped: the socket buffer is full or the peer is gone
+ */
+bool fuzzy_message_sendto(int sock, FuzzyMessage * msg, struct sockaddr_in * addr)
+{
+    ssize_t sent;
+
+    if (msg->cursor > FUZZY_DATAGRAM_MAX_SIZE)
+        fuzzy_critical(fuzzy_sformat("Datagram too big: %zd bytes", msg->cursor));
+
+    do {
+        sent = sendto(sock, msg->buffer, msg->cursor, MSG_DONTWAIT | MSG_NOSIGNAL,
+          (struct sockaddr *) addr, addr ? sizeof(struct sockaddr_in) : 0);
+    } while (sent < 0 && errno == EINTR);
+
+    if (sent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED || errno == ENOBUFS)
+            return false;
+        fuzzy_critical(fuzzy_strerror(errno));
+    }
     return true;
 }
+
+/* reads a datagram, without waiting. addr, if not NULL, gets the sender.
+    Oversized datagrams are truncated to an empty message.
+
+    \retval FUZZY_RECV_MORE a datagram was read into msg
+    \retval FUZZY_RECV_DRAINED no datagram pending
+ */
+FUZZY_RECV_STATUS fuzzy_message_recvfrom(int sock, FuzzyMessage * msg, struct sockaddr_in * addr)
+{
+    socklen_t addrlen = sizeof(struct sockaddr_in);
+    ssize_t recved;
+
+    msg->cursor = 0;
+    fuzzy_message_reserve(msg, FUZZY_DATAGRAM_MAX_SIZE);
+
+    do {
+        recved = recvfrom(sock, msg->buffer, FUZZY_DATAGRAM_MAX_SIZE, MSG_DONTWAIT | MSG_TRUNC,
+          (struct sockaddr *) addr, addr ? &addrlen : NULL);
+    } while (recved < 0 && errno == EINTR);
+
+    if (recved < 0) {
+        /* refused: an icmp error for a previous datagram */
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED)
+            return FUZZY_RECV_DRAINED;
+        fuzzy_critical(fuzzy_strerror(errno));
+    }
+
+    if (recved <= FUZZY_DATAGRAM_MAX_SIZE)
+        msg->cursor = recved;
+    return FUZZY_RECV_MORE;
+}
+
+void fuzzy_ring_init(FuzzyRingBuffer * ring, size_t size)
+{
+    if (size & (size-1))
+        fuzzy_critical("Ring size must be a power of 2");
+
+    ring->buffer = fuzzy_alloc(size);
+    ring->size = size;
+    ring->head = ring->tail = 0;
+    ring->inflate = false;
+}
+
+void fuzzy_ring_free(FuzzyRingBuffer * ring)
+{
+    free(ring->buffer);
+    ring->buffer = NULL;
+    ring->size = 0;
+}
+
+/* copy len bytes starting from head+offset, without consuming them */
+static void _fuzzy_ring_peek(FuzzyRingBuffer * ring, size_t offset, void * out, size_t len)
+{
+    size_t start = (ring->head + offset) & (ring->size - 1);
+    size_t first = fuzzy_min(len, ring->size - start);
+
+    memcpy(out, &ring->buffer[start], first);
+    memcpy((ubyte8 *)out + first, ring->buffer, len - first);
+}
+
+/* grows the ring to hold at least nsize bytes, linearizing its content */
+static void _fuzzy_ring_grow(FuzzyRingBuffer * ring, size_t nsize)
+{
+    ubyte8 * newbuf;
+    size_t used = ring->tail - ring->head;
+    size_t size = ring->size;
+
+    while (size < nsize)
+        size *= 2;
+
+    newbuf = fuzzy_alloc(size);
+    _fuzzy_ring_peek(ring, 0, newbuf, used);
+    free(ring->buffer);
+    ring->buffer = newbuf;
+    ring->size = size;
+    ring->head = 0;
+    ring->tail = used;
+}
+
+/* performs a single read from a non blocking socket into the ring free space */
+FUZZY_RECV_STATUS fuzzy_ring_recv(int sock, FuzzyRingBuffer * ring)
+{
+    struct iovec iov[2];
+    size_t space = ring->size - (ring->tail - ring->head);
+    size_t start = ring->tail & (ring->size - 1);
+    ssize_t recved;
+
+    if (space == 0)
+        /* extract some message first */
+        return FUZZY_RECV_MORE;
+
+    iov[0].iov_base = &ring->buffer[start];
+    iov[0].iov_len = fuzzy_min(space, ring->size - start);
+    iov[1].iov_base = ring->buffer;
+    iov[1].iov_len = space - iov[0].iov_len;
+
+    do {
+        recved = readv(sock, iov, iov[1].iov_len ? 2 : 1);
+    } while (recved < 0 && errno == EINTR);
+
+    if (recved == 0)
+        return FUZZY_RECV_CLOSED;
+    if (recved < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return FUZZY_RECV_DRAINED;
+        if (errno == ECONNRESET || errno == ETIMEDOUT || errno == EPIPE)
+            return FUZZY_RECV_CLOSED;
+        fuzzy_critical(fuzzy_strerror(errno));
+    }
+
+    ring->tail += recved;
+
+    /* a short read on a stream socket means it has been drained */
+    if ((size_t)recved < space)
+        return FUZZY_RECV_DRAINED;
+    return FUZZY_RECV_MORE;
+}
+
+/* appends data received elsewhere, growing the ring if needed */
+void fuzzy_ring_write(FuzzyRingBuffer * ring, const void * data, size_t len)
+{
+    size_t start, first;
+
+    if (ring->tail - ring->head + len > ring->size)
+        _fuzzy_ring_grow(ring, ring->tail - ring->head + len);
+
+    start = ring->tail & (ring->size - 1);
+    first = fuzzy_min(len, ring->size - start);
+    memcpy(&ring->buffer[start], data, first);
+    memcpy(ring->buffer, (const ubyte8 *)data + first, len - first);
+    ring->tail += len;
+}
+
+/* extracts the next complete message from the ring, if any */
+FUZZY_FRAME_STATUS fuzzy_message_extract(FuzzyRingBuffer * ring, FuzzyMessage * msg)
+{
+    size_t used = ring->tail - ring->head;
+    FuzzyMessage * payload = msg;
+    ubyte32 len;
+
+    if (used < FUZZY_FRAME_HEADER_SIZE)
+        return FUZZY_FRAME_PARTIAL;
+
+    _fuzzy_ring_peek(ring, 0, &len, FUZZY_FRAME_HEADER_SIZE);
+    len = ntohl(len);
+    if (len & FUZZY_FRAME_COMPRESSED) {
+        /* only from peers which negotiated FUZZY_CAP_DEFLATE */
+        if (! ring->inflate)
+            return FUZZY_FRAME_INVALID;
+        len &= ~FUZZY_FRAME_COMPRESSED;
+        payload = _fuzzy_z_scratch(0);
+    }
+    if (len > FUZZY_MESSAGE_MAX_SIZE)
+        return FUZZY_FRAME_INVALID;
+
+    if (used < FUZZY_FRAME_HEADER_SIZE + len) {
+        /* grow as the frame bytes arrive, a header alone does not reserve
+            up to FUZZY_MESSAGE_MAX_SIZE */
+        if (used == ring->size)
+            _fuzzy_ring_grow(ring, fuzzy_min(ring->size * 2, FUZZY_FRAME_HEADER_SIZE + len));
+        return FUZZY_FRAME_PARTIAL;
+    }
+
+    payload->cursor = 0;
+    fuzzy_message_reserve(payload, len);
+
+    _fuzzy_ring_peek(ring, FUZZY_FRAME_HEADER_SIZE, payload->buffer, len);
+    ring->head += FUZZY_FRAME_HEADER_SIZE + len;
+    if (ring->head == ring->tail)
+        ring->head = ring->tail = 0;
+
+    payload->cursor = len;
+    if (payload != msg && ! _fuzzy_inflate(msg))
+        return FUZZY_FRAME_INVALID;
+    return FUZZY_FRAME_READY;
+}
+
+static FuzzyFrame * _fuzzy_frame_build(FuzzyMessage * msg, ubyte32 flags)
+{
+    FuzzyFrame * frame;
+    ubyte32 header;
+
+    frame = _fuzzy_pool_get(sizeof(FuzzyFrame) + FUZZY_FRAME_HEADER_SIZE + msg->cursor);
+    frame->refs = 1;
+    frame->len = FUZZY_FRAME_HEADER_SIZE + msg->cursor;
+
+    header = htonl((ubyte32)msg->cursor | flags);
+    memcpy(frame->data, &header, FUZZY_FRAME_HEADER_SIZE);
+    memcpy(&frame->data[FUZZY_FRAME_HEADER_SIZE], msg->buffer, msg->cursor);
+    return frame;
+}
+
+/* encodes the message into a new frame, holding one reference */
+FuzzyFrame * fuzzy_frame_new(FuzzyMessage * msg)
+{
+    return _fuzzy_frame_build(msg, 0);
+}
+
+/* like fuzzy_frame_new, deflating big messages. The frame is still shared
+    among any queue whose peer agreed on compression */
+FuzzyFrame * fuzzy_frame_new_compressed(FuzzyMessage * msg)
+{
+    if (_fuzzy_deflate(msg))
+        return _fuzzy_frame_build(ZStreams.scratch, FUZZY_FRAME_COMPRESSED);
+    return _fuzzy_frame_build(msg, 0);
+}
+
+FuzzyFrame * fuzzy_frame_ref(FuzzyFrame * frame)
+{
+    __atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+    return frame;
+}
+
+void fuzzy_frame_unref(FuzzyFrame * frame)
+{
+    if (__atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        _fuzzy_pool_put(frame, sizeof(FuzzyFrame) + frame->len);
+}
+
+/* pops only read the buffer, so the frame can be shared meanwhile */
+void fuzzy_frame_view(FuzzyFrame * frame, FuzzyMessage * msg)
+{
+    msg->buffer = frame->data + FUZZY_FRAME_HEADER_SIZE;
+    msg->buflen = msg->cursor = frame->len - FUZZY_FRAME_HEADER_SIZE;
+}
+
+void fuzzy_outqueue_init(FuzzyOutQueue * queue)
+{
+    queue->frames = fuzzy_newarr(FuzzyFrame *, FUZZY_OUTQUEUE_DEFAULT_SIZE);
+    queue->size = FUZZY_OUTQUEUE_DEFAULT_SIZE;
+    queue->head = queue->tail = 0;
+    queue->offset = 0;
+    queue->bytes = 0;
+}
+
+/* also frees any pending frame */
+void fuzzy_outqueue_free(FuzzyOutQueue * queue)
+{
+    while (queue->head != queue->tail) {
+        fuzzy_frame_unref(queue->frames[queue->head & (queue->size - 1)]);
+        queue->head++;
+    }
+
+    free(queue->frames);
+    queue->frames = NULL;
+    queue->bytes = 0;
+}
+
+/* queue takes ownership of a frame reference */
+void fuzzy_outqueue_push(FuzzyOutQueue * queue, FuzzyFrame * frame)
+{
+    if (queue->tail - queue->head == queue->size) {
+        /* full: double and linearize */
+        FuzzyFrame ** frames = fuzzy_newarr(FuzzyFrame *, queue->size * 2);
+        uint i;
+
+        for (i = 0; i < queue->size; i++)
+            frames[i] = queue->frames[(queue->head + i) & (queue->size - 1)];
+        free(queue->frames);
+        queue->frames = frames;
+        queue->head = 0;
+        queue->tail = queue->size;
+        queue->size *= 2;
+    }
+
+    queue->frames[queue->tail & (queue->size - 1)] = frame;
+    queue->tail++;
+    queue->bytes += frame->len;
+}
+
+/* points iov at the unsent bytes of the first queued frames, up to max of
+    them. Returns the frames count, len gets their bytes */
+uint fuzzy_outqueue_iov(FuzzyOutQueue * queue, struct iovec * iov, uint max, size_t * len)
+{
+    FuzzyFrame * frame;
+    size_t offset = queue->offset;
+    uint i, n;
+
+    n = fuzzy_min(queue->tail - queue->head, max);
+    *len = 0;
+    for (i = 0; i < n; i++) {
+        frame = queue->frames[(queue->head + i) & (queue->size - 1)];
+        iov[i].iov_base = &frame->data[offset];
+        iov[i].iov_len = frame->len - offset;
+        *len += iov[i].iov_len;
+        offset = 0;
+    }
+    return n;
+}
+
+/* releases the frames sent by a write of the fuzzy_outqueue_iov vector */
+void fuzzy_outqueue_consume(FuzzyOutQueue * queue, size_t sent)
+{
+    FuzzyFrame * frame;
+
+    queue->bytes -= sent;
+    while (sent > 0) {
+        frame = queue->frames[queue->head & (queue->size - 1)];
+        if (sent < frame->len - queue->offset) {
+            queue->offset += sent;
+            return;
+        }
+        sent -= frame->len - queue->offset;
+        queue->offset = 0;
+        queue->head++;
+        fuzzy_frame_unref(frame);
+    }
+}
+
+/* writes as many frames as the socket accepts, a gather write for each batch.
+    sendmsg is used like writev, to get MSG_NOSIGNAL */
+FUZZY_SEND_STATUS fuzzy_outqueue_flush(int sock, FuzzyOutQueue * queue)
+{
+    struct iovec iov[FUZZY_OUTQUEUE_IOV];
+    struct msghdr mh;
+    ssize_t sent;
+    size_t len;
+
+    while (queue->head != queue->tail) {
+        bzero(&mh, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = fuzzy_outqueue_iov(queue, iov, FUZZY_OUTQUEUE_IOV, &len);
+        sent = sendmsg(sock, &mh, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return FUZZY_SEND_BLOCKED;
+            if (errno == EPIPE || errno == ECONNRESET)
+                return FUZZY_SEND_CLOSED;
+            fuzzy_critical(fuzzy_strerror(errno));
+        }
+
+        fuzzy_outqueue_consume(queue, sent);
+        if ((size_t)sent < len)
+            return FUZZY_SEND_BLOCKED;
+    }
+
+    return FUZZY_SEND_DONE;
+}
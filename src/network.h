@@ -22,13 +22,45 @@
     MESSAGE: the container for the data to send
     NETWORK TYPES: a conversion must be performed to convert standard types
         to network types. Supported types: ubyte8 ubyte16 ubyte32
+    ARRAYS: blocks of 16/32 bit values are byte swapped at once, with SSE2
+        or AVX2 kernels when the cpu supports them.
+    VARINT: LEB128 encoded ubyte32, 7 bits for each byte. Signed values are
+        zigzag encoded first, so small negative values take few bytes too.
+        The 64 bit variant is meant for counters.
+    VARSTR: a string prefixed by its length, which is encoded in a variable
+        number of bytes. Only the string characters are sent.
 
     Endianess is respected
 
     Ordering: network MSB first, network LSB after
-    Size: size is encoded in 32bit storage
+    Size: size is encoded in 32bit storage, network ordered, before the data
+
+    FRAME: an encoded message, size header included, ready to be written.
+        Frames are immutable and reference counted, so a single frame can
+        wait on many queues. An uncompressed frame can be read in place
+        through a message view, which must not be pushed to or freed.
+    OUT QUEUE: frames waiting for a non blocking socket to become writable.
+        Frames are flushed with a single writev.
+
+    COMPRESSION: messages of FUZZY_COMPRESS_MIN_SIZE bytes or more can be
+        deflated, when the peer agreed and the result is smaller. The size
+        header has FUZZY_FRAME_COMPRESSED set, the payload holds the inflated
+        size followed by raw deflate data. Received frames are inflated
+        transparently. zlib streams are per thread and reset for each
+        message, so compressed frames can still be shared among queues.
+
+    DATAGRAM: a message sent on a udp socket as is, without size header.
+        Datagrams can be lost or reordered, the caller must cope with it.
+
+    RING BUFFER: accumulates the bytes of a non blocking socket until entire
+        messages can be extracted. Partial frames are kept for the next read.
+
+    POOL: message buffers and frames are recycled through per thread free
+        lists, one for each power of 2 size class. Buffers grow to the next
+        class, so in steady state no heap allocation happens.
 
     \note cursor always points to a new insertion byte
+    \note buflen is the buffer capacity, received messages length is cursor
  */
 
 #ifndef __FUZZY_NETWORK_H
@@ -37,8 +69,24 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
 
 #define FUZZY_DEFAULT_MESSAGE_SIZE 256
+#define FUZZY_MESSAGE_MAX_SIZE (16*1024*1024)
+#define FUZZY_FRAME_HEADER_SIZE 4
+#define FUZZY_FRAME_COMPRESSED 0x80000000       // size header flag: deflated payload
+#define FUZZY_COMPRESS_MIN_SIZE 512             // smaller messages are sent as they are
+#define FUZZY_COMPRESS_LEVEL 1                  // zlib level, favour speed
+#define FUZZY_INFLATE_MAX_RATIO 1032            // deflate cannot compress better
+#define FUZZY_DATAGRAM_MAX_SIZE 1400             // fits the common path mtu
+#define FUZZY_RING_DEFAULT_SIZE 4096
+#define FUZZY_OUTQUEUE_DEFAULT_SIZE 16
+#define FUZZY_OUTQUEUE_IOV 64
+#define FUZZY_POOL_MIN_SHIFT 8                  // smallest class: 256 bytes
+#define FUZZY_POOL_MAX_SHIFT 24                 // biggest class: 16 MB
+#define FUZZY_POOL_CLASSES (FUZZY_POOL_MAX_SHIFT - FUZZY_POOL_MIN_SHIFT + 1)
+#define FUZZY_POOL_MAX_CACHED 64                // cached buffers per class
 
 typedef unsigned char ubyte8;
 typedef uint16_t ubyte16;
@@ -50,22 +98,98 @@ typedef struct FuzzyMessage {
     ssize_t cursor;
 }FuzzyMessage;
 
+typedef enum FUZZY_SIMD_LEVEL {
+    FUZZY_SIMD_NONE,
+    FUZZY_SIMD_SSE2,
+    FUZZY_SIMD_AVX2
+} FUZZY_SIMD_LEVEL;
+
+typedef struct FuzzyPoolStats {
+    ulong hits;                 // requests served from the free lists
+    ulong misses;               // requests which needed a heap allocation
+    size_t cached_bytes;        // bytes held by the free lists
+}FuzzyPoolStats;
+
+/* head and tail grow indefinitely, size is a power of 2 */
+typedef struct FuzzyRingBuffer {
+    ubyte8 * buffer;
+    size_t size;
+    size_t head;
+    size_t tail;
+    bool inflate;                           // accepts compressed frames
+}FuzzyRingBuffer;
+
+typedef struct FuzzyFrame {
+    uint refs;
+    size_t len;
+    ubyte8 data[];
+}FuzzyFrame;
+
+/* circular array of frames, size is a power of 2 */
+typedef struct FuzzyOutQueue {
+    FuzzyFrame ** frames;
+    uint size;
+    uint head;
+    uint tail;
+    size_t offset;              // bytes of the head frame already sent
+    size_t bytes;               // bytes waiting to be sent
+}FuzzyOutQueue;
+
+typedef enum FUZZY_SEND_STATUS {
+    FUZZY_SEND_DONE,            // queue has been flushed
+    FUZZY_SEND_BLOCKED,         // socket is full, wait for it to be writable
+    FUZZY_SEND_CLOSED           // peer disconnected or connection error
+} FUZZY_SEND_STATUS;
+
+typedef enum FUZZY_RECV_STATUS {
+    FUZZY_RECV_MORE,            // buffer is full, socket could hold more data
+    FUZZY_RECV_DRAINED,         // socket has no more data for now
+    FUZZY_RECV_CLOSED           // peer disconnected or connection error
+} FUZZY_RECV_STATUS;
+
+typedef enum FUZZY_FRAME_STATUS {
+    FUZZY_FRAME_READY,          // a message has been extracted
+    FUZZY_FRAME_PARTIAL,        // more data is needed
+    FUZZY_FRAME_INVALID         // bad frame header
+} FUZZY_FRAME_STATUS;
+
 /* Misc */
 FuzzyMessage * fuzzy_message_new();
 void fuzzy_message_del(FuzzyMessage * msg);
+void fuzzy_message_reserve(FuzzyMessage * msg, ssize_t len);
 bool fuzzy_message_poll(int sock);
 
+/* Select array kernels up to limit, returns the level in use */
+FUZZY_SIMD_LEVEL fuzzy_message_simd_limit(FUZZY_SIMD_LEVEL limit);
+
+/* Pool, per thread */
+void fuzzy_message_pool_stats(FuzzyPoolStats * stats);
+void fuzzy_message_pool_clear();
+
 /* Push message data */
 void fuzzy_message_push8(FuzzyMessage * msg, ubyte8 data);
 void fuzzy_message_push16(FuzzyMessage * msg, ubyte16 data);
 void fuzzy_message_push32(FuzzyMessage * msg, ubyte32 data);
 void fuzzy_message_pushstr(FuzzyMessage * msg, const char * data, ssize_t len);
+void fuzzy_message_pushvarstr(FuzzyMessage * msg, const char * data, ssize_t maxlen);
+// Big endian, unlike the scalar pushes which keep the version 1 layout
+void fuzzy_message_push16_array(FuzzyMessage * msg, const ubyte16 * data, size_t n);
+void fuzzy_message_push32_array(FuzzyMessage * msg, const ubyte32 * data, size_t n);
+void fuzzy_message_pushvar(FuzzyMessage * msg, ubyte32 data);
+void fuzzy_message_pushsvar(FuzzyMessage * msg, int32_t data);
+void fuzzy_message_pushvar64(FuzzyMessage * msg, uint64_t data);
 
 /* Pop message data */
 ubyte8 fuzzy_message_pop8(FuzzyMessage * msg);
 ubyte16 fuzzy_message_pop16(FuzzyMessage * msg);
 ubyte32 fuzzy_message_pop32(FuzzyMessage * msg);
 void fuzzy_message_popstr(FuzzyMessage * msg, char * out, ssize_t len);
+bool fuzzy_message_popvarstr(FuzzyMessage * msg, char * out, ssize_t outlen);
+void fuzzy_message_pop16_array(FuzzyMessage * msg, ubyte16 * out, size_t n);
+void fuzzy_message_pop32_array(FuzzyMessage * msg, ubyte32 * out, size_t n);
+bool fuzzy_message_popvar(FuzzyMessage * msg, ubyte32 * out);
+bool fuzzy_message_popsvar(FuzzyMessage * msg, int32_t * out);
+bool fuzzy_message_popvar64(FuzzyMessage * msg, uint64_t * out);
 void fuzzy_message_clear(FuzzyMessage * msg);
 
 /* Push fitting uint */
@@ -74,7 +198,29 @@ void fuzzy_message_push16uint(FuzzyMessage * msg, uint data);
 void fuzzy_message_push32uint(FuzzyMessage * msg, uint data);
 
 /* Exchange routines */
-void fuzzy_message_send(int sock, FuzzyMessage * msg);
+bool fuzzy_message_send(int sock, FuzzyMessage * msg);
+bool fuzzy_message_send_compressed(int sock, FuzzyMessage * msg);
 bool fuzzy_message_recv(int sock, FuzzyMessage * msg);
 
+/* Non blocking exchange routines */
+void fuzzy_ring_init(FuzzyRingBuffer * ring, size_t size);
+void fuzzy_ring_free(FuzzyRingBuffer * ring);
+FUZZY_RECV_STATUS fuzzy_ring_recv(int sock, FuzzyRingBuffer * ring);
+void fuzzy_ring_write(FuzzyRingBuffer * ring, const void * data, size_t len);
+FUZZY_FRAME_STATUS fuzzy_message_extract(FuzzyRingBuffer * ring, FuzzyMessage * msg);
+FuzzyFrame * fuzzy_frame_new(FuzzyMessage * msg);
+FuzzyFrame * fuzzy_frame_new_compressed(FuzzyMessage * msg);
+FuzzyFrame * fuzzy_frame_ref(FuzzyFrame * frame);
+void fuzzy_frame_unref(FuzzyFrame * frame);
+// Points msg at the frame payload, valid while the frame is referenced
+void fuzzy_frame_view(FuzzyFrame * frame, FuzzyMessage * msg);
+void fuzzy_outqueue_init(FuzzyOutQueue * queue);
+void fuzzy_outqueue_free(FuzzyOutQueue * queue);
+void fuzzy_outqueue_push(FuzzyOutQueue * queue, FuzzyFrame * frame);
+FUZZY_SEND_STATUS fuzzy_outqueue_flush(int sock, FuzzyOutQueue * queue);
+uint fuzzy_outqueue_iov(FuzzyOutQueue * queue, struct iovec * iov, uint max, size_t * len);
+void fuzzy_outqueue_consume(FuzzyOutQueue * queue, size_t sent);
+bool fuzzy_message_sendto(int sock, FuzzyMessage * msg, struct sockaddr_in * addr);
+FUZZY_RECV_STATUS fuzzy_message_recvfrom(int sock, FuzzyMessage * msg, struct sockaddr_in * addr);
+
 #endif
@@ -15,24 +15,61 @@
  *
  */
 
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include "network.h"
 #include "server.h"
 #include "protocol.h"
 #include "fuzzy.h"
 
-/* checks command return code, printing error. Returns true on ok. */
-static bool _check_return_netcode(FuzzyMessage * msg, int svsock)
+/* Server capabilities by socket, as negotiated by this thread */
+static __thread ubyte32 * PeerCaps = NULL;
+static __thread int PeerCapsSize = 0;
+
+static void _set_peer_caps(int svsock, ubyte32 caps)
+{
+    int nsize;
+
+    if (svsock >= PeerCapsSize) {
+        nsize = fuzzy_max(PeerCapsSize * 2, 16);
+        while (nsize <= svsock)
+            nsize *= 2;
+        fuzzy_iz_perror(PeerCaps = (ubyte32 *) realloc(PeerCaps, nsize * sizeof(ubyte32)));
+        bzero(&PeerCaps[PeerCapsSize], (nsize - PeerCapsSize) * sizeof(ubyte32));
+        PeerCapsSize = nsize;
+    }
+    PeerCaps[svsock] = caps;
+}
+
+ubyte32 fuzzy_protocol_peer_caps(int svsock)
+{
+    if (svsock < 0 || svsock >= PeerCapsSize)
+        return 0;
+    return PeerCaps[svsock];
+}
+
+/* pops the return code, printing error. Returns true on ok. */
+static bool _pop_netcode(FuzzyMessage * msg)
 {
     ubyte8 netcode;
 
-    fuzzy_message_recv(svsock, msg);
+    if (msg->cursor < 1)
+        return false;
     netcode = fuzzy_message_pop8(msg);
 
     if (netcode != FUZZY_NETCODE_OK) {
-        if (netcode == FUZZY_NETCODE_ERROR) {
-            char err[FUZZY_NETERROR_CHARS];
+        char err[FUZZY_NETERROR_CHARS];
 
+        if (netcode == FUZZY_NETCODE_ERROR) {
             fuzzy_message_popstr(msg, err, FUZZY_NETERROR_CHARS);
+            err[FUZZY_NETERROR_CHARS-1] = '\0';
+            fuzzy_error(fuzzy_sformat("Net error: %s", err));
+        } else if (netcode == FUZZY_NETCODE_ERROR_VARSTR) {
+            if (! fuzzy_message_popvarstr(msg, err, FUZZY_NETERROR_CHARS))
+                strcpy(err, "malformed error");
             fuzzy_error(fuzzy_sformat("Net error: %s", err));
         }
         return false;
@@ -40,8 +77,290 @@ static bool _check_return_netcode(FuzzyMessage * msg, int svsock)
     return true;
 }
 
+/* waits the command reply and checks its return code */
+static bool _check_return_netcode(FuzzyMessage * msg, int svsock)
+{
+    if (! fuzzy_message_recv(svsock, msg))
+        return false;
+    return _pop_netcode(msg);
+}
+
+/* Command codecs, generated from FUZZY_COMMAND_SCHEMA. An encoder reserves
+    the whole command once and writes it downwards from its top, where the
+    type is popped first. A decoder is called after a single check of the
+    minimum size: fixed size fields are read unchecked until a varint, whose
+    length is only known once read, comes before them. */
+typedef enum FUZZY_SCHEMA_SIZE {
+    FUZZY_SCHEMA_EXACT,
+    FUZZY_SCHEMA_MIN,
+    FUZZY_SCHEMA_NONE
+} FUZZY_SCHEMA_SIZE;
+
+typedef struct FuzzyCommandCodec {
+    const char * name;
+    FUZZY_SCHEMA_SIZE size;
+    ssize_t min;                        // type and fields, fixed size strings
+    ssize_t min_varstr;                 // same, length prefixed strings
+    void (*encode)(FuzzyMessage * msg, const FuzzyCommand * cmd, bool varstr);
+    bool (*decode)(FuzzyMessage * msg, FuzzyCommand * cmd, bool varstr);
+    bool (*check)(const FuzzyCommand * cmd);
+} FuzzyCommandCodec;
+
+static inline ssize_t _var_size(ubyte32 v)
+{
+    return 1 + (v >= (1 << 7)) + (v >= (1 << 14)) + (v >= (1 << 21)) + (v >= (1 << 28));
+}
+
+static inline ubyte32 _zigzag(int32_t v)
+{
+    return ((ubyte32)v << 1) ^ (ubyte32)(v >> 31);
+}
+
+static inline int32_t _unzigzag(ubyte32 v)
+{
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+/* writers take the top of the field and return its bottom */
+static inline ubyte8 * _put_var(ubyte8 * top, ubyte32 v)
+{
+    while (v >= 0x80) {
+        *--top = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *--top = v;
+    return top;
+}
+
+/* same layout as fuzzy_message_push32 */
+static inline ubyte8 * _put_u32(ubyte8 * top, ubyte32 v)
+{
+    v = htonl(v);
+    top -= 4;
+    top[0] = v >> 24;
+    top[1] = v >> 16;
+    top[2] = v >> 8;
+    top[3] = v;
+    return top;
+}
+
+/* unused bytes are zeroed, to avoid data leaks */
+static inline ubyte8 * _put_str(ubyte8 * top, const char * s, ssize_t len)
+{
+    ssize_t slen = strnlen(s, len);
+
+    top -= len;
+    memcpy(top, s, slen);
+    bzero(top + slen, len - slen);
+    return top;
+}
+
+static inline ssize_t _varstr_size(const char * s, ssize_t maxlen)
+{
+    ssize_t slen = strnlen(s, maxlen);
+
+    return _var_size(slen) + slen;
+}
+
+static inline ubyte8 * _put_varstr(ubyte8 * top, const char * s, ssize_t maxlen)
+{
+    ssize_t slen = strnlen(s, maxlen);
+
+    top = _put_var(top, slen) - slen;
+    memcpy(top, s, slen);
+    return top;
+}
+
+/* fuzzy_message_popvar on a local cursor, so that it can be inlined */
+static inline bool _get_var(const ubyte8 * buf, ssize_t * cursor, ubyte32 * out)
+{
+    ubyte32 data = 0;
+    ssize_t c = *cursor;
+    ubyte8 byte;
+    int shift = 0;
+
+    do {
+        if (c < 1 || shift > 28)
+            return false;
+
+        byte = buf[--c];
+        if (shift == 28 && (byte & 0x70))
+            return false;
+        data |= (ubyte32)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    *cursor = c;
+    *out = data;
+    return true;
+}
+
+static inline ubyte32 _get_u32(const ubyte8 * buf, ssize_t cursor)
+{
+    return ntohl((ubyte32)buf[cursor-4] << 24 | buf[cursor-3] << 16 | buf[cursor-2] << 8 | buf[cursor-1]);
+}
+
+/* out is always null terminated */
+static inline bool _get_varstr(const ubyte8 * buf, ssize_t * cursor, char * out, ssize_t outlen)
+{
+    ubyte32 slen;
+
+    if (! _get_var(buf, cursor, &slen) || slen >= outlen || slen > *cursor)
+        return false;
+    *cursor -= slen;
+    memcpy(out, &buf[*cursor], slen);
+    out[slen] = '\0';
+    return true;
+}
+
+/* a delta is against an older state */
+static bool _check_state(const FuzzyCommand * cmd)
+{
+    return cmd->data.state.base == 0 || fuzzy_protocol_seq_after(cmd->data.state.tick, cmd->data.state.base);
+}
+
+/* F(kind, member, len) expansions, by field kind */
+#define _FUZZY_MIN_U8(len) 1
+#define _FUZZY_MIN_U32(len) 4
+#define _FUZZY_MIN_STR(len) (len)
+#define _FUZZY_MIN_NAME(len) (len)
+#define _FUZZY_MIN_VAR(len) 1
+#define _FUZZY_MIN_SVAR(len) 1
+#define _FUZZY_FIELD_MIN(kind, member, len) + _FUZZY_MIN_##kind(len)
+
+#define _FUZZY_VMIN_U8(len) 1
+#define _FUZZY_VMIN_U32(len) 4
+#define _FUZZY_VMIN_STR(len) (len)
+#define _FUZZY_VMIN_NAME(len) 1
+#define _FUZZY_VMIN_VAR(len) 1
+#define _FUZZY_VMIN_SVAR(len) 1
+#define _FUZZY_FIELD_VMIN(kind, member, len) + _FUZZY_VMIN_##kind(len)
+
+#define _FUZZY_NAMES_U8 0
+#define _FUZZY_NAMES_U32 0
+#define _FUZZY_NAMES_STR 0
+#define _FUZZY_NAMES_NAME 1
+#define _FUZZY_NAMES_VAR 0
+#define _FUZZY_NAMES_SVAR 0
+#define _FUZZY_FIELD_NAMES(kind, member, len) + _FUZZY_NAMES_##kind
+
+#define _FUZZY_SIZE_U8(v, len) 1
+#define _FUZZY_SIZE_U32(v, len) 4
+#define _FUZZY_SIZE_STR(v, len) (len)
+#define _FUZZY_SIZE_NAME(v, len) (varstr ? _varstr_size(v, (len)-1) : (len))
+#define _FUZZY_SIZE_VAR(v, len) _var_size(v)
+#define _FUZZY_SIZE_SVAR(v, len) _var_size(_zigzag(v))
+#define _FUZZY_FIELD_SIZE(kind, member, len) + _FUZZY_SIZE_##kind(cmd->data.member, len)
+
+#define _FUZZY_PUT_U8(v, len) *--top = (v)
+#define _FUZZY_PUT_U32(v, len) top = _put_u32(top, v)
+#define _FUZZY_PUT_STR(v, len) top = _put_str(top, v, len)
+#define _FUZZY_PUT_NAME(v, len) top = varstr ? _put_varstr(top, v, (len)-1) : _put_str(top, v, len)
+#define _FUZZY_PUT_VAR(v, len) top = _put_var(top, v)
+#define _FUZZY_PUT_SVAR(v, len) top = _put_var(top, _zigzag(v))
+#define _FUZZY_FIELD_PUT(kind, member, len) _FUZZY_PUT_##kind(cmd->data.member, len);
+
+/* loose: a varint came before, the minimum size does not cover the field */
+#define _FUZZY_NEED(n) if (loose && cursor < (n)) return false
+#define _FUZZY_GET_U8(v, len) _FUZZY_NEED(1); v = buf[--cursor]
+#define _FUZZY_GET_U32(v, len) _FUZZY_NEED(4); v = _get_u32(buf, cursor); cursor -= 4
+#define _FUZZY_GET_STR(v, len) _FUZZY_NEED(len); cursor -= (len); memcpy(v, &buf[cursor], len); v[(len)-1] = '\0'
+#define _FUZZY_GET_NAME(v, len)\
+    if (! varstr) {\
+        _FUZZY_GET_STR(v, len);\
+    } else if (_get_varstr(buf, &cursor, v, len)) {\
+        loose = true;\
+    } else {\
+        return false;\
+    }
+#define _FUZZY_GET_VAR(v, len) if (! _get_var(buf, &cursor, &u)) return false; v = u; loose = true
+#define _FUZZY_GET_SVAR(v, len) if (! _get_var(buf, &cursor, &u)) return false; v = _unzigzag(u); loose = true
+#define _FUZZY_FIELD_GET(kind, member, len) _FUZZY_GET_##kind(cmd->data.member, len);
+
+#define _FUZZY_FIELD_ZERO(kind, member, len) memset(&cmd->data.member, 0, sizeof(cmd->data.member));
+
+#define _FUZZY_COMMAND_CODEC(name, fields, optional, size, check)\
+static void _encode_##name(FuzzyMessage * msg, const FuzzyCommand * cmd, bool varstr)\
+{\
+    ssize_t len;\
+    ubyte8 * top;\
+\
+    varstr = varstr && (0 fields(_FUZZY_FIELD_NAMES) optional(_FUZZY_FIELD_NAMES));\
+    len = 1 + (cmd->reqid ? _var_size(cmd->reqid) : 0) fields(_FUZZY_FIELD_SIZE) optional(_FUZZY_FIELD_SIZE);\
+    fuzzy_message_reserve(msg, len);\
+\
+    top = &msg->buffer[msg->cursor + len];\
+    *--top = FUZZY_COMMAND_##name | (cmd->reqid ? FUZZY_COMMAND_FLAG_REQID : 0) |\
+      (varstr ? FUZZY_COMMAND_FLAG_VARSTR : 0);\
+    if (cmd->reqid)\
+        top = _put_var(top, cmd->reqid);\
+    fields(_FUZZY_FIELD_PUT)\
+    optional(_FUZZY_FIELD_PUT)\
+    msg->cursor += len;\
+}\
+\
+static bool _decode_##name(FuzzyMessage * msg, FuzzyCommand * cmd, bool varstr)\
+{\
+    const ubyte8 * buf = msg->buffer;\
+    ssize_t cursor = msg->cursor;\
+    bool loose = false;\
+    ubyte32 u = 0;\
+\
+    fields(_FUZZY_FIELD_GET)\
+    /* older peers stop before the optional fields */\
+    if ((0 optional(_FUZZY_FIELD_MIN)) && cursor > 0) {\
+        if (cursor < (0 optional(_FUZZY_FIELD_MIN)))\
+            return false;\
+        loose = false;\
+        optional(_FUZZY_FIELD_GET)\
+    } else {\
+        optional(_FUZZY_FIELD_ZERO)\
+    }\
+    /* not every command uses them */\
+    (void) buf; (void) loose; (void) u;\
+\
+    msg->cursor = cursor;\
+    return true;\
+}
+
+FUZZY_COMMAND_SCHEMA(_FUZZY_COMMAND_CODEC)
+
+#define _FUZZY_COMMAND_ENTRY(name, fields, optional, size, check)\
+    {#name, FUZZY_SCHEMA_##size, 1 fields(_FUZZY_FIELD_MIN), 1 fields(_FUZZY_FIELD_VMIN),\
+      _encode_##name, _decode_##name, check},
+
+/* dispatch by command type */
+static const FuzzyCommandCodec Codecs[FUZZY_COMMAND_COUNT] = {
+    FUZZY_COMMAND_SCHEMA(_FUZZY_COMMAND_ENTRY)
+};
+
+const char * fuzzy_protocol_command_name(FUZZY_MESSAGE_TYPES type)
+{
+    if ((unsigned) type >= FUZZY_COMMAND_COUNT)
+        return "UNKNOWN";
+    return Codecs[type].name;
+}
+
+void fuzzy_protocol_push_command(FuzzyMessage * msg, const FuzzyCommand * cmd, ubyte32 caps)
+{
+    if ((unsigned) cmd->type >= FUZZY_COMMAND_COUNT)
+        fuzzy_critical(fuzzy_sformat("Unknown command type %d", cmd->type));
+    Codecs[cmd->type].encode(msg, cmd, (caps & FUZZY_CAP_VARSTR) != 0);
+}
+
+void fuzzy_protocol_push_player_action(FuzzyMessage * msg, FUZZY_MESSAGE_TYPES type, struct FuzzyCommandPlayer * player)
+{
+    FuzzyCommand cmd;
+
+    cmd.type = type;
+    cmd.reqid = 0;
+    cmd.data.player = *player;
+    fuzzy_protocol_push_command(msg, &cmd, 0);
+}
+
 bool fuzzy_protocol_decode_message(FuzzyMessage * msg, FuzzyCommand * cmd)
 {
+    ssize_t len = msg->cursor;
     #define BAD_MSG "Bad message: "
     #define _fuzzy_bad_message(err)\
     do {\
@@ -49,38 +368,34 @@ bool fuzzy_protocol_decode_message(FuzzyMessage * msg, FuzzyCommand * cmd)
         return false;\
     } while(0)
 
-    if(msg->buflen < 1)
+    const FuzzyCommandCodec * codec;
+    ubyte8 type;
+    bool varstr;
+
+    /* set before any error, the server replies with it */
+    cmd->reqid = 0;
+    if(len < 1)
         _fuzzy_bad_message(BAD_MSG "missing command type");
 
-    cmd->type = fuzzy_message_pop8(msg);
-    switch(cmd->type) {
-        case FUZZY_COMMAND_AUTHENTICATE:
-            if(msg->buflen < 1 + FUZZY_SERVERKEY_LEN)
-                _fuzzy_bad_message(BAD_MSG "missing authentication key");
-
-            fuzzy_message_popstr(msg, cmd->data.auth.key, FUZZY_SERVERKEY_LEN);
-            break;
-        case FUZZY_COMMAND_SHUTDOWN:
-            break;
-        case FUZZY_COMMAND_GAME_CREATE:
-            if(msg->buflen < 1 + FUZZY_NET_ROOM_LEN)
-                _fuzzy_bad_message(BAD_MSG "missing room name");
-
-            fuzzy_message_popstr(msg, cmd->data.room.name, FUZZY_NET_ROOM_LEN);
-            break;
-        case FUZZY_COMMAND_GAME_JOIN:
-            if(msg->buflen < 1 + 4)
-                _fuzzy_bad_message(BAD_MSG "missing room id");
-
-            cmd->data.room.id = fuzzy_message_pop32(msg);
-            break;
-        case FUZZY_COMMAND_GAME_START:
-            if (msg->buflen != 1)
-                _fuzzy_bad_message(BAD_MSG);
-            break;
-        default:
-            _fuzzy_bad_message(fuzzy_sformat(BAD_MSG "unknown command type '0x%02x'", cmd->type));
+    type = fuzzy_message_pop8(msg);
+    if (type & FUZZY_COMMAND_FLAG_REQID) {
+        if (! fuzzy_message_popvar(msg, &cmd->reqid))
+            _fuzzy_bad_message(BAD_MSG "bad request id");
+        /* the size checks below do not count the id */
+        len = msg->cursor + 1;
     }
+    varstr = (type & FUZZY_COMMAND_FLAG_VARSTR) != 0;
+    cmd->type = type & ~(FUZZY_COMMAND_FLAG_VARSTR | FUZZY_COMMAND_FLAG_REQID);
+    if (cmd->type >= FUZZY_COMMAND_COUNT || Codecs[cmd->type].size == FUZZY_SCHEMA_NONE)
+        _fuzzy_bad_message(fuzzy_sformat(BAD_MSG "unknown command type '0x%02x'", cmd->type));
+
+    codec = &Codecs[cmd->type];
+    if (len < (varstr ? codec->min_varstr : codec->min))
+        _fuzzy_bad_message(fuzzy_sformat(BAD_MSG "truncated %s", codec->name));
+    if (! codec->decode(msg, cmd, varstr) || (codec->check && ! codec->check(cmd)))
+        _fuzzy_bad_message(fuzzy_sformat(BAD_MSG "malformed %s", codec->name));
+    if (codec->size == FUZZY_SCHEMA_EXACT && msg->cursor != 0)
+        _fuzzy_bad_message(fuzzy_sformat(BAD_MSG "trailing data after %s", codec->name));
     return true;
 }
 
@@ -94,11 +409,50 @@ bool fuzzy_protocol_server_shutdown(int svsock, FuzzyMessage * msg)
 
 bool fuzzy_protocol_authenticate(int svsock, FuzzyMessage * msg, char * key)
 {
-    fuzzy_message_pushstr(msg, key, FUZZY_SERVERKEY_LEN);
-    fuzzy_message_push8(msg, FUZZY_COMMAND_AUTHENTICATE);
+    FuzzyCommand cmd;
+    ubyte32 caps = 0;
+
+    cmd.type = FUZZY_COMMAND_AUTHENTICATE;
+    cmd.reqid = 0;
+    strncpy(cmd.data.auth.key, key, FUZZY_SERVERKEY_LEN-1);
+    cmd.data.auth.key[FUZZY_SERVERKEY_LEN-1] = '\0';
+    cmd.data.auth.version = FUZZY_PROTOCOL_VERSION;
+    cmd.data.auth.caps = FUZZY_PROTOCOL_CAPS;
+    fuzzy_protocol_push_command(msg, &cmd, 0);
     fuzzy_message_send(svsock, msg);
 
-    return _check_return_netcode(msg, svsock);
+    if (! _check_return_netcode(msg, svsock))
+        return false;
+
+    /* version 0 servers only send the return code */
+    if (msg->cursor > 0) {
+        fuzzy_message_pop8(msg);
+        if (! fuzzy_message_popvar(msg, &caps))
+            caps = 0;
+    }
+    _set_peer_caps(svsock, caps & FUZZY_PROTOCOL_CAPS);
+    return true;
+}
+
+static void _push_create_room(int svsock, FuzzyMessage * msg, char * name)
+{
+    FuzzyCommand cmd;
+
+    cmd.type = FUZZY_COMMAND_GAME_CREATE;
+    cmd.reqid = 0;
+    strncpy(cmd.data.room.name, name, FUZZY_NET_ROOM_LEN-1);
+    cmd.data.room.name[FUZZY_NET_ROOM_LEN-1] = '\0';
+    fuzzy_protocol_push_command(msg, &cmd, fuzzy_protocol_peer_caps(svsock));
+}
+
+static void _push_join(FuzzyMessage * msg, ulong roomid)
+{
+    FuzzyCommand cmd;
+
+    cmd.type = FUZZY_COMMAND_GAME_JOIN;
+    cmd.reqid = 0;
+    cmd.data.room.id = roomid;
+    fuzzy_protocol_push_command(msg, &cmd, 0);
 }
 
 // 0 on error, >0 roomid on success
@@ -106,8 +460,7 @@ ulong fuzzy_protocol_create_room(int svsock, FuzzyMessage * msg, char * name)
 {
     ulong roomid;
 
-    fuzzy_message_pushstr(msg, name, FUZZY_NET_ROOM_LEN);
-    fuzzy_message_push8(msg, FUZZY_COMMAND_GAME_CREATE);
+    _push_create_room(svsock, msg, name);
     fuzzy_message_send(svsock, msg);
 
     if (! _check_return_netcode(msg, svsock))
@@ -119,8 +472,7 @@ ulong fuzzy_protocol_create_room(int svsock, FuzzyMessage * msg, char * name)
 
 bool fuzzy_protocol_join(int svsock, FuzzyMessage * msg, ulong roomid)
 {
-    fuzzy_message_push32(msg, roomid);
-    fuzzy_message_push8(msg, FUZZY_COMMAND_GAME_JOIN);
+    _push_join(msg, roomid);
     fuzzy_message_send(svsock, msg);
 
     return _check_return_netcode(msg, svsock);
@@ -133,3 +485,524 @@ bool fuzzy_protocol_game_start(int svsock, FuzzyMessage * msg)
 
     return _check_return_netcode(msg, svsock);
 }
+
+/* Leaves the current room. The server also sends GAME_LEAVE to the clients
+    of a room whose owner left. */
+bool fuzzy_protocol_leave(int svsock, FuzzyMessage * msg)
+{
+    fuzzy_message_push8(msg, FUZZY_COMMAND_GAME_LEAVE);
+    fuzzy_message_send(svsock, msg);
+
+    return _check_return_netcode(msg, svsock);
+}
+
+/* Servers close the clients they do not hear from, see
+    FUZZY_SERVER_IDLE_TIMEOUT. The echo tells the server is alive. */
+bool fuzzy_protocol_ping(int svsock, FuzzyMessage * msg)
+{
+    fuzzy_message_push8(msg, FUZZY_COMMAND_PING);
+    fuzzy_message_send(svsock, msg);
+
+    if (! fuzzy_message_recv(svsock, msg))
+        return false;
+    return msg->cursor == 1 && fuzzy_message_pop8(msg) == FUZZY_COMMAND_PING;
+}
+
+/* Player actions get no reply: they are relayed to the other room clients */
+static void _fuzzy_player_action(int svsock, FuzzyMessage * msg, FUZZY_MESSAGE_TYPES type, ulong x, ulong y, long dx, long dy)
+{
+    struct FuzzyCommandPlayer player;
+
+    player.x = x;
+    player.y = y;
+    player.dx = dx;
+    player.dy = dy;
+    fuzzy_message_clear(msg);
+    fuzzy_protocol_push_player_action(msg, type, &player);
+    fuzzy_message_send(svsock, msg);
+}
+
+void fuzzy_protocol_player_step(int svsock, FuzzyMessage * msg, ulong x, ulong y, long dx, long dy)
+{
+    _fuzzy_player_action(svsock, msg, FUZZY_COMMAND_PLAYER_STEP, x, y, dx, dy);
+}
+
+void fuzzy_protocol_player_move(int svsock, FuzzyMessage * msg, ulong x, ulong y, ulong nx, ulong ny)
+{
+    _fuzzy_player_action(svsock, msg, FUZZY_COMMAND_PLAYER_MOVE, x, y, (long)nx - (long)x, (long)ny - (long)y);
+}
+
+void fuzzy_protocol_player_attack(int svsock, FuzzyMessage * msg, ulong x, ulong y, ulong tx, ulong ty)
+{
+    _fuzzy_player_action(svsock, msg, FUZZY_COMMAND_PLAYER_ATTACK, x, y, (long)tx - (long)x, (long)ty - (long)y);
+}
+
+/* the state delta goes first, so it is popped after its header */
+void fuzzy_protocol_push_state(FuzzyMessage * msg, const FuzzySnapshot * base, const FuzzySnapshot * snap)
+{
+    FuzzyCommand cmd;
+
+    cmd.type = FUZZY_COMMAND_STATE;
+    cmd.reqid = 0;
+    cmd.data.state.tick = snap->tick;
+    cmd.data.state.base = base->tick;
+    fuzzy_snapshot_push_delta(msg, base, snap);
+    fuzzy_protocol_push_command(msg, &cmd, 0);
+}
+
+/* decodes the delta of a state command into history. Returns true when the
+    state is new and must be acked. States with unknown base are dropped:
+    the server sends them again against the last ack. */
+bool fuzzy_protocol_apply_state(FuzzyMessage * msg, FuzzyCommand * cmd, FuzzySnapshotHistory * history)
+{
+    const FuzzySnapshot * base;
+    FuzzySnapshot * snap;
+    ubyte32 tick = cmd->data.state.tick;
+
+    if (fuzzy_snapshot_history_get(history, tick)->tick == tick)
+        return false;
+    base = fuzzy_snapshot_history_get(history, cmd->data.state.base);
+    if (base->tick != cmd->data.state.base)
+        return false;
+    /* the base is never that old, but a bad server would overwrite it */
+    if (base->tick != 0 && ((tick ^ base->tick) & (FUZZY_SNAPSHOT_HISTORY-1)) == 0)
+        return false;
+
+    snap = fuzzy_snapshot_history_slot(history, tick);
+    if (! fuzzy_snapshot_pop_delta(msg, base, snap)) {
+        fuzzy_error("Bad state delta");
+        return false;
+    }
+    snap->tick = tick;
+    return true;
+}
+
+/* asks for the room state on the stream. No reply, states follow each
+    change. msg is left empty */
+void fuzzy_protocol_state_subscribe(int svsock, FuzzyMessage * msg)
+{
+    FuzzyCommand cmd;
+
+    cmd.type = FUZZY_COMMAND_STATE_ACK;
+    cmd.reqid = 0;
+    cmd.data.state.tick = 0;
+    fuzzy_message_clear(msg);
+    fuzzy_protocol_push_command(msg, &cmd, 0);
+    fuzzy_message_send(svsock, msg);
+    fuzzy_message_clear(msg);
+}
+
+/* Stats layout: clients, rooms, decode errors, then the commands with
+    some traffic. Each command: type, messages and bytes in and out, the
+    latency max and the used histogram buckets as index, count pairs. */
+void fuzzy_protocol_push_stats(FuzzyMessage * msg, const FuzzyServerStats * stats)
+{
+    const FuzzyCommandStats * cs;
+    int c, i, nbuckets, ncommands = 0;
+
+    /* popped last: older servers do not send it */
+    fuzzy_message_pushvar64(msg, stats->timeouts);
+    fuzzy_message_pushvar64(msg, stats->syscalls);
+    for (c = FUZZY_STATS_COMMANDS-1; c >= 0; c--) {
+        cs = &stats->commands[c];
+        if (cs->messages_in == 0 && cs->messages_out == 0)
+            continue;
+
+        nbuckets = 0;
+        for (i = FUZZY_HISTOGRAM_BUCKETS-1; i >= 0; i--) {
+            if (cs->latency.buckets[i] == 0)
+                continue;
+            fuzzy_message_pushvar64(msg, cs->latency.buckets[i]);
+            fuzzy_message_pushvar(msg, i);
+            nbuckets++;
+        }
+        fuzzy_message_pushvar(msg, nbuckets);
+        fuzzy_message_pushvar64(msg, cs->latency.max);
+        fuzzy_message_pushvar64(msg, cs->bytes_out);
+        fuzzy_message_pushvar64(msg, cs->messages_out);
+        fuzzy_message_pushvar64(msg, cs->bytes_in);
+        fuzzy_message_pushvar64(msg, cs->messages_in);
+        fuzzy_message_push8(msg, c);
+        ncommands++;
+    }
+    fuzzy_message_pushvar(msg, ncommands);
+    fuzzy_message_pushvar64(msg, stats->decode_errors);
+    fuzzy_message_pushvar(msg, stats->rooms);
+    fuzzy_message_pushvar(msg, stats->clients);
+}
+
+/* Only the counters sent by fuzzy_protocol_push_stats are set, others are 0 */
+bool fuzzy_protocol_pop_stats(FuzzyMessage * msg, FuzzyServerStats * stats)
+{
+    FuzzyCommandStats * cs;
+    ubyte32 clients, rooms, ncommands, nbuckets, idx;
+    uint64_t val[6];
+    int c, i;
+
+    bzero(stats, sizeof(FuzzyServerStats));
+    if (! fuzzy_message_popvar(msg, &clients) || ! fuzzy_message_popvar(msg, &rooms) ||
+      ! fuzzy_message_popvar64(msg, &val[0]) || ! fuzzy_message_popvar(msg, &ncommands))
+        return false;
+    stats->clients = clients;
+    stats->rooms = rooms;
+    stats->decode_errors = val[0];
+
+    for (c = 0; c < (int)ncommands; c++) {
+        if (msg->cursor < 1)
+            return false;
+        i = fuzzy_message_pop8(msg);
+        if (i >= FUZZY_STATS_COMMANDS)
+            return false;
+        cs = &stats->commands[i];
+
+        for (i = 0; i < 5; i++)
+            if (! fuzzy_message_popvar64(msg, &val[i]))
+                return false;
+        if (! fuzzy_message_popvar(msg, &nbuckets) || nbuckets > FUZZY_HISTOGRAM_BUCKETS)
+            return false;
+        cs->messages_in = val[0];
+        cs->bytes_in = val[1];
+        cs->messages_out = val[2];
+        cs->bytes_out = val[3];
+        cs->latency.max = val[4];
+
+        for (i = 0; i < (int)nbuckets; i++) {
+            if (! fuzzy_message_popvar(msg, &idx) || idx >= FUZZY_HISTOGRAM_BUCKETS ||
+              ! fuzzy_message_popvar64(msg, &val[5]))
+                return false;
+            cs->latency.buckets[idx] = val[5];
+            cs->latency.count += val[5];
+        }
+    }
+    /* sent by newer servers only */
+    if (msg->cursor > 0) {
+        if (! fuzzy_message_popvar64(msg, &val[0]))
+            return false;
+        stats->syscalls = val[0];
+    }
+    if (msg->cursor > 0) {
+        if (! fuzzy_message_popvar64(msg, &val[0]))
+            return false;
+        stats->timeouts = val[0];
+    }
+    return true;
+}
+
+/* needs an authenticated connection */
+bool fuzzy_protocol_server_stats(int svsock, FuzzyMessage * msg, FuzzyServerStats * stats)
+{
+    fuzzy_message_push8(msg, FUZZY_COMMAND_STATS);
+    fuzzy_message_send(svsock, msg);
+
+    if (! _check_return_netcode(msg, svsock))
+        return false;
+    if (! fuzzy_protocol_pop_stats(msg, stats)) {
+        fuzzy_error("Malformed server stats");
+        return false;
+    }
+    return true;
+}
+
+static FuzzyCommand * _batch_next(FuzzyChannelBatch * batch)
+{
+    if (batch->count == FUZZY_CHANNEL_BATCH)
+        fuzzy_critical("Channel batch overflow");
+    batch->cmds[batch->count].reqid = 0;
+    return &batch->cmds[batch->count++];
+}
+
+/* appends the action, returns true when the batch is full */
+bool fuzzy_protocol_batch_add(FuzzyChannelBatch * batch, FUZZY_MESSAGE_TYPES type, struct FuzzyCommandPlayer * player)
+{
+    FuzzyCommand * cmd = _batch_next(batch);
+
+    cmd->type = type;
+    cmd->data.player = *player;
+    return batch->count == FUZZY_CHANNEL_BATCH;
+}
+
+/* pushes the batch and empties it. Newest commands go first, so they are popped last */
+void fuzzy_protocol_push_batch(FuzzyMessage * msg, FuzzyChannelBatch * batch)
+{
+    int i;
+
+    for (i = batch->count-1; i >= 0; i--)
+        fuzzy_protocol_push_command(msg, &batch->cmds[i], 0);
+    batch->count = 0;
+}
+
+/* Opens the udp channel for the current room. The client must be inside a room
+    and the server must support FUZZY_CAP_CHANNEL. */
+bool fuzzy_protocol_channel_open(int svsock, FuzzyMessage * msg, FuzzyChannel * channel)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    ubyte16 port;
+
+    if (! (fuzzy_protocol_peer_caps(svsock) & FUZZY_CAP_CHANNEL)) {
+        fuzzy_error("Server does not support udp channels");
+        return false;
+    }
+
+    fuzzy_message_push8(msg, FUZZY_COMMAND_CHANNEL_OPEN);
+    fuzzy_message_send(svsock, msg);
+
+    if (! _check_return_netcode(msg, svsock))
+        return false;
+
+    bzero(channel, sizeof(FuzzyChannel));
+    channel->id = fuzzy_message_pop32(msg);
+    channel->key = fuzzy_message_pop32(msg);
+    port = fuzzy_message_pop16(msg);
+
+    /* same server host, reactor specific port */
+    fuzzy_lz_perror(getpeername(svsock, (struct sockaddr *) &addr, &addrlen));
+    addr.sin_port = htons(port);
+    fuzzy_lz_perror(channel->socket = socket(AF_INET, SOCK_DGRAM, 0));
+    fuzzy_lz_perror(connect(channel->socket, (struct sockaddr *) &addr, sizeof(addr)));
+
+    /* tell the server our address. If lost, the first action does it */
+    fuzzy_protocol_channel_flush(channel, msg);
+    return true;
+}
+
+void fuzzy_protocol_channel_close(FuzzyChannel * channel)
+{
+    if (channel->socket >= 0)
+        close(channel->socket);
+    channel->socket = -1;
+}
+
+/* queues a player action, sending the batch when full */
+void fuzzy_protocol_channel_action(FuzzyChannel * channel, FuzzyMessage * msg, FUZZY_MESSAGE_TYPES type, struct FuzzyCommandPlayer * player)
+{
+    if (fuzzy_protocol_batch_add(&channel->batch, type, player))
+        fuzzy_protocol_channel_flush(channel, msg);
+}
+
+/* acks a state, also subscribing to them with tick 0. Only the newest ack
+    of the batch is sent */
+void fuzzy_protocol_channel_ack(FuzzyChannel * channel, FuzzyMessage * msg, ubyte32 tick)
+{
+    FuzzyCommand * cmd;
+    int i;
+
+    for (i = 0; i < channel->batch.count; i++) {
+        cmd = &channel->batch.cmds[i];
+        if (cmd->type == FUZZY_COMMAND_STATE_ACK) {
+            cmd->data.state.tick = tick;
+            return;
+        }
+    }
+
+    cmd = _batch_next(&channel->batch);
+    cmd->type = FUZZY_COMMAND_STATE_ACK;
+    cmd->data.state.tick = tick;
+    if (channel->batch.count == FUZZY_CHANNEL_BATCH)
+        fuzzy_protocol_channel_flush(channel, msg);
+}
+
+/* sends the queued commands in a single datagram, call it once per tick.
+    msg is left empty */
+void fuzzy_protocol_channel_flush(FuzzyChannel * channel, FuzzyMessage * msg)
+{
+    fuzzy_message_clear(msg);
+    fuzzy_protocol_push_batch(msg, &channel->batch);
+    fuzzy_message_push32(msg, ++channel->seq_out);
+    fuzzy_message_push32(msg, channel->key);
+    fuzzy_message_push32(msg, channel->id);
+    fuzzy_message_sendto(channel->socket, msg, NULL);
+    fuzzy_message_clear(msg);
+}
+
+/* reads a datagram without waiting and decodes up to maxcmds commands.
+    Returns the number of commands, 0 when nothing new arrived. A state is
+    always the last command, its delta is left into msg */
+int fuzzy_protocol_channel_recv(FuzzyChannel * channel, FuzzyMessage * msg, FuzzyCommand * cmds, int maxcmds)
+{
+    ubyte32 seq;
+    int n = 0;
+
+    while (fuzzy_message_recvfrom(channel->socket, msg, NULL) == FUZZY_RECV_MORE) {
+        if (msg->cursor < 4)
+            continue;
+
+        seq = fuzzy_message_pop32(msg);
+        if (! fuzzy_protocol_seq_after(seq, channel->seq_in)) {
+            channel->stale++;
+            continue;
+        }
+        channel->seq_in = seq;
+
+        while (msg->cursor > 0 && n < maxcmds) {
+            if (! fuzzy_protocol_decode_message(msg, &cmds[n]))
+                break;
+            if (cmds[n].type == FUZZY_COMMAND_STATE)
+                return n + 1;
+            if (! fuzzy_protocol_is_player_action(cmds[n].type))
+                break;
+            n++;
+        }
+        if (n > 0)
+            return n;
+    }
+    return 0;
+}
+
+/* needs a server with FUZZY_CAP_REQID, after authentication */
+bool fuzzy_protocol_async_init(FuzzyAsync * async, int svsock, FuzzyAsyncPush on_push, void * data)
+{
+    if (! (fuzzy_protocol_peer_caps(svsock) & FUZZY_CAP_REQID))
+        return false;
+
+    bzero(async, sizeof(FuzzyAsync));
+    async->socket = svsock;
+    async->next_reqid = 1;
+    async->on_push = on_push;
+    async->push_data = data;
+    fuzzy_ring_init(&async->inbuf, FUZZY_RING_DEFAULT_SIZE);
+    async->inbuf.inflate = (fuzzy_protocol_peer_caps(svsock) & FUZZY_CAP_DEFLATE) != 0;
+    return true;
+}
+
+/* pending requests are forgotten, their callbacks never run */
+void fuzzy_protocol_async_free(FuzzyAsync * async)
+{
+    fuzzy_ring_free(&async->inbuf);
+    free(async->pending);
+    async->pending = NULL;
+    async->pending_count = async->pending_size = 0;
+}
+
+/* sends the command in msg, as built for the blocking call, tagged with a new
+    request id. Returns the id. msg is left empty */
+ubyte32 fuzzy_protocol_async_submit(FuzzyAsync * async, FuzzyMessage * msg, FuzzyAsyncReply callback, void * data)
+{
+    FuzzyAsyncRequest * req;
+    ubyte8 type;
+
+    if (async->pending_count == async->pending_size) {
+        async->pending_size = async->pending_size ? async->pending_size * 2 : 16;
+        fuzzy_iz_perror(async->pending = (FuzzyAsyncRequest *) realloc(async->pending, async->pending_size * sizeof(FuzzyAsyncRequest)));
+    }
+    req = &async->pending[async->pending_count++];
+    req->reqid = async->next_reqid;
+    req->callback = callback;
+    req->data = data;
+
+    /* 0 means untagged */
+    if (++async->next_reqid == 0)
+        async->next_reqid = 1;
+
+    type = fuzzy_message_pop8(msg);
+    fuzzy_message_pushvar(msg, req->reqid);
+    fuzzy_message_push8(msg, type | FUZZY_COMMAND_FLAG_REQID);
+    fuzzy_message_send(async->socket, msg);
+    fuzzy_message_clear(msg);
+    return req->reqid;
+}
+
+ubyte32 fuzzy_protocol_async_create_room(FuzzyAsync * async, FuzzyMessage * msg, char * name, FuzzyAsyncReply callback, void * data)
+{
+    _push_create_room(async->socket, msg, name);
+    return fuzzy_protocol_async_submit(async, msg, callback, data);
+}
+
+ubyte32 fuzzy_protocol_async_join(FuzzyAsync * async, FuzzyMessage * msg, ulong roomid, FuzzyAsyncReply callback, void * data)
+{
+    _push_join(msg, roomid);
+    return fuzzy_protocol_async_submit(async, msg, callback, data);
+}
+
+ubyte32 fuzzy_protocol_async_game_start(FuzzyAsync * async, FuzzyMessage * msg, FuzzyAsyncReply callback, void * data)
+{
+    fuzzy_message_push8(msg, FUZZY_COMMAND_GAME_START);
+    return fuzzy_protocol_async_submit(async, msg, callback, data);
+}
+
+ubyte32 fuzzy_protocol_async_leave(FuzzyAsync * async, FuzzyMessage * msg, FuzzyAsyncReply callback, void * data)
+{
+    fuzzy_message_push8(msg, FUZZY_COMMAND_GAME_LEAVE);
+    return fuzzy_protocol_async_submit(async, msg, callback, data);
+}
+
+ubyte32 fuzzy_protocol_async_ping(FuzzyAsync * async, FuzzyMessage * msg, FuzzyAsyncReply callback, void * data)
+{
+    fuzzy_message_push8(msg, FUZZY_COMMAND_PING);
+    return fuzzy_protocol_async_submit(async, msg, callback, data);
+}
+
+/* completes the request a reply is for */
+static bool _async_reply(FuzzyAsync * async, FuzzyMessage * msg)
+{
+    FuzzyAsyncRequest req;
+    ubyte32 reqid;
+    bool ok;
+    int i;
+
+    if (! fuzzy_message_popvar(msg, &reqid))
+        return false;
+
+    /* replies usually come in order */
+    for (i = 0; i < async->pending_count && async->pending[i].reqid != reqid; i++);
+    if (i == async->pending_count) {
+        fuzzy_error(fuzzy_sformat("Reply to unknown request %u", reqid));
+        return false;
+    }
+    req = async->pending[i];
+    memmove(&async->pending[i], &async->pending[i+1], (async->pending_count - i - 1) * sizeof(FuzzyAsyncRequest));
+    async->pending_count--;
+
+    ok = _pop_netcode(msg);
+    if (req.callback)
+        req.callback(async, msg, ok, req.data);
+    return true;
+}
+
+static bool _async_dispatch(FuzzyAsync * async, FuzzyMessage * msg)
+{
+    FuzzyCommand cmd;
+
+    if (msg->cursor > 0 && msg->buffer[msg->cursor-1] == FUZZY_COMMAND_REPLY) {
+        fuzzy_message_pop8(msg);
+        return _async_reply(async, msg);
+    }
+
+    if (! fuzzy_protocol_decode_message(msg, &cmd))
+        return false;
+    if (async->on_push)
+        async->on_push(async, msg, &cmd, async->push_data);
+    return true;
+}
+
+/* waits up to timeout ms (-1 forever, 0 not at all) for server messages,
+    then runs the callbacks of all the received ones. Returns how many there
+    were, -1 if the connection was closed or broken */
+int fuzzy_protocol_async_poll(FuzzyAsync * async, FuzzyMessage * msg, int timeout)
+{
+    struct pollfd pfd = {.fd = async->socket, .events = POLLIN};
+    FUZZY_FRAME_STATUS frame;
+    int rv, count = 0;
+
+    while (true) {
+        while ((frame = fuzzy_message_extract(&async->inbuf, msg)) == FUZZY_FRAME_READY) {
+            if (! _async_dispatch(async, msg))
+                return -1;
+            count++;
+        }
+        if (frame == FUZZY_FRAME_INVALID)
+            return -1;
+
+        /* only wait until something arrives */
+        do {
+            rv = poll(&pfd, 1, count ? 0 : timeout);
+        } while (rv < 0 && errno == EINTR);
+        fuzzy_lz_perror(rv);
+        if (rv == 0)
+            return count;
+
+        /* the socket is readable, a single read does not block */
+        if (fuzzy_ring_recv(async->socket, &async->inbuf) == FUZZY_RECV_CLOSED)
+            return -1;
+    }
+}
@@ -19,53 +19,226 @@
 #define __FUZZY_PROTOCOL_H
 
 #include "server.h"
+#include "snapshot.h"
+
+/* Protocol revision, exchanged on authentication. Version 0 clients do not
+   send it and only understand fixed size strings. */
+#define FUZZY_PROTOCOL_VERSION 1
+
+/* Capabilities, negotiated on authentication */
+#define FUZZY_CAP_VARSTR (1 << 0)               // length prefixed strings
+#define FUZZY_CAP_CHANNEL (1 << 1)              // udp channel for player actions
+#define FUZZY_CAP_STATE (1 << 2)                // room state replication
+#define FUZZY_CAP_DEFLATE (1 << 3)              // big messages may be compressed
+#define FUZZY_CAP_REQID (1 << 4)                // tagged requests, see FuzzyAsync
+#define FUZZY_PROTOCOL_CAPS (FUZZY_CAP_VARSTR | FUZZY_CAP_CHANNEL | FUZZY_CAP_STATE | FUZZY_CAP_DEFLATE |\
+  FUZZY_CAP_REQID)
+
+/* Set on the command type when its strings are length prefixed */
+#define FUZZY_COMMAND_FLAG_VARSTR 0x80
+/* Set on the command type when a request id follows it */
+#define FUZZY_COMMAND_FLAG_REQID 0x40
 
 /* Return codes */
 #define FUZZY_NETERROR_CHARS 256
 typedef enum FUZZY_NETCODES {
     FUZZY_NETCODE_OK,
-    FUZZY_NETCODE_ERROR
+    FUZZY_NETCODE_ERROR,
+    FUZZY_NETCODE_ERROR_VARSTR              // error with a length prefixed string
 } FUZZY_NETCODES;
 
+/* Command schema: every message type once, by type value, with the fields
+   of the command in the order they are popped. protocol.c generates from it
+   the encoders, the decoders and their size checks.
+
+   X(name, fields, optional, size, check)
+     fields     F(kind, member, len) list, members of union FuzzyCommandData:
+                U8, U32: fixed size integers, network order
+                STR: fixed size string of len bytes
+                NAME: like STR, length prefixed with FUZZY_COMMAND_FLAG_VARSTR
+                VAR, SVAR: varint and zigzag varint, 1 to 5 bytes
+     optional   fields which older peers do not send, all or none
+     size       EXACT: nothing follows, MIN: more may follow, like the state
+                delta or the other commands of a datagram. NONE: not decoded
+     check      validates the decoded command, NULL if none */
+#define FUZZY_FIELDS_NONE(F)
+#define FUZZY_FIELDS_AUTH(F)        F(STR, auth.key, FUZZY_SERVERKEY_LEN)
+#define FUZZY_FIELDS_AUTH_V1(F)     F(U8, auth.version, 1) F(VAR, auth.caps, 0)
+#define FUZZY_FIELDS_CREATE(F)      F(NAME, room.name, FUZZY_NET_ROOM_LEN)
+#define FUZZY_FIELDS_JOIN(F)        F(U32, room.id, 4)
+#define FUZZY_FIELDS_PLAYER(F)      F(VAR, player.x, 0) F(VAR, player.y, 0) F(SVAR, player.dx, 0) F(SVAR, player.dy, 0)
+#define FUZZY_FIELDS_STATE(F)       F(VAR, state.tick, 0) F(VAR, state.base, 0)
+#define FUZZY_FIELDS_STATE_ACK(F)   F(VAR, state.tick, 0)
+
+#define FUZZY_COMMAND_SCHEMA(X)\
+    X(SHUTDOWN,         FUZZY_FIELDS_NONE,      FUZZY_FIELDS_NONE,      MIN,    NULL)\
+    X(AUTHENTICATE,     FUZZY_FIELDS_AUTH,      FUZZY_FIELDS_AUTH_V1,   MIN,    NULL)\
+    X(GAME_CREATE,      FUZZY_FIELDS_CREATE,    FUZZY_FIELDS_NONE,      MIN,    NULL)\
+    X(GAME_JOIN,        FUZZY_FIELDS_JOIN,      FUZZY_FIELDS_NONE,      MIN,    NULL)\
+    X(GAME_START,       FUZZY_FIELDS_NONE,      FUZZY_FIELDS_NONE,      EXACT,  NULL)\
+    X(GAME_FINISH,      FUZZY_FIELDS_NONE,      FUZZY_FIELDS_NONE,      NONE,   NULL)\
+    X(PLAYER_STEP,      FUZZY_FIELDS_PLAYER,    FUZZY_FIELDS_NONE,      MIN,    NULL)\
+    X(PLAYER_MOVE,      FUZZY_FIELDS_PLAYER,    FUZZY_FIELDS_NONE,      MIN,    NULL)\
+    X(PLAYER_ATTACK,    FUZZY_FIELDS_PLAYER,    FUZZY_FIELDS_NONE,      MIN,    NULL)\
+    /* owner leaving closes the room */\
+    X(GAME_LEAVE,       FUZZY_FIELDS_NONE,      FUZZY_FIELDS_NONE,      EXACT,  NULL)\
+    /* udp channel for the current room */\
+    X(CHANNEL_OPEN,     FUZZY_FIELDS_NONE,      FUZZY_FIELDS_NONE,      EXACT,  NULL)\
+    /* room state delta, server to client */\
+    X(STATE,            FUZZY_FIELDS_STATE,     FUZZY_FIELDS_NONE,      MIN,    _check_state)\
+    /* last state received, client to server */\
+    X(STATE_ACK,        FUZZY_FIELDS_STATE_ACK, FUZZY_FIELDS_NONE,      MIN,    NULL)\
+    /* server statistics, authenticated */\
+    X(STATS,            FUZZY_FIELDS_NONE,      FUZZY_FIELDS_NONE,      EXACT,  NULL)\
+    /* request id and return code of a tagged request, see FuzzyAsync */\
+    X(REPLY,            FUZZY_FIELDS_NONE,      FUZZY_FIELDS_NONE,      NONE,   NULL)\
+    /* keepalive, echoed by the server */\
+    X(PING,             FUZZY_FIELDS_NONE,      FUZZY_FIELDS_NONE,      EXACT,  NULL)
+
 /* Message types */
+#define _FUZZY_COMMAND_ENUM(name, fields, optional, size, check) FUZZY_COMMAND_##name,
 typedef enum FUZZY_MESSAGE_TYPES {
-    FUZZY_COMMAND_SHUTDOWN,
-    FUZZY_COMMAND_AUTHENTICATE,
-    FUZZY_COMMAND_GAME_CREATE,
-    FUZZY_COMMAND_GAME_JOIN,
-    FUZZY_COMMAND_GAME_START,
-    FUZZY_COMMAND_GAME_FINISH,
-
-    FUZZY_COMMAND_PLAYER_STEP,
-    FUZZY_COMMAND_PLAYER_MOVE,
-    FUZZY_COMMAND_PLAYER_ATTACK
+    FUZZY_COMMAND_SCHEMA(_FUZZY_COMMAND_ENUM)
+    FUZZY_COMMAND_COUNT
 } FUZZY_MESSAGE_TYPES;
+#undef _FUZZY_COMMAND_ENUM
+
+#define fuzzy_protocol_is_player_action(type)\
+    ((type) == FUZZY_COMMAND_PLAYER_STEP || (type) == FUZZY_COMMAND_PLAYER_MOVE || (type) == FUZZY_COMMAND_PLAYER_ATTACK)
 
 /* Command specific data */
 struct FuzzyCommandAuth {
     char key[FUZZY_SERVERKEY_LEN];
+    ubyte8 version;
+    ubyte32 caps;
 };
 struct FuzzyCommandRoom {
     ulong id;
     char name[FUZZY_NET_ROOM_LEN];
 };
+/* chess at x,y acts on x+dx,y+dy. Fields are varint encoded */
+struct FuzzyCommandPlayer {
+    ulong x;
+    ulong y;
+    long dx;
+    long dy;
+};
+/* the delta from base to tick follows the command, acks only carry tick */
+struct FuzzyCommandState {
+    ubyte32 tick;
+    ubyte32 base;
+};
 union FuzzyCommandData {
     struct FuzzyCommandAuth auth;
     struct FuzzyCommandRoom room;
+    struct FuzzyCommandPlayer player;
+    struct FuzzyCommandState state;
 };
 
 typedef struct FuzzyCommand {
     FUZZY_MESSAGE_TYPES type;
+    ubyte32 reqid;                      // 0 if the request is not tagged
     union FuzzyCommandData data;
 } FuzzyCommand;
 
+/* Udp channel: player actions and state, latest state wins. Lost datagrams
+   are not sent again and datagrams older than the last received are dropped.
+   Client datagrams carry channel id, key and sequence, server datagrams the
+   sequence only, followed by the batched commands in the order they happened.
+   A state command takes the rest of the datagram, so it comes last. */
+#define FUZZY_CHANNEL_BATCH 32                  // commands per datagram, 41 bytes max each
+#define FUZZY_CHANNEL_HEADER_SIZE 12
+
+/* serial number comparison, sequences can wrap */
+#define fuzzy_protocol_seq_after(seq, last) ((int32_t)((seq) - (last)) > 0)
+
+/* player actions and state acks */
+typedef struct FuzzyChannelBatch {
+    int count;
+    FuzzyCommand cmds[FUZZY_CHANNEL_BATCH];
+} FuzzyChannelBatch;
+
+typedef struct FuzzyChannel {
+    int socket;                         // connected udp socket
+    ubyte32 id;
+    ubyte32 key;
+    ubyte32 seq_out;
+    ubyte32 seq_in;
+    ulong stale;                        // datagrams dropped for being old
+    FuzzyChannelBatch batch;
+} FuzzyChannel;
+
+
+/* State replication: clients subscribe by acking tick 0. Each state is a
+   delta against the last state acked by the client, which is implicit on the
+   stream. Channel clients ack the states they apply. */
+
+/* Asynchronous requests: each one is tagged with an id and pipelined on the
+   stream, without waiting for the previous replies. The server sends back the
+   id with the return code, anything else is a push like GAME_START or STATE.
+   Callbacks run inside fuzzy_protocol_async_poll; on success the reply data
+   is left into msg, as for the blocking calls. Blocking calls must not be
+   made on the socket while requests are pending. */
+struct FuzzyAsync;
+typedef void (*FuzzyAsyncReply)(struct FuzzyAsync * async, FuzzyMessage * msg, bool ok, void * data);
+typedef void (*FuzzyAsyncPush)(struct FuzzyAsync * async, FuzzyMessage * msg, FuzzyCommand * cmd, void * data);
+
+typedef struct FuzzyAsyncRequest {
+    ubyte32 reqid;
+    FuzzyAsyncReply callback;           // can be NULL
+    void * data;
+} FuzzyAsyncRequest;
+
+typedef struct FuzzyAsync {
+    int socket;
+    ubyte32 next_reqid;
+    FuzzyRingBuffer inbuf;
+    FuzzyAsyncRequest * pending;        // in submission order
+    int pending_count;
+    int pending_size;
+    FuzzyAsyncPush on_push;             // can be NULL
+    void * push_data;
+} FuzzyAsync;
 
 /* Functions */
 bool fuzzy_protocol_decode_message(FuzzyMessage * msg, FuzzyCommand * cmd);
+// Tagged if cmd->reqid is set. Strings are length prefixed if caps has FUZZY_CAP_VARSTR
+void fuzzy_protocol_push_command(FuzzyMessage * msg, const FuzzyCommand * cmd, ubyte32 caps);
+const char * fuzzy_protocol_command_name(FUZZY_MESSAGE_TYPES type);
+ubyte32 fuzzy_protocol_peer_caps(int svsock);
 bool fuzzy_protocol_server_shutdown(int svsock, FuzzyMessage * msg);
 bool fuzzy_protocol_authenticate(int svsock, FuzzyMessage * msg, char * key);
 ulong fuzzy_protocol_create_room(int svsock, FuzzyMessage * msg, char * name);
 bool fuzzy_protocol_join(int svsock, FuzzyMessage * msg, ulong roomid);
 bool fuzzy_protocol_game_start(int svsock, FuzzyMessage * msg);
+bool fuzzy_protocol_leave(int svsock, FuzzyMessage * msg);
+bool fuzzy_protocol_ping(int svsock, FuzzyMessage * msg);
+void fuzzy_protocol_push_player_action(FuzzyMessage * msg, FUZZY_MESSAGE_TYPES type, struct FuzzyCommandPlayer * player);
+void fuzzy_protocol_player_step(int svsock, FuzzyMessage * msg, ulong x, ulong y, long dx, long dy);
+void fuzzy_protocol_player_move(int svsock, FuzzyMessage * msg, ulong x, ulong y, ulong nx, ulong ny);
+void fuzzy_protocol_player_attack(int svsock, FuzzyMessage * msg, ulong x, ulong y, ulong tx, ulong ty);
+void fuzzy_protocol_push_state(FuzzyMessage * msg, const FuzzySnapshot * base, const FuzzySnapshot * snap);
+bool fuzzy_protocol_apply_state(FuzzyMessage * msg, FuzzyCommand * cmd, FuzzySnapshotHistory * history);
+void fuzzy_protocol_state_subscribe(int svsock, FuzzyMessage * msg);
+bool fuzzy_protocol_batch_add(FuzzyChannelBatch * batch, FUZZY_MESSAGE_TYPES type, struct FuzzyCommandPlayer * player);
+void fuzzy_protocol_push_batch(FuzzyMessage * msg, FuzzyChannelBatch * batch);
+bool fuzzy_protocol_channel_open(int svsock, FuzzyMessage * msg, FuzzyChannel * channel);
+void fuzzy_protocol_channel_close(FuzzyChannel * channel);
+void fuzzy_protocol_channel_action(FuzzyChannel * channel, FuzzyMessage * msg, FUZZY_MESSAGE_TYPES type, struct FuzzyCommandPlayer * player);
+void fuzzy_protocol_channel_ack(FuzzyChannel * channel, FuzzyMessage * msg, ubyte32 tick);
+void fuzzy_protocol_channel_flush(FuzzyChannel * channel, FuzzyMessage * msg);
+void fuzzy_protocol_push_stats(FuzzyMessage * msg, const FuzzyServerStats * stats);
+bool fuzzy_protocol_pop_stats(FuzzyMessage * msg, FuzzyServerStats * stats);
+bool fuzzy_protocol_server_stats(int svsock, FuzzyMessage * msg, FuzzyServerStats * stats);
+int fuzzy_protocol_channel_recv(FuzzyChannel * channel, FuzzyMessage * msg, FuzzyCommand * cmds, int maxcmds);
+bool fuzzy_protocol_async_init(FuzzyAsync * async, int svsock, FuzzyAsyncPush on_push, void * data);
+void fuzzy_protocol_async_free(FuzzyAsync * async);
+ubyte32 fuzzy_protocol_async_submit(FuzzyAsync * async, FuzzyMessage * msg, FuzzyAsyncReply callback, void * data);
+ubyte32 fuzzy_protocol_async_create_room(FuzzyAsync * async, FuzzyMessage * msg, char * name, FuzzyAsyncReply callback, void * data);
+ubyte32 fuzzy_protocol_async_join(FuzzyAsync * async, FuzzyMessage * msg, ulong roomid, FuzzyAsyncReply callback, void * data);
+ubyte32 fuzzy_protocol_async_game_start(FuzzyAsync * async, FuzzyMessage * msg, FuzzyAsyncReply callback, void * data);
+ubyte32 fuzzy_protocol_async_leave(FuzzyAsync * async, FuzzyMessage * msg, FuzzyAsyncReply callback, void * data);
+ubyte32 fuzzy_protocol_async_ping(FuzzyAsync * async, FuzzyMessage * msg, FuzzyAsyncReply callback, void * data);
+int fuzzy_protocol_async_poll(FuzzyAsync * async, FuzzyMessage * msg, int timeout);
 
 #endif
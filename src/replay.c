@@ -0,0 +1,104 @@
+/*
+ * Emanuele Faranda         black.silver@hotmail.it
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Replays a server journal on headless games, at full speed: post-mortems
+ * of the rooms, deterministic repros and a workload for the game engine.
+ * The digest of the final room states is the same on every run of the
+ * same journal, unless the game rules changed.
+ *
+ */
+
+#include <unistd.h>
+#include <time.h>
+#include "fuzzy.h"
+#include "protocol.h"
+#include "journal.h"
+
+/* options */
+static bool Verbose = false;
+static ulong RoomFilter = 0;            // 0 for all the rooms
+static int Runs = 1;
+
+static ulong _now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void _print_room(FuzzyReplay * replay, FuzzyReplayRoom * room, void * data)
+{
+    FuzzyPlayer * player;
+    FuzzyChess * chess;
+
+    printf("room %lu at %.2f s%s\n", room->id, (double) room->steps / replay->tick_rate, room->started ? "" : ", not started");
+    for (player = room->game->players; player; fuzzy_list_next(player)) {
+        printf("  player %d%s: %u sp", player->id, player->id == room->owner ? " (owner)" : "", player->soul_points);
+        for (chess = player->chess_l; chess; fuzzy_list_next(chess))
+            printf(", chess %lu at %lu,%lu", chess->id, chess->x, chess->y);
+        printf("\n");
+    }
+}
+
+static void _usage(char * prog)
+{
+    fprintf(stderr, "Usage: %s [-v] [-r room] [-n runs] journal\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char * argv[])
+{
+    FuzzyJournalMap map;
+    FuzzyReplay replay;
+    ulong start, elapsed;
+    size_t i;
+    int opt, run;
+
+    while ((opt = getopt(argc, argv, "vr:n:")) != -1) {
+        switch (opt) {
+            case 'v': Verbose = true; break;
+            case 'r': RoomFilter = strtoul(optarg, NULL, 0); break;
+            case 'n': Runs = atoi(optarg); break;
+            default: _usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || Runs <= 0)
+        _usage(argv[0]);
+    if (! fuzzy_journal_map(&map, argv[optind]))
+        fuzzy_critical(fuzzy_sformat("%s is not a journal", argv[optind]));
+    printf("%zu records at %u ticks/s\n", map.count, map.header->tick_rate);
+
+    for (run = 0; run < Runs; run++) {
+        fuzzy_replay_init(&replay, map.header->tick_rate);
+        /* rooms are printed once */
+        if (Verbose && run == 0)
+            replay.on_close = _print_room;
+
+        start = _now_ns();
+        for (i = 0; i < map.count; i++)
+            if (RoomFilter == 0 || map.records[i].room == RoomFilter)
+                fuzzy_replay_record(&replay, &map.records[i]);
+        fuzzy_replay_finish(&replay);
+        elapsed = _now_ns() - start;
+
+        printf("%lu records, %lu rooms, %lu actions in %.3f s: %.0f records/s\n", replay.records, replay.rooms_created,
+          replay.actions, elapsed / 1e9, elapsed ? replay.records / (elapsed / 1e9) : 0.0);
+    }
+    printf("digest %016lx, %lu mismatches\n", replay.digest, replay.mismatches);
+
+    fuzzy_journal_unmap(&map);
+    return replay.mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
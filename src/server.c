@@ -17,22 +17,173 @@
 
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <sys/random.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <uuid/uuid.h>
 #include "fuzzy.h"
 #include "server.h"
 #include "network.h"
 #include "protocol.h"
+#include "game.h"
+#include "snapshot.h"
+#include "uring.h"
+#include "journal.h"
+
+/* same host transports: compression only costs cpu, udp channels need an ip
+    peer */
+#define HOST_CAPS (FUZZY_PROTOCOL_CAPS & ~(FUZZY_CAP_DEFLATE | FUZZY_CAP_CHANNEL))
+
+/* Per thread server state. Every reactor owns a listening socket and the
+    clients accepted on it; rooms are pinned to the reactor of their owner. */
+typedef struct FuzzyReactor {
+    int id;
+    int socket;                         // listening socket
+    int unixsock;                       // unix domain listener, -1 if none
+    int wakefd;                         // eventfd: mailbox or shutdown
+    int tickfd;                         // timerfd: room ticks
+    FuzzyTimerWheel timers;             // client timeouts, on the tick clock
+    pthread_t thread;
+    FuzzyClient ** clients;             // indexed by socket
+    int clients_size;
+    int clients_count;
+    int * pending;                      // sockets to close or hand off after the current events
+    int pending_size;
+    int pending_count;
+    int epfd;                           // epoll backend only
+    FuzzyUring * uring;                 // io_uring backend only
+    int uring_ops;                      // client requests in flight
+    fd_set readset;                     // select backend only
+    fd_set writeset;
+    int udpsock;                        // player actions channel
+    ubyte16 udpport;
+    FuzzyMessage * dgram;               // outgoing datagrams
+    FuzzyMessage * state;               // room state shared by the stream clients
+    int * dirty;                        // sockets with batched channel actions
+    int dirty_size;
+    int dirty_count;
+    int * locals;                       // sockets of the in-process clients
+    int locals_size;
+    int locals_count;
+    struct FuzzyRoom ** rooms;          // rooms owned by the reactor
+    int rooms_size;
+    int rooms_count;
+    FuzzyServerStats stats;             // written by the reactor only, see _stats_add
+    int out_type;                       // command type counting the queued frames, -1 for none
+
+    /* clients handed off by other reactors */
+    pthread_mutex_t mailbox_lock;
+    FuzzyClient * mailbox;
+} FuzzyReactor;
+
+/* Udp channel of a client inside a room */
+typedef struct FuzzyClientChannel {
+    ubyte32 key;
+    ubyte32 seq_in;                     // last accepted client sequence
+    ubyte32 seq_out;
+    struct sockaddr_in addr;            // follows the last valid datagram
+    bool bound;                         // addr is known
+    bool dirty;                         // batch is sent after the current events
+    FuzzyChannelBatch batch;
+} FuzzyClientChannel;
+
+/* io_uring state of a client. A client with requests in flight stays on its
+    reactor: its close or handoff waits for them, see _uring_quiesce */
+typedef struct FuzzyClientUring {
+    int ops;                            // requests in flight
+    bool receiving;                     // multishot recv, or the eventfd poll of a local link
+    bool sending;                       // a sendmsg gathering the queued frames
+    bool quiescing;                     // requests cancelled for close or handoff
+    bool eof;                           // peer closed
+    size_t inflight;                    // bytes of the sendmsg
+    struct msghdr mh;
+    struct iovec iov[FUZZY_OUTQUEUE_IOV];
+} FuzzyClientUring;
+
+/* io_uring request kinds, in the low bits of the user data. The rest is a
+    client pointer or a reactor descriptor */
+#define URING_ACCEPT 0                  // listening socket
+#define URING_POLL 1                    // wakefd, tickfd or udp socket
+#define URING_RECV 2                    // client
+#define URING_SEND 3                    // client
+#define URING_CANCEL 4
+#define URING_TAGS 7
+
+/* A player action waiting for the next tick */
+typedef struct FuzzyRoomIntent {
+    ubyte player;                       // player id, it may have left meanwhile
+    FUZZY_MESSAGE_TYPES type;
+    struct FuzzyCommandPlayer action;
+} FuzzyRoomIntent;
+
+/* Game of a room. It advances on the reactor ticks, playing the queued
+    actions; changes are published to the members as a delta against the
+    last state they acked. */
+typedef struct FuzzyRoomState {
+    FuzzyGame * game;                   // headless
+    FuzzySnapshotHistory history;
+    ubyte32 tick;                       // last published state
+    bool dirty;                         // changed since the last published state
+    bool started;
+    ulong steps;                        // game clock, in ticks since the start
+    int index;                          // into the reactor rooms
+    FuzzyRoomIntent * intents;
+    int intents_size;
+    int intents_count;
+} FuzzyRoomState;
+
+/* Room directory entry. A room id is its slot index plus the slot generation,
+    which changes when the room is freed: ids of old rooms never match. */
+typedef struct FuzzyRoomSlot {
+    FuzzyRoom * room;                   // NULL when free
+    uint generation;
+    int next_free;
+} FuzzyRoomSlot;
 
-static int ServerSocket = -1;
 static char ServerKey[FUZZY_SERVERKEY_LEN];
-static bool ServerRun;
-static FuzzyClient * ServerClients = NULL;
-static FuzzyRoom * ServerRooms = NULL;
-static ulong ServerRoomCtr = 1;     // nb. 0 is not considered valid
+static bool ServerRun;                  // shared by the reactors, read through _server_running
+static FuzzyReactor * ServerReactors = NULL;
+static int ServerReactorsCount = 1;
+static FuzzyRoomSlot * ServerRoomSlots = NULL;  // room directory, indexed by room id slot
+static int ServerRoomSlotsSize = 0;
+static int ServerRoomsCount = 0;
+static int ServerRoomsFree = -1;        // free slots queue
+static int ServerRoomsFreeTail = -1;
+static pthread_mutex_t ServerRoomsLock = PTHREAD_MUTEX_INITIALIZER;
+static FuzzyServerBackend ServerBackend = FUZZY_SERVER_BACKEND_EPOLL;
+static size_t ServerHighWater = FUZZY_SERVER_HIGHWATER;
+static int ServerTickRate = FUZZY_SERVER_TICK_RATE;
+static int ServerIdleTimeout = FUZZY_SERVER_IDLE_TIMEOUT;
+static int ServerLocalNext = 0;         // reactor of the next in-process client
+static FuzzyAddress ServerUnixAddress;  // len is 0 without a unix listener
+static char * ServerJournalPath = NULL;
+static FuzzyJournal * ServerJournal = NULL;     // each reactor is a producer
+static __thread FuzzyReactor * Reactor = NULL;  // reactor of the current thread
+
+/* Reactor counters have a single writer and can be read by any thread:
+    relaxed stores avoid both locked instructions and torn reads */
+#define _stats_set(field, value) __atomic_store_n(&Reactor->stats.field, (value), __ATOMIC_RELAXED)
+#define _stats_add(field, n) _stats_set(field, Reactor->stats.field + (n))
+#define _stats_sub(field, n) _stats_set(field, Reactor->stats.field - (n))
+
+static void _set_nonblocking(int sock)
+{
+    int flags;
+
+    fuzzy_lz_perror(flags = fcntl(sock, F_GETFL, 0));
+    fuzzy_lz_perror(fcntl(sock, F_SETFL, flags | O_NONBLOCK));
+}
 
 static bool _verify_auth(FuzzyClient * client, FUZZY_MESSAGE_TYPES cmdtype)
 {
@@ -43,297 +194,2302 @@ static bool _verify_auth(FuzzyClient * client, FUZZY_MESSAGE_TYPES cmdtype)
     return true;
 }
 
-static FuzzyClient * _client_connected(int clsock, struct sockaddr_in * sa_addr)
+/* grows the clients table to hold socket index */
+static void _clients_table_fit(int clsock)
+{
+    int nsize;
+
+    if (clsock < Reactor->clients_size)
+        return;
+
+    nsize = fuzzy_max(Reactor->clients_size * 2, FUZZY_SERVER_CLIENTS_INITIAL);
+    while (nsize <= clsock)
+        nsize *= 2;
+
+    fuzzy_iz_perror(Reactor->clients = (FuzzyClient **) realloc(Reactor->clients, nsize * sizeof(FuzzyClient *)));
+    bzero(&Reactor->clients[Reactor->clients_size], (nsize - Reactor->clients_size) * sizeof(FuzzyClient *));
+    Reactor->clients_size = nsize;
+}
+
+/* adds client to the current reactor table */
+static void _client_attach(FuzzyClient * cl)
+{
+    _clients_table_fit(cl->socket);
+    if (Reactor->clients[cl->socket] != NULL)
+        fuzzy_critical(fuzzy_sformat("Socket #%d is already registered", cl->socket));
+    Reactor->clients[cl->socket] = cl;
+    __atomic_store_n(&Reactor->clients_count, Reactor->clients_count + 1, __ATOMIC_RELAXED);
+    _stats_add(queued_bytes, cl->outq.bytes);
+
+    /* a client coming from another reactor starts over on this clock. Local
+        links do not ping, they live as long as their thread keeps them */
+    cl->seen = Reactor->timers.now;
+    if (ServerIdleTimeout > 0 && cl->link == NULL)
+        fuzzy_timer_arm(&Reactor->timers, &cl->idle, cl->seen + (ulong) ServerIdleTimeout * ServerTickRate);
+
+    if (cl->link) {
+        if (Reactor->locals_count == Reactor->locals_size) {
+            Reactor->locals_size = fuzzy_max(Reactor->locals_size * 2, 4);
+            fuzzy_iz_perror(Reactor->locals = (int *) realloc(Reactor->locals, Reactor->locals_size * sizeof(int)));
+        }
+        Reactor->locals[Reactor->locals_count++] = cl->socket;
+    }
+}
+
+/* removes client from the current reactor table, the socket stays open */
+static void _client_detach(FuzzyClient * cl)
+{
+    int i;
+
+    Reactor->clients[cl->socket] = NULL;
+    __atomic_store_n(&Reactor->clients_count, Reactor->clients_count - 1, __ATOMIC_RELAXED);
+    _stats_sub(queued_bytes, cl->outq.bytes);
+    fuzzy_timer_cancel(&cl->idle);
+
+    for (i = 0; cl->link && i < Reactor->locals_count; i++)
+        if (Reactor->locals[i] == cl->socket) {
+            Reactor->locals[i] = Reactor->locals[--Reactor->locals_count];
+            break;
+        }
+}
+
+static FuzzyClient * _client_new(int clsock)
 {
     FuzzyClient * cl;
 
     cl = fuzzy_new(FuzzyClient);
     cl->socket = clsock;
-    strncpy(cl->ip, inet_ntoa(sa_addr->sin_addr), sizeof(cl->ip));
-    cl->port = sa_addr->sin_port;
+    cl->ip[0] = '\0';
+    cl->port = 0;
     cl->auth = false;
+    cl->version = 0;
+    cl->caps = 0;
+    cl->offer = FUZZY_PROTOCOL_CAPS;
+    cl->reqid = 0;
+    cl->link = NULL;
+    cl->uring = NULL;
     cl->room = NULL;
+    cl->joining = 0;
+    cl->channel = NULL;
+    cl->player = NULL;
+    cl->replicated = false;
+    cl->acked = 0;
+    cl->throttled = false;
+    cl->closing = false;
+    cl->seen = 0;
+    fuzzy_timer_init(&cl->idle, cl);
+    fuzzy_ring_init(&cl->inbuf, FUZZY_RING_DEFAULT_SIZE);
+    fuzzy_outqueue_init(&cl->outq);
     fuzzy_list_null(cl);
+    return cl;
+}
 
-    fuzzy_list_prepend(ServerClients, cl);
+static FuzzyClient * _client_connected(int clsock, FuzzyAddress * address)
+{
+    FuzzyClient * cl = _client_new(clsock);
 
+    if (address->addr.sa.sa_family == AF_UNIX) {
+        strcpy(cl->ip, "unix");
+        cl->offer = HOST_CAPS;
+    } else {
+        strncpy(cl->ip, inet_ntoa(address->addr.in.sin_addr), sizeof(cl->ip));
+        cl->port = address->addr.in.sin_port;
+    }
+    _client_attach(cl);
     return cl;
 }
 
 // get or die
 static FuzzyClient * _get_client_by_socket(int clsock)
 {
-    FuzzyClient *cl;
+    FuzzyClient *cl = NULL;
 
-    fuzzy_list_findbyattr(FuzzyClient, ServerClients, socket, clsock, cl);
+    if (clsock >= 0 && clsock < Reactor->clients_size)
+        cl = Reactor->clients[clsock];
 
     if (cl == NULL)
         fuzzy_critical(fuzzy_sformat("Cannot find client for socket #%d", clsock));
     return cl;
 }
 
-/* kick any client out of the room */
-static void _kick_all_out(FuzzyRoom * room)
+/* a client which is being closed or handed off gets no more events here */
+static bool _client_active(FuzzyClient * client)
 {
-    // TODO implement
+    return ! client->closing && ! client->joining;
 }
 
-static void _room_client_disconnected(FuzzyClient * client)
+static void _client_free(FuzzyClient * cl)
 {
-    // TODO notify disconnection
-    fuzzy_list_remove(FuzzyClient, client->room->clients, client);
+    free(cl->channel);
+    free(cl->uring);
+    fuzzy_ring_free(&cl->inbuf);
+    fuzzy_outqueue_free(&cl->outq);
+    free(cl);
 }
 
-static void _client_disconnected(int clsock)
+/* remembers the client socket for the end of the current events */
+static void _client_defer(FuzzyClient * client)
 {
-    FuzzyClient *cl;
+    if (Reactor->pending_count == Reactor->pending_size) {
+        Reactor->pending_size = fuzzy_max(Reactor->pending_size * 2, FUZZY_SERVER_CLIENTS_INITIAL);
+        fuzzy_iz_perror(Reactor->pending = (int *) realloc(Reactor->pending, Reactor->pending_size * sizeof(int)));
+    }
+    Reactor->pending[Reactor->pending_count++] = client->socket;
+}
 
-    cl = _get_client_by_socket(clsock);
+/* marks the client to be closed when the current events have been processed.
+    This is safe while iterating room clients. */
+static void _client_kill(FuzzyClient * client)
+{
+    if (client->closing)
+        return;
 
-    if (cl->room && cl->room->owner == cl)
-        _kick_all_out(cl->room);
-    else
-        _room_client_disconnected(cl);
+    client->closing = true;
+    _client_defer(client);
+}
 
-    fuzzy_list_remove(FuzzyClient, ServerClients, cl);
-    free(cl);
+static struct io_uring_sqe * _uring_sqe(int fd, ubyte8 opcode, ulong data)
+{
+    struct io_uring_sqe * sqe = fuzzy_uring_sqe(Reactor->uring);
+
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = data;
+    return sqe;
 }
 
-static FuzzyRoom * _new_room(FuzzyClient * owner, char * rname)
+static void _uring_poll(int fd, ulong data)
 {
-    FuzzyRoom * room;
+    struct io_uring_sqe * sqe = _uring_sqe(fd, IORING_OP_POLL_ADD, data);
 
-    room = fuzzy_new(FuzzyRoom);
-    room->id = ServerRoomCtr++;
-    strncpy(room->name, rname, FUZZY_NET_ROOM_LEN);
-    room->owner = owner;
-    room->clients = owner;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+}
 
-    owner->room = room;
-    fuzzy_list_prepend(ServerRooms, room);
+static void _uring_accept(int lsock)
+{
+    struct io_uring_sqe * sqe = _uring_sqe(lsock, IORING_OP_ACCEPT, ((ulong) lsock << 3) | URING_ACCEPT);
 
-    return room;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
 }
 
-static void _room_broadcast(FuzzyRoom * room, FuzzyMessage * msg)
+static void _uring_cancel(ulong data)
 {
-    FuzzyClient * cl;
+    struct io_uring_sqe * sqe = _uring_sqe(-1, IORING_OP_ASYNC_CANCEL, URING_CANCEL);
 
-    cl = room->clients;
-    while(cl) {
-        fuzzy_message_send(cl->socket, msg);
-        fuzzy_list_next(cl);
+    sqe->addr = data;
+}
+
+static void _uring_start(FuzzyClient * client)
+{
+    client->uring->ops++;
+    Reactor->uring_ops++;
+}
+
+/* a client waiting to leave is reaped again after its last request */
+static void _uring_done(FuzzyClient * client)
+{
+    client->uring->ops--;
+    Reactor->uring_ops--;
+    if (client->uring->ops == 0 && (client->closing || client->joining))
+        _client_defer(client);
+}
+
+/* a multishot receive into the provided buffers, or a poll on the eventfd
+    of local links. It lasts until cancelled or out of buffers */
+static void _uring_recv(FuzzyClient * client)
+{
+    FuzzyClientUring * cu = client->uring;
+    struct io_uring_sqe * sqe;
+
+    if (cu->receiving || cu->eof || cu->quiescing)
+        return;
+
+    if (client->link) {
+        _uring_poll(client->socket, (ulong) client | URING_RECV);
+    } else {
+        sqe = _uring_sqe(client->socket, IORING_OP_RECV, (ulong) client | URING_RECV);
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
     }
+    cu->receiving = true;
+    _uring_start(client);
 }
 
-static void _fuzzy_net_error(FuzzyMessage * msg, char * err, FuzzyClient * cl)
+/* one sendmsg at a time, gathering the queued frames. Frames queued meanwhile
+    go with the next one */
+static void _uring_send(FuzzyClient * client)
 {
+    FuzzyClientUring * cu = client->uring;
+    struct io_uring_sqe * sqe;
 
-    fuzzy_message_clear(msg);
-    fuzzy_message_pushstr(msg, err, FUZZY_NETERROR_CHARS);
-    fuzzy_message_push8(msg, FUZZY_NETCODE_ERROR);
-    fuzzy_message_send(cl->socket, msg);
+    if (cu->sending || cu->quiescing || client->outq.head == client->outq.tail)
+        return;
+
+    bzero(&cu->mh, sizeof(cu->mh));
+    cu->mh.msg_iov = cu->iov;
+    cu->mh.msg_iovlen = fuzzy_outqueue_iov(&client->outq, cu->iov, FUZZY_OUTQUEUE_IOV, &cu->inflight);
+    sqe = _uring_sqe(client->socket, IORING_OP_SENDMSG, (ulong) client | URING_SEND);
+    sqe->addr = (ulong) &cu->mh;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    cu->sending = true;
+    _uring_start(client);
 }
 
-static void _fuzzy_net_ok(FuzzyMessage * msg, FuzzyClient * cl)
+/* cancels the requests of a client leaving the reactor. A joining client
+    keeps its pending send, the room reactor sends what follows. Returns
+    true if the client must wait for them */
+static bool _uring_quiesce(FuzzyClient * client)
 {
-    fuzzy_message_clear(msg);
-    fuzzy_message_push8(msg, FUZZY_NETCODE_OK);
-    fuzzy_message_send(cl->socket, msg);
+    FuzzyClientUring * cu = client->uring;
+
+    if (cu->ops == 0) {
+        cu->quiescing = false;
+        return false;
+    }
+    if (! cu->quiescing) {
+        cu->quiescing = true;
+        if (cu->receiving)
+            _uring_cancel((ulong) client | URING_RECV);
+        if (cu->sending && client->closing)
+            _uring_cancel((ulong) client | URING_SEND);
+    }
+    return true;
 }
 
-static void _fuzzy_process_message(FuzzyMessage * msg, FuzzyClient * client)
+static void _reactor_wake(FuzzyReactor * reactor)
 {
-    FuzzyCommand cmd;
-    FuzzyRoom * room;
+    fuzzy_lz_perror(eventfd_write(reactor->wakefd, 1));
+}
 
-    if (! fuzzy_protocol_decode_message(msg, &cmd)) {
-        /* bad message */
-        _fuzzy_net_error(msg, "Malformed message", client);
+/* hands a detached client to a reactor */
+static void _reactor_post(FuzzyReactor * reactor, FuzzyClient * client)
+{
+    fuzzy_nz_rerror(pthread_mutex_lock(&reactor->mailbox_lock));
+    fuzzy_list_prepend(reactor->mailbox, client);
+    fuzzy_nz_rerror(pthread_mutex_unlock(&reactor->mailbox_lock));
+    _reactor_wake(reactor);
+}
+
+/* the last side to let go frees the link */
+static void _local_release(FuzzyLocalLink * link)
+{
+    FuzzyMessage * msg;
+    FuzzyFrame * frame;
+
+    if (__atomic_sub_fetch(&link->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    while ((msg = (FuzzyMessage *) fuzzy_queue_pop(&link->requests)) != NULL)
+        fuzzy_message_del(msg);
+    while ((frame = (FuzzyFrame *) fuzzy_queue_pop(&link->replies)) != NULL)
+        fuzzy_frame_unref(frame);
+    fuzzy_queue_free(&link->requests);
+    fuzzy_queue_free(&link->replies);
+    close(link->wakefd);
+    free(link);
+}
+
+/* the fence orders the queue push before reading the flag */
+static void _local_notify(FuzzyLocalLink * link)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (! __atomic_exchange_n(&link->client_signaled, true, __ATOMIC_SEQ_CST))
+        link->notify(link->notify_data);
+}
+
+/* closes the client socket, or leaves its link telling the client. A client
+    which closed first is not notified */
+static void _client_hangup(int clsock, FuzzyLocalLink * link)
+{
+    if (link == NULL) {
+        close(clsock);
         return;
     }
-    fuzzy_debug(fuzzy_sformat("Message[%d bytes] from socket %d", msg->buflen, client->socket));
+    if (! __atomic_exchange_n(&link->closed, true, __ATOMIC_SEQ_CST))
+        link->notify(link->notify_data);
+    _local_release(link);
+}
 
-    switch(cmd.type) {
-        case FUZZY_COMMAND_AUTHENTICATE:
-            if(strncmp(cmd.data.auth.key, ServerKey, FUZZY_SERVERKEY_LEN) != 0) {
-                fuzzy_error(fuzzy_sformat("Bad key: %s", cmd.data.auth.key));
-                _fuzzy_net_error(msg, "Bad key", client);
-                return;
-            } else {
-                fuzzy_debug(fuzzy_sformat("Client %d authenticated", client->socket));
-                client->auth = true;
-            }
-            break;
+/* moves the client to the reactor owning the room it is joining */
+static void _client_handoff(FuzzyClient * client, int target)
+{
+    FuzzyReactor * reactor = &ServerReactors[target];
 
-        case FUZZY_COMMAND_SHUTDOWN:
-            if (_verify_auth(client, FUZZY_COMMAND_SHUTDOWN)) {
-                fuzzy_debug("Server shutdown command received");
-                ServerRun = false;
-            }
-            break;
+    fuzzy_debug(fuzzy_sformat("Client %d moves to reactor %d", client->socket, target));
+    if (ServerBackend == FUZZY_SERVER_BACKEND_SELECT) {
+        FD_CLR(client->socket, &Reactor->readset);
+        FD_CLR(client->socket, &Reactor->writeset);
+    }
+    /* the socket stays open, so it must leave the epoll set explicitly */
+    if (ServerBackend == FUZZY_SERVER_BACKEND_EPOLL)
+        fuzzy_lz_perror(epoll_ctl(Reactor->epfd, EPOLL_CTL_DEL, client->socket, NULL));
+    _client_detach(client);
+    _stats_add(handoffs, 1);
+    _reactor_post(reactor, client);
+}
 
-        case FUZZY_COMMAND_GAME_CREATE:
-            if (client->room != NULL) {
-                _fuzzy_net_error(msg, "Disconnect client first", client);
-                return;
-            }
-            room = _new_room(client, cmd.data.room.name);
-            fuzzy_message_clear(msg);
-            fuzzy_message_push32(msg, room->id);
-            fuzzy_message_push8(msg, FUZZY_NETCODE_OK);
-            fuzzy_message_send(client->socket, msg);
-            break;
+/* writes pending frames, tracking blocked sockets */
+static void _client_flush(FuzzyClient * client)
+{
+    size_t pending = client->outq.bytes;
+    FUZZY_SEND_STATUS status;
 
-        case FUZZY_COMMAND_GAME_START:
-            if (client->room == NULL) {
-                _fuzzy_net_error(msg, "Client is not inside a room", client);
-                return;
-            }
-            if (client->room->owner != client) {
-                _fuzzy_net_error(msg, "Client is the room owner", client);
-                return;
-            }
-            _fuzzy_net_ok(msg, client);
-            fuzzy_message_clear(msg);
-            fuzzy_message_push8(msg, FUZZY_COMMAND_GAME_START);
+    if (client->uring) {
+        /* the ring is gone when the server is destroyed */
+        if (Reactor->uring)
+            _uring_send(client);
+        return;
+    }
 
-            /* notify all about game start */
-            _room_broadcast(client->room, msg);
-            break;
+    if (pending > 0)
+        _stats_add(syscalls, 1);
+    status = fuzzy_outqueue_flush(client->socket, &client->outq);
+    _stats_sub(queued_bytes, pending - client->outq.bytes);
 
-        case FUZZY_COMMAND_GAME_JOIN:
-            if (client->room != NULL) {
-                _fuzzy_net_error(msg, "Disconnect client first", client);
-                return;
-            }
-            fuzzy_list_findbyattr(FuzzyRoom, ServerRooms, id, cmd.data.room.id, room);
-            if (room == NULL) {
-                _fuzzy_net_error(msg, "Room does not exist", client);
-                return;
-            }
-            client->room = room;
-            fuzzy_list_append(FuzzyClient, room->clients, client);
+    switch (status) {
+        case FUZZY_SEND_CLOSED:
+            _client_kill(client);
+            break;
+        case FUZZY_SEND_BLOCKED:
+            _stats_add(stalls, 1);
+            if (ServerBackend == FUZZY_SERVER_BACKEND_SELECT)
+                FD_SET(client->socket, &Reactor->writeset);
             break;
+        case FUZZY_SEND_DONE:
+            if (ServerBackend == FUZZY_SERVER_BACKEND_SELECT && ! client->throttled)
+                FD_CLR(client->socket, &Reactor->writeset);
+            break;
+    }
+}
 
-        default:
-            fuzzy_critical(fuzzy_sformat("Unknown command type '0x%02x'", cmd.type));
+/* queue a frame reference to client, applying the backpressure policy */
+static void _client_queue(FuzzyClient * client, FuzzyFrame * frame)
+{
+    if (client->closing) {
+        fuzzy_frame_unref(frame);
+        return;
+    }
+    if (Reactor->out_type >= 0) {
+        _stats_add(commands[Reactor->out_type].messages_out, 1);
+        _stats_add(commands[Reactor->out_type].bytes_out, frame->len);
+    }
+
+    if (client->link) {
+        /* nothing to flush, a full queue means a stuck client */
+        if (! fuzzy_queue_push(&client->link->replies, frame)) {
+            fuzzy_warning(fuzzy_sformat("Dropping stuck local client %d", client->socket));
+            fuzzy_frame_unref(frame);
+            _stats_add(drops, 1);
+            _client_kill(client);
             return;
+        }
+        _local_notify(client->link);
+        return;
     }
 
-    _fuzzy_net_ok(msg, client);
+    fuzzy_outqueue_push(&client->outq, frame);
+    _stats_add(queued_bytes, frame->len);
+    _client_flush(client);
+
+    if (client->outq.bytes > ServerHighWater * FUZZY_SERVER_DROP_FACTOR) {
+        fuzzy_warning(fuzzy_sformat("Dropping slow client %d: %zu bytes pending", client->socket, client->outq.bytes));
+        _stats_add(drops, 1);
+        _client_kill(client);
+    } else if (client->outq.bytes > ServerHighWater && ! client->throttled) {
+        /* stop reading client requests until its queue drains */
+        fuzzy_debug(fuzzy_sformat("Throttling slow client %d", client->socket));
+        _stats_add(throttles, 1);
+        client->throttled = true;
+        if (client->uring && client->uring->receiving)
+            _uring_cancel((ulong) client | URING_RECV);
+    }
 }
 
-void fuzzy_server_create(int port, char * keyout)
+/* a reference to the frame of msg fitting the client. frames holds the plain
+    and the deflated encodings, each one is made on first use */
+static FuzzyFrame * _client_frame(FuzzyClient * client, FuzzyMessage * msg, FuzzyFrame * frames[2])
 {
-    int yes = 1;
-    struct sockaddr_in sa_srv;
-    uuid_t key;
+    int deflate = (client->caps & FUZZY_CAP_DEFLATE) ? 1 : 0;
 
-    sa_srv.sin_family = AF_INET;
-    sa_srv.sin_port = htons(port);
-    sa_srv.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (frames[deflate] == NULL) {
+        if (deflate) {
+            frames[1] = fuzzy_frame_new_compressed(msg);
+            if (frames[1]->len < FUZZY_FRAME_HEADER_SIZE + msg->cursor) {
+                _stats_add(deflated, 1);
+                _stats_add(deflate_saved, FUZZY_FRAME_HEADER_SIZE + msg->cursor - frames[1]->len);
+            }
+        } else {
+            frames[0] = fuzzy_frame_new(msg);
+        }
+    }
+    return fuzzy_frame_ref(frames[deflate]);
+}
 
-    fuzzy_lz_perror(ServerSocket = socket(AF_INET, SOCK_STREAM, 0));
-    fuzzy_lz_perror(setsockopt(ServerSocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)));
-    uuid_generate_random(key);
-    uuid_unparse_upper(key, ServerKey);
-    fuzzy_debug(fuzzy_sformat("Server key: %s", ServerKey));
+static void _frames_unref(FuzzyFrame * frames[2])
+{
+    if (frames[0])
+        fuzzy_frame_unref(frames[0]);
+    if (frames[1])
+        fuzzy_frame_unref(frames[1]);
+    frames[0] = frames[1] = NULL;
+}
 
-    fuzzy_lz_perror(bind(ServerSocket, (struct sockaddr *)&sa_srv, sizeof(sa_srv)));
-    fuzzy_lz_perror(listen(ServerSocket, FUZZY_SERVER_BACKLOG));
-    fuzzy_debug(fuzzy_sformat("Server listening on port %i", port));
+static void _client_send(FuzzyClient * client, FuzzyMessage * msg)
+{
+    FuzzyFrame * frames[2] = {NULL, NULL};
 
-    strncpy(keyout, ServerKey, FUZZY_SERVERKEY_LEN);
+    _client_queue(client, _client_frame(client, msg, frames));
+    _frames_unref(frames);
 }
 
-void fuzzy_server_destroy()
+/* replies to the request being served, tagged with its id if it had one */
+static void _client_reply(FuzzyClient * client, FuzzyMessage * msg)
 {
-    if (ServerSocket == -1) {
-        fuzzy_error("Server not running");
-    } else {
-        close(ServerSocket);
-        ServerSocket = -1;
-        fuzzy_debug("Server shutdown completed");
+    if (client->reqid != 0) {
+        fuzzy_message_pushvar(msg, client->reqid);
+        fuzzy_message_push8(msg, FUZZY_COMMAND_REPLY);
     }
+    _client_send(client, msg);
 }
 
-void * fuzzy_server_loop(void * args)
+static void _channel_open(FuzzyClient * client)
 {
-    int i;
-    int clsock;
-    struct sockaddr_in sa_addr;
-    fd_set active_fd_set, read_fd_set;
-    socklen_t sa_size;
-    FuzzyMessage * msg;
-    FuzzyClient * client;
+    FuzzyClientChannel * ch;
 
-    if (ServerSocket == -1)
-        fuzzy_critical("Server not running");
+    ch = fuzzy_new(FuzzyClientChannel);
+    bzero(ch, sizeof(FuzzyClientChannel));
+    do {
+        fuzzy_lz_perror(getrandom(&ch->key, sizeof(ch->key), 0));
+    } while (ch->key == 0);
+    client->channel = ch;
+}
 
-    /* Initialize the set of active sockets */
-    FD_ZERO(&active_fd_set);
-    FD_SET(ServerSocket, &active_fd_set);
-    msg = fuzzy_message_new();
+/* pending actions are dropped */
+static void _channel_close(FuzzyClient * client)
+{
+    free(client->channel);
+    client->channel = NULL;
+}
 
-    ServerRun = 1;
-    while(ServerRun) {
-        read_fd_set = active_fd_set;
-        fuzzy_lz_perror(select(FD_SETSIZE, &read_fd_set, NULL, NULL, NULL));
+/* sends the batched actions in a single datagram */
+static void _channel_flush(FuzzyClient * client)
+{
+    FuzzyClientChannel * ch = client->channel;
+    FuzzyMessage * msg = Reactor->dgram;
 
-        for (i = 0; i<FD_SETSIZE; ++i) {
-            if (FD_ISSET(i, &read_fd_set)) {
-                if (i == ServerSocket) {
-                    /* connection request */
-                    sa_size = sizeof(sa_addr);
-                    fuzzy_lz_perror(clsock = accept(ServerSocket, (struct sockaddr *)&sa_addr, &sa_size));
-                    client = _client_connected(clsock, &sa_addr);
-                    fuzzy_debug(fuzzy_sformat("Client %s:%d connected -> socket #%d", client->ip, client->port, client->socket));
+    /* nowhere to send until the client datagrams arrive */
+    if (! ch->bound) {
+        ch->batch.count = 0;
+        return;
+    }
 
-                    FD_SET(clsock, &active_fd_set);
-                } else {
-                    client = _get_client_by_socket(i);
-                    if ((fuzzy_message_recv(i, msg)) == false) {
-                        /* disconnection */
-                        fuzzy_debug(fuzzy_sformat("Client %s:%d disconnected", client->ip, client->port));
-                        close(client->socket);
-                        FD_CLR (client->socket, &active_fd_set);
-                        _client_disconnected(client->socket);
-                    } else {
-                        /* incoming data */
-                        bool more = 1;
+    fuzzy_message_clear(msg);
+    fuzzy_protocol_push_batch(msg, &ch->batch);
+    fuzzy_message_push32(msg, ++ch->seq_out);
+    if (fuzzy_message_sendto(Reactor->udpsock, msg, &ch->addr))
+        _stats_add(datagrams_out, 1);
+}
+
+/* batches the action until the end of the current events */
+static void _channel_queue(FuzzyClient * client, FUZZY_MESSAGE_TYPES type, struct FuzzyCommandPlayer * player)
+{
+    FuzzyClientChannel * ch = client->channel;
 
-                        while (more) {
-                            _fuzzy_process_message(msg, client);
+    if (fuzzy_protocol_batch_add(&ch->batch, type, player))
+        _channel_flush(client);
 
-                            if (! fuzzy_message_poll(i))
-                                more = false;
-                            else
-                                fuzzy_message_recv(i, msg);
-                        }
-                    }
-                }
-            }
+    if (! ch->dirty) {
+        if (Reactor->dirty_count == Reactor->dirty_size) {
+            Reactor->dirty_size = fuzzy_max(Reactor->dirty_size * 2, FUZZY_SERVER_CLIENTS_INITIAL);
+            fuzzy_iz_perror(Reactor->dirty = (int *) realloc(Reactor->dirty, Reactor->dirty_size * sizeof(int)));
         }
+        Reactor->dirty[Reactor->dirty_count++] = client->socket;
+        ch->dirty = true;
     }
+}
 
-    fuzzy_message_del(msg);
-    return 0;
+static void _server_flush_channels()
+{
+    FuzzyClient * client;
+    int i, fd;
+
+    for (i = 0; i < Reactor->dirty_count; i++) {
+        fd = Reactor->dirty[i];
+        client = Reactor->clients[fd];
+        if (client == NULL || client->channel == NULL || ! client->channel->dirty)
+            continue;
+        if (client->channel->batch.count > 0)
+            _channel_flush(client);
+        client->channel->dirty = false;
+    }
+    Reactor->dirty_count = 0;
 }
 
-int fuzzy_server_connect(char * host, int port)
+/* the room state is published on the next tick */
+static void _room_touch(FuzzyRoom * room)
 {
-    struct sockaddr_in serv_addr;
-    int sock;
+    room->state->dirty = true;
+}
+
+static double _room_time(FuzzyRoomState * state)
+{
+    return (double)state->steps / ServerTickRate;
+}
 
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    fuzzy_iz_perror(inet_aton(host, &serv_addr.sin_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port);
+/* records a command accepted by the room, with the room clock */
+static void _room_journal(FuzzyRoom * room, FUZZY_MESSAGE_TYPES type, FuzzyPlayer * player, struct FuzzyCommandPlayer * action)
+{
+    FuzzyJournalRecord record;
 
-    fuzzy_lz_perror(sock = socket(AF_INET, SOCK_STREAM, 0));
-    fuzzy_lz_perror(connect(sock, (struct sockaddr *) &serv_addr, sizeof(serv_addr)));
-    fuzzy_debug(fuzzy_sformat("Connected to server %s:%d", host, port));
+    if (ServerJournal == NULL)
+        return;
+    bzero(&record, sizeof(record));
+    record.steps = room->state->steps;
+    record.room = room->id;
+    record.type = type;
+    record.player = player->id;
+    if (action) {
+        record.x = action->x;
+        record.y = action->y;
+        record.dx = action->dx;
+        record.dy = action->dy;
+    }
+    fuzzy_journal_append(ServerJournal, Reactor->id, &record);
+}
 
-    return sock;
+/* adds the client to the room members and to its game */
+static void _room_enter(FuzzyRoom * room, FuzzyClient * client)
+{
+    client->room = room;
+    client->player = fuzzy_player_new(room->state->game, FUZZY_PLAYER_REMOTE, client->ip);
+    client->player->soul_time = _room_time(room->state);
+    _room_journal(room, room->owner == client ? FUZZY_COMMAND_GAME_CREATE : FUZZY_COMMAND_GAME_JOIN, client->player, NULL);
+    client->replicated = false;
+    client->acked = 0;
+    fuzzy_list_append(FuzzyClient, room->clients, client);
+    _room_touch(room);
+}
+
+/* takes a free directory slot, growing the directory when full.
+    Must be called with the directory lock held. */
+static int _room_slot_alloc()
+{
+    int slot, nsize;
+
+    if (ServerRoomsFree == -1) {
+        if (ServerRoomSlotsSize == FUZZY_ROOM_MAX_SLOTS)
+            return -1;
+
+        nsize = fuzzy_min(fuzzy_max(ServerRoomSlotsSize * 2, FUZZY_SERVER_CLIENTS_INITIAL), FUZZY_ROOM_MAX_SLOTS);
+        fuzzy_iz_perror(ServerRoomSlots = (FuzzyRoomSlot *) realloc(ServerRoomSlots, nsize * sizeof(FuzzyRoomSlot)));
+        for (slot = ServerRoomSlotsSize; slot < nsize; slot++) {
+            ServerRoomSlots[slot].room = NULL;
+            ServerRoomSlots[slot].generation = 1;
+            ServerRoomSlots[slot].next_free = slot + 1 < nsize ? slot + 1 : -1;
+        }
+        ServerRoomsFree = ServerRoomSlotsSize;
+        ServerRoomsFreeTail = nsize - 1;
+        ServerRoomSlotsSize = nsize;
+    }
+
+    slot = ServerRoomsFree;
+    ServerRoomsFree = ServerRoomSlots[slot].next_free;
+    if (ServerRoomsFree == -1)
+        ServerRoomsFreeTail = -1;
+    return slot;
+}
+
+/* frees the slot for reuse. The generation changes, so stale ids do not match.
+    Freed slots are reused last, to make the generations wrap slowly.
+    Must be called with the directory lock held. */
+static void _room_slot_free(int slot)
+{
+    FuzzyRoomSlot * rs = &ServerRoomSlots[slot];
+
+    rs->room = NULL;
+    rs->generation = rs->generation % FUZZY_ROOM_MAX_GENERATION + 1;
+    rs->next_free = -1;
+
+    if (ServerRoomsFreeTail == -1)
+        ServerRoomsFree = slot;
+    else
+        ServerRoomSlots[ServerRoomsFreeTail].next_free = slot;
+    ServerRoomsFreeTail = slot;
+}
+
+/* returns NULL when the directory is full */
+static FuzzyRoom * _new_room(FuzzyClient * owner, char * rname)
+{
+    FuzzyRoom * room;
+    int slot;
+
+    fuzzy_nz_rerror(pthread_mutex_lock(&ServerRoomsLock));
+    slot = _room_slot_alloc();
+    if (slot == -1) {
+        fuzzy_nz_rerror(pthread_mutex_unlock(&ServerRoomsLock));
+        return NULL;
+    }
+
+    room = fuzzy_new(FuzzyRoom);
+    room->id = ((ulong)ServerRoomSlots[slot].generation << FUZZY_ROOM_SLOT_BITS) | slot;
+    room->reactor = Reactor->id;
+    ServerRoomSlots[slot].room = room;
+    ServerRoomsCount++;
+    fuzzy_nz_rerror(pthread_mutex_unlock(&ServerRoomsLock));
+
+    strncpy(room->name, rname, FUZZY_NET_ROOM_LEN);
+    room->owner = owner;
+    room->clients = NULL;
+    fuzzy_list_null(room);
+
+    room->state = fuzzy_new(FuzzyRoomState);
+    bzero(room->state, sizeof(FuzzyRoomState));
+    room->state->game = fuzzy_game_new(NULL);
+    fuzzy_snapshot_history_init(&room->state->history);
+    _room_enter(room, owner);
+
+    /* the reactor ticks it from now on */
+    if (Reactor->rooms_count == Reactor->rooms_size) {
+        Reactor->rooms_size = fuzzy_max(Reactor->rooms_size * 2, FUZZY_SERVER_CLIENTS_INITIAL);
+        fuzzy_iz_perror(Reactor->rooms = (FuzzyRoom **) realloc(Reactor->rooms, Reactor->rooms_size * sizeof(FuzzyRoom *)));
+    }
+    room->state->index = Reactor->rooms_count;
+    Reactor->rooms[Reactor->rooms_count++] = room;
+
+    return room;
+}
+
+/* looks up a room in the shared directory. The room members can only be
+    touched by its reactor, which is stored into reactor. */
+static FuzzyRoom * _find_room(ulong id, int * reactor)
+{
+    FuzzyRoom * room = NULL;
+    ulong slot = id & ((1 << FUZZY_ROOM_SLOT_BITS) - 1);
+
+    fuzzy_nz_rerror(pthread_mutex_lock(&ServerRoomsLock));
+    if (slot < ServerRoomSlotsSize && ServerRoomSlots[slot].room != NULL &&
+      ServerRoomSlots[slot].room->id == id) {
+        room = ServerRoomSlots[slot].room;
+        *reactor = room->reactor;
+    }
+    fuzzy_nz_rerror(pthread_mutex_unlock(&ServerRoomsLock));
+
+    return room;
+}
+
+/* message is encoded once for each encoding, every client queues a reference
+    to the same frame. skip client, if not NULL, does not get the message */
+static void _room_broadcast(FuzzyRoom * room, FuzzyMessage * msg, FuzzyClient * skip)
+{
+    FuzzyClient * cl;
+    FuzzyFrame * frames[2] = {NULL, NULL};
+
+    cl = room->clients;
+    while(cl) {
+        if (cl != skip)
+            _client_queue(cl, _client_frame(cl, msg, frames));
+        fuzzy_list_next(cl);
+    }
+    _frames_unref(frames);
+}
+
+/* player actions go to the members which do not follow the room state: on
+    the udp channel of the clients which have one, on the stream otherwise */
+static void _room_relay(FuzzyRoom * room, FuzzyClient * sender, FUZZY_MESSAGE_TYPES type, struct FuzzyCommandPlayer * player)
+{
+    FuzzyClient * cl;
+    FuzzyFrame * frame = NULL;
+
+    for (cl = room->clients; cl; fuzzy_list_next(cl)) {
+        if (cl == sender || cl->closing || cl->replicated)
+            continue;
+
+        if (cl->channel) {
+            _channel_queue(cl, type, player);
+        } else {
+            if (frame == NULL) {
+                fuzzy_message_clear(Reactor->dgram);
+                fuzzy_protocol_push_player_action(Reactor->dgram, type, player);
+                frame = fuzzy_frame_new(Reactor->dgram);
+            }
+            _client_queue(cl, fuzzy_frame_ref(frame));
+        }
+    }
+    if (frame)
+        fuzzy_frame_unref(frame);
+}
+
+/* queues the action for the next tick */
+static void _room_intent(FuzzyRoom * room, FuzzyClient * sender, FUZZY_MESSAGE_TYPES type, struct FuzzyCommandPlayer * action)
+{
+    FuzzyRoomState * state = room->state;
+    FuzzyRoomIntent * intent;
+
+    if (state->intents_count == FUZZY_ROOM_MAX_INTENTS) {
+        _stats_add(intents_dropped, 1);
+        return;
+    }
+    if (state->intents_count == state->intents_size) {
+        state->intents_size = state->intents_size ? state->intents_size * 2 : 16;
+        fuzzy_iz_perror(state->intents = (FuzzyRoomIntent *) realloc(state->intents, state->intents_size * sizeof(FuzzyRoomIntent)));
+    }
+
+    intent = &state->intents[state->intents_count++];
+    intent->player = sender->player->id;
+    intent->type = type;
+    intent->action = *action;
+}
+
+/* plays the action on the room game. Invalid actions are ignored */
+static void _room_play(FuzzyRoom * room, FuzzyPlayer * player, FUZZY_MESSAGE_TYPES type, struct FuzzyCommandPlayer * action)
+{
+    if (fuzzy_game_play(room->state->game, player, type == FUZZY_COMMAND_PLAYER_ATTACK,
+      action->x, action->y, action->dx, action->dy))
+        _room_touch(room);
+}
+
+/* soul points start growing now */
+static void _room_spawn(FuzzyRoom * room)
+{
+    _room_journal(room, FUZZY_COMMAND_GAME_START, room->owner->player, NULL);
+    fuzzy_game_spawn(room->state->game, _room_time(room->state));
+    room->state->started = true;
+    _room_touch(room);
+}
+
+/* sends the state on the client channel. Returns false if it does not fit a datagram */
+static bool _channel_state(FuzzyClient * client, const FuzzySnapshot * base, const FuzzySnapshot * snap)
+{
+    FuzzyClientChannel * ch = client->channel;
+    FuzzyMessage * msg = Reactor->dgram;
+
+    fuzzy_message_clear(msg);
+    fuzzy_protocol_push_state(msg, base, snap);
+    if (msg->cursor + 4 > FUZZY_DATAGRAM_MAX_SIZE)
+        return false;
+
+    fuzzy_message_push32(msg, ++ch->seq_out);
+    if (fuzzy_message_sendto(Reactor->udpsock, msg, &ch->addr)) {
+        _stats_add(datagrams_out, 1);
+        _stats_add(states, 1);
+        _stats_add(state_bytes, msg->cursor);
+    }
+    return true;
+}
+
+/* takes a new snapshot and sends the members the changes since their last
+    ack. Stream clients get everything, so their ack is implicit and they
+    usually share the same frame. */
+static void _room_publish(FuzzyRoom * room)
+{
+    FuzzyRoomState * state = room->state;
+    const FuzzySnapshot * base;
+    FuzzySnapshot * snap;
+    FuzzyFrame * frames[2] = {NULL, NULL};
+    FuzzyFrame * frame;
+    ubyte32 frame_base = 0;
+    FuzzyClient * cl;
+
+    /* nobody is watching */
+    cl = room->clients;
+    while (cl && ! cl->replicated)
+        fuzzy_list_next(cl);
+    if (cl == NULL)
+        return;
+
+    /* 0 is the empty state */
+    if (++state->tick == 0)
+        state->tick = 1;
+    snap = fuzzy_snapshot_history_slot(&state->history, state->tick);
+    fuzzy_snapshot_take(snap, state->game, state->tick);
+
+    for (cl = room->clients; cl; fuzzy_list_next(cl)) {
+        if (! cl->replicated || cl->closing)
+            continue;
+
+        base = fuzzy_snapshot_history_get(&state->history, cl->acked);
+        if (cl->channel && cl->channel->bound && _channel_state(cl, base, snap))
+            continue;
+
+        if (Reactor->state->cursor == 0 || frame_base != base->tick) {
+            _frames_unref(frames);
+            fuzzy_message_clear(Reactor->state);
+            fuzzy_protocol_push_state(Reactor->state, base, snap);
+            frame_base = base->tick;
+        }
+        frame = _client_frame(cl, Reactor->state, frames);
+        _stats_add(states, 1);
+        _stats_add(state_bytes, frame->len);
+        _client_queue(cl, frame);
+        cl->acked = snap->tick;
+    }
+    _frames_unref(frames);
+    fuzzy_message_clear(Reactor->state);
+}
+
+/* a state ack on the stream only subscribes, the following acks are implicit.
+    Acks of states not sent yet are ignored. */
+static void _room_ack(FuzzyClient * client, ubyte32 tick, bool stream)
+{
+    FuzzyRoom * room = client->room;
+
+    if (room == NULL || ! (client->caps & FUZZY_CAP_STATE))
+        return;
+
+    if (! client->replicated) {
+        client->replicated = true;
+        client->acked = 0;
+        _room_touch(room);
+    } else if (! stream && fuzzy_protocol_seq_after(tick, client->acked) &&
+      ! fuzzy_protocol_seq_after(tick, room->state->tick)) {
+        client->acked = tick;
+    }
+}
+
+/* plays the queued actions, then advances the clock by steps ticks */
+static void _room_tick(FuzzyRoom * room, ulong steps)
+{
+    FuzzyRoomState * state = room->state;
+    FuzzyPlayer * player;
+    FuzzyRoomIntent * intent;
+    int i;
+
+    for (i = 0; i < state->intents_count; i++) {
+        intent = &state->intents[i];
+        if ((player = fuzzy_player_by_id(state->game, intent->player)) != NULL) {
+            _room_journal(room, intent->type, player, &intent->action);
+            _room_play(room, player, intent->type, &intent->action);
+        }
+    }
+    state->intents_count = 0;
+
+    if (state->started) {
+        state->steps += steps;
+        for (player = state->game->players; player; fuzzy_list_next(player))
+            if (fuzzy_player_soul_update(player, _room_time(state), SOUL_TIME_INTERVAL))
+                _room_touch(room);
+    }
+
+    if (state->dirty) {
+        state->dirty = false;
+        _room_publish(room);
+    }
+}
+
+static ulong _elapsed_ns(const struct timespec * start, const struct timespec * end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000000UL + end->tv_nsec - start->tv_nsec;
+}
+
+/* the timer is armed at the idle timeout from the client last message. It is
+    not moved on every message: when it fires the client may have spoken
+    meanwhile, and it is armed again from then */
+static void _client_idle(FuzzyTimer * timer)
+{
+    FuzzyClient * client = (FuzzyClient *) timer->data;
+    ulong deadline = client->seen + (ulong) ServerIdleTimeout * ServerTickRate;
+
+    if (Reactor->timers.now < deadline) {
+        fuzzy_timer_arm(&Reactor->timers, timer, deadline);
+        return;
+    }
+    fuzzy_warning(fuzzy_sformat("Client %d silent for %d s, closing", client->socket, ServerIdleTimeout));
+    _stats_add(timeouts, 1);
+    _client_kill(client);
+}
+
+/* runs the rooms of the reactor. Late ticks are caught up at once */
+static void _server_tick()
+{
+    struct timespec start, end;
+    uint64_t expired;
+    ulong ns;
+    int i;
+
+    if (read(Reactor->tickfd, &expired, sizeof(expired)) != sizeof(expired))
+        return;
+    _stats_add(ticks_late, expired - 1);
+    Reactor->out_type = FUZZY_COMMAND_STATE;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < Reactor->rooms_count; i++)
+        _room_tick(Reactor->rooms[i], expired);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    ns = _elapsed_ns(&start, &end);
+    _stats_add(ticks, 1);
+    _stats_add(tick_ns, ns);
+    if (ns > Reactor->stats.tick_max_ns) {
+        _stats_set(tick_max_ns, ns);
+        if (ns > 1000000000UL / ServerTickRate)
+            fuzzy_warning(fuzzy_sformat("Reactor %d tick took %lu us, over budget with %d rooms",
+                Reactor->id, ns / 1000, Reactor->rooms_count));
+    }
+    fuzzy_wheel_advance(&Reactor->timers, expired, _client_idle);
+}
+
+/* kick any client out of the room and free it */
+static void _kick_all_out(FuzzyRoom * room)
+{
+    FuzzyMessage * msg;
+    FuzzyClient * cl;
+
+    /* clients are told the room is gone */
+    msg = fuzzy_message_new();
+    fuzzy_message_push8(msg, FUZZY_COMMAND_GAME_LEAVE);
+    _room_broadcast(room, msg, room->owner);
+    fuzzy_message_del(msg);
+
+    while (room->clients) {
+        cl = room->clients;
+        fuzzy_list_next(room->clients);
+        fuzzy_list_null(cl);
+        cl->room = NULL;
+        cl->player = NULL;
+        cl->replicated = false;
+        _channel_close(cl);
+    }
+
+    /* the last room takes its place */
+    Reactor->rooms[room->state->index] = Reactor->rooms[--Reactor->rooms_count];
+    Reactor->rooms[room->state->index]->state->index = room->state->index;
+
+    /* players go away with the game */
+    fuzzy_game_free(room->state->game);
+    fuzzy_snapshot_history_free(&room->state->history);
+    free(room->state->intents);
+    free(room->state);
+
+    fuzzy_nz_rerror(pthread_mutex_lock(&ServerRoomsLock));
+    _room_slot_free(room->id & ((1 << FUZZY_ROOM_SLOT_BITS) - 1));
+    ServerRoomsCount--;
+    fuzzy_nz_rerror(pthread_mutex_unlock(&ServerRoomsLock));
+    free(room);
+}
+
+/* the room is destroyed when its owner leaves */
+static void _room_leave(FuzzyClient * client)
+{
+    FuzzyRoom * room = client->room;
+
+    _room_journal(room, FUZZY_COMMAND_GAME_LEAVE, client->player, NULL);
+    if (room->owner == client) {
+        _kick_all_out(room);
+    } else {
+        // TODO notify disconnection
+        fuzzy_list_remove(FuzzyClient, room->clients, client);
+        fuzzy_list_null(client);
+        client->room = NULL;
+        fuzzy_player_free(room->state->game, client->player);
+        client->player = NULL;
+        client->replicated = false;
+        _channel_close(client);
+        _room_touch(room);
+    }
+}
+
+static void _client_disconnected(int clsock)
+{
+    FuzzyClient *cl;
+
+    cl = _get_client_by_socket(clsock);
+
+    if (cl->room)
+        _room_leave(cl);
+
+    _client_detach(cl);
+    _client_free(cl);
+}
+
+static void _server_client_close(FuzzyClient * client)
+{
+    int clsock = client->socket;
+    FuzzyLocalLink * link = client->link;
+
+    fuzzy_debug(fuzzy_sformat("Client %s:%d disconnected", client->ip, client->port));
+    /* the members of its room are told */
+    Reactor->out_type = FUZZY_COMMAND_GAME_LEAVE;
+    if (ServerBackend == FUZZY_SERVER_BACKEND_SELECT) {
+        FD_CLR(clsock, &Reactor->readset);
+        FD_CLR(clsock, &Reactor->writeset);
+    }
+    _client_disconnected(clsock);
+    _client_hangup(clsock, link);
+}
+
+static void _server_reap_clients()
+{
+    FuzzyClient * client;
+    int i;
+
+    for (i = 0; i < Reactor->pending_count; i++) {
+        client = Reactor->clients[Reactor->pending[i]];
+        if (client == NULL)
+            continue;
+        if (client->uring && (client->closing || client->joining) && _uring_quiesce(client))
+            continue;
+        if (client->closing)
+            _server_client_close(client);
+        else if (client->joining)
+            _client_handoff(client, client->handoff);
+    }
+    Reactor->pending_count = 0;
+}
+
+/* after the current events */
+static void _server_end_round()
+{
+    /* one datagram per client for all the actions of this round */
+    _server_flush_channels();
+    if (ServerJournal)
+        fuzzy_journal_flush(ServerJournal, Reactor->id);
+    _server_reap_clients();
+}
+
+static void _fuzzy_net_error(FuzzyMessage * msg, char * err, FuzzyClient * cl)
+{
+    fuzzy_message_clear(msg);
+    if (cl->caps & FUZZY_CAP_VARSTR) {
+        fuzzy_message_pushvarstr(msg, err, FUZZY_NETERROR_CHARS-1);
+        fuzzy_message_push8(msg, FUZZY_NETCODE_ERROR_VARSTR);
+    } else {
+        fuzzy_message_pushstr(msg, err, FUZZY_NETERROR_CHARS);
+        fuzzy_message_push8(msg, FUZZY_NETCODE_ERROR);
+    }
+    _client_reply(cl, msg);
+}
+
+static void _fuzzy_net_ok(FuzzyMessage * msg, FuzzyClient * cl)
+{
+    fuzzy_message_clear(msg);
+    fuzzy_message_push8(msg, FUZZY_NETCODE_OK);
+    _client_reply(cl, msg);
+}
+
+/* joins a room owned by the current reactor and replies to the client */
+static void _room_join(FuzzyMessage * msg, FuzzyClient * client, ulong id)
+{
+    FuzzyRoom * room;
+    int reactor;
+
+    room = _find_room(id, &reactor);
+    if (room == NULL || reactor != Reactor->id) {
+        _fuzzy_net_error(msg, "Room does not exist", client);
+        return;
+    }
+    _room_enter(room, client);
+    _fuzzy_net_ok(msg, client);
+}
+
+static bool _server_running()
+{
+    return __atomic_load_n(&ServerRun, __ATOMIC_RELAXED);
+}
+
+static void _server_stop()
+{
+    int i;
+
+    __atomic_store_n(&ServerRun, false, __ATOMIC_RELAXED);
+    for (i = 0; i < ServerReactorsCount; i++)
+        _reactor_wake(&ServerReactors[i]);
+}
+
+/* counters of running reactors are read while they change, each one is
+    consistent but they can be slightly apart */
+void fuzzy_server_get_stats(FuzzyServerStats * stats)
+{
+    FuzzyServerStats * rs;
+    int i, c;
+
+    #define _stats_sum(field) stats->field += __atomic_load_n(&rs->field, __ATOMIC_RELAXED)
+    bzero(stats, sizeof(FuzzyServerStats));
+    for (i = 0; ServerReactors && i < ServerReactorsCount; i++) {
+        rs = &ServerReactors[i].stats;
+        stats->clients += __atomic_load_n(&ServerReactors[i].clients_count, __ATOMIC_RELAXED);
+        _stats_sum(queued_bytes);
+        _stats_sum(stalls);
+        _stats_sum(throttles);
+        _stats_sum(drops);
+        _stats_sum(handoffs);
+        _stats_sum(datagrams_in);
+        _stats_sum(datagrams_out);
+        _stats_sum(datagrams_stale);
+        _stats_sum(states);
+        _stats_sum(state_bytes);
+        _stats_sum(deflated);
+        _stats_sum(deflate_saved);
+        _stats_sum(ticks);
+        _stats_sum(ticks_late);
+        _stats_sum(tick_ns);
+        stats->tick_max_ns = fuzzy_max(stats->tick_max_ns, __atomic_load_n(&rs->tick_max_ns, __ATOMIC_RELAXED));
+        _stats_sum(intents_dropped);
+        _stats_sum(decode_errors);
+        _stats_sum(syscalls);
+        _stats_sum(timeouts);
+        for (c = 0; c < FUZZY_STATS_COMMANDS; c++) {
+            _stats_sum(commands[c].messages_in);
+            _stats_sum(commands[c].bytes_in);
+            _stats_sum(commands[c].messages_out);
+            _stats_sum(commands[c].bytes_out);
+            fuzzy_histogram_merge(&stats->commands[c].latency, &rs->commands[c].latency);
+        }
+    }
+    #undef _stats_sum
+
+    fuzzy_nz_rerror(pthread_mutex_lock(&ServerRoomsLock));
+    stats->rooms = ServerRoomsCount;
+    fuzzy_nz_rerror(pthread_mutex_unlock(&ServerRoomsLock));
+}
+
+static void _fuzzy_process_command(FuzzyMessage * msg, FuzzyClient * client, FuzzyCommand * cmd)
+{
+    FuzzyServerStats * stats;
+    FuzzyRoom * room;
+    int reactor;
+
+    switch(cmd->type) {
+        case FUZZY_COMMAND_AUTHENTICATE:
+            /* wire format is negotiated even if the key is wrong */
+            client->version = cmd->data.auth.version;
+            client->caps = cmd->data.auth.caps & client->offer;
+            client->inbuf.inflate = (client->caps & FUZZY_CAP_DEFLATE) != 0;
+
+            if(strncmp(cmd->data.auth.key, ServerKey, FUZZY_SERVERKEY_LEN) != 0) {
+                fuzzy_error(fuzzy_sformat("Bad key: %s", cmd->data.auth.key));
+                _fuzzy_net_error(msg, "Bad key", client);
+                return;
+            } else {
+                fuzzy_debug(fuzzy_sformat("Client %d authenticated, protocol version %d", client->socket, cmd->data.auth.version));
+                client->auth = true;
+            }
+            if (client->version > 0) {
+                /* tell the server revision, version 0 clients do not expect it */
+                fuzzy_message_clear(msg);
+                fuzzy_message_pushvar(msg, client->offer);
+                fuzzy_message_push8(msg, FUZZY_PROTOCOL_VERSION);
+                fuzzy_message_push8(msg, FUZZY_NETCODE_OK);
+                _client_reply(client, msg);
+                return;
+            }
+            break;
+
+        case FUZZY_COMMAND_SHUTDOWN:
+            if (_verify_auth(client, FUZZY_COMMAND_SHUTDOWN)) {
+                fuzzy_debug("Server shutdown command received");
+                _server_stop();
+            }
+            break;
+
+        case FUZZY_COMMAND_GAME_CREATE:
+            if (client->room != NULL) {
+                _fuzzy_net_error(msg, "Disconnect client first", client);
+                return;
+            }
+            room = _new_room(client, cmd->data.room.name);
+            if (room == NULL) {
+                _fuzzy_net_error(msg, "Too many rooms", client);
+                return;
+            }
+            fuzzy_message_clear(msg);
+            fuzzy_message_push32(msg, room->id);
+            fuzzy_message_push8(msg, FUZZY_NETCODE_OK);
+            _client_reply(client, msg);
+            return;
+
+        case FUZZY_COMMAND_GAME_START:
+            if (client->room == NULL) {
+                _fuzzy_net_error(msg, "Client is not inside a room", client);
+                return;
+            }
+            if (client->room->owner != client) {
+                _fuzzy_net_error(msg, "Client is the room owner", client);
+                return;
+            }
+            _room_spawn(client->room);
+            _fuzzy_net_ok(msg, client);
+            fuzzy_message_clear(msg);
+            fuzzy_message_push8(msg, FUZZY_COMMAND_GAME_START);
+
+            /* notify all about game start */
+            _room_broadcast(client->room, msg, NULL);
+            return;
+
+        case FUZZY_COMMAND_GAME_JOIN:
+            if (client->room != NULL) {
+                _fuzzy_net_error(msg, "Disconnect client first", client);
+                return;
+            }
+            room = _find_room(cmd->data.room.id, &reactor);
+            if (room == NULL) {
+                _fuzzy_net_error(msg, "Room does not exist", client);
+                return;
+            }
+            if (reactor != Reactor->id) {
+                /* the room reactor joins the client and replies */
+                client->joining = cmd->data.room.id;
+                client->handoff = reactor;
+                _client_defer(client);
+                return;
+            }
+            _room_enter(room, client);
+            break;
+
+        case FUZZY_COMMAND_GAME_LEAVE:
+            if (client->room == NULL) {
+                _fuzzy_net_error(msg, "Client is not inside a room", client);
+                return;
+            }
+            _room_leave(client);
+            break;
+
+        case FUZZY_COMMAND_PLAYER_STEP:
+        case FUZZY_COMMAND_PLAYER_MOVE:
+        case FUZZY_COMMAND_PLAYER_ATTACK:
+            /* no reply, high frequency traffic */
+            if (! _verify_auth(client, cmd->type) || client->room == NULL)
+                return;
+            _room_intent(client->room, client, cmd->type, &cmd->data.player);
+            _room_relay(client->room, client, cmd->type, &cmd->data.player);
+            return;
+
+        case FUZZY_COMMAND_STATE_ACK:
+            if (_verify_auth(client, cmd->type))
+                _room_ack(client, cmd->data.state.tick, true);
+            return;
+
+        case FUZZY_COMMAND_CHANNEL_OPEN:
+            if (! _verify_auth(client, cmd->type) || ! (client->caps & FUZZY_CAP_CHANNEL)) {
+                _fuzzy_net_error(msg, "Channel not negotiated", client);
+                return;
+            }
+            if (client->room == NULL) {
+                _fuzzy_net_error(msg, "Client is not inside a room", client);
+                return;
+            }
+            if (client->channel == NULL)
+                _channel_open(client);
+            fuzzy_message_clear(msg);
+            fuzzy_message_push16(msg, Reactor->udpport);
+            fuzzy_message_push32(msg, client->channel->key);
+            fuzzy_message_push32(msg, client->socket);
+            fuzzy_message_push8(msg, FUZZY_NETCODE_OK);
+            _client_reply(client, msg);
+            return;
+
+        case FUZZY_COMMAND_PING:
+            /* echoed, a tagged one gets its reply */
+            if (client->reqid != 0)
+                break;
+            fuzzy_message_clear(msg);
+            fuzzy_message_push8(msg, FUZZY_COMMAND_PING);
+            _client_send(client, msg);
+            return;
+
+        case FUZZY_COMMAND_STATS:
+            if (! _verify_auth(client, cmd->type)) {
+                _fuzzy_net_error(msg, "Not authorized", client);
+                return;
+            }
+            stats = fuzzy_new(FuzzyServerStats);
+            fuzzy_server_get_stats(stats);
+            fuzzy_message_clear(msg);
+            fuzzy_protocol_push_stats(msg, stats);
+            fuzzy_message_push8(msg, FUZZY_NETCODE_OK);
+            _client_reply(client, msg);
+            free(stats);
+            return;
+
+        default:
+            /* server to client types, like STATE */
+            _fuzzy_net_error(msg, "Unexpected command", client);
+            return;
+    }
+
+    _fuzzy_net_ok(msg, client);
+}
+
+/* decodes and runs a client message. Frames queued meanwhile are counted
+    under its command type */
+static void _fuzzy_process_message(FuzzyMessage * msg, FuzzyClient * client)
+{
+    FuzzyCommand cmd;
+    struct timespec start, end;
+    ssize_t len = msg->cursor;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    client->seen = Reactor->timers.now;
+    fuzzy_debug(fuzzy_sformat("Message[%zd bytes] from socket %d", msg->cursor, client->socket));
+    if (! fuzzy_protocol_decode_message(msg, &cmd)) {
+        /* bad message */
+        _stats_add(decode_errors, 1);
+        Reactor->out_type = -1;
+        client->reqid = cmd.reqid;
+        _fuzzy_net_error(msg, "Malformed message", client);
+        return;
+    }
+
+    Reactor->out_type = cmd.type;
+    client->reqid = cmd.reqid;
+    _fuzzy_process_command(msg, client, &cmd);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    _stats_add(commands[cmd.type].messages_in, 1);
+    _stats_add(commands[cmd.type].bytes_in, FUZZY_FRAME_HEADER_SIZE + len);
+    fuzzy_histogram_add(&Reactor->stats.commands[cmd.type].latency, _elapsed_ns(&start, &end));
+}
+
+/* the socket left by a previous run would make bind fail. Anything else is
+    left alone */
+static void _unix_unlink_stale(char * path)
+{
+    struct stat st;
+
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        fuzzy_lz_perror(unlink(path));
+}
+
+static void _reactor_init(FuzzyReactor * reactor, int id, int port)
+{
+    int yes = 1;
+    struct sockaddr_in sa_srv;
+    socklen_t sa_len = sizeof(sa_srv);
+    struct itimerspec tick;
+
+    bzero(reactor, sizeof(FuzzyReactor));
+    reactor->id = id;
+    reactor->epfd = -1;
+    reactor->out_type = -1;
+    fuzzy_nz_rerror(pthread_mutex_init(&reactor->mailbox_lock, NULL));
+    fuzzy_lz_perror(reactor->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+
+    /* the rooms of the reactor share its tick */
+    fuzzy_lz_perror(reactor->tickfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+    tick.it_interval.tv_sec = (1000000000L / ServerTickRate) / 1000000000L;
+    tick.it_interval.tv_nsec = (1000000000L / ServerTickRate) % 1000000000L;
+    tick.it_value = tick.it_interval;
+    fuzzy_lz_perror(timerfd_settime(reactor->tickfd, 0, &tick, NULL));
+    fuzzy_wheel_init(&reactor->timers);
+
+    sa_srv.sin_family = AF_INET;
+    sa_srv.sin_port = htons(port);
+    sa_srv.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    fuzzy_lz_perror(reactor->socket = socket(AF_INET, SOCK_STREAM, 0));
+    fuzzy_lz_perror(setsockopt(reactor->socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)));
+    /* the kernel spreads the incoming connections among the reactors */
+    if (ServerReactorsCount > 1)
+        fuzzy_lz_perror(setsockopt(reactor->socket, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)));
+    fuzzy_lz_perror(bind(reactor->socket, (struct sockaddr *)&sa_srv, sizeof(sa_srv)));
+    fuzzy_lz_perror(listen(reactor->socket, FUZZY_SERVER_BACKLOG));
+
+    /* a unix socket cannot be shared, the first reactor owns it */
+    reactor->unixsock = -1;
+    if (id == 0 && ServerUnixAddress.len > 0) {
+        _unix_unlink_stale(ServerUnixAddress.addr.un.sun_path);
+        fuzzy_lz_perror(reactor->unixsock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        fuzzy_lz_perror(bind(reactor->unixsock, &ServerUnixAddress.addr.sa, ServerUnixAddress.len));
+        fuzzy_lz_perror(listen(reactor->unixsock, FUZZY_SERVER_BACKLOG));
+    }
+
+    /* each reactor gets its channels on its own port */
+    sa_srv.sin_port = 0;
+    fuzzy_lz_perror(reactor->udpsock = socket(AF_INET, SOCK_DGRAM, 0));
+    fuzzy_lz_perror(bind(reactor->udpsock, (struct sockaddr *)&sa_srv, sizeof(sa_srv)));
+    fuzzy_lz_perror(getsockname(reactor->udpsock, (struct sockaddr *)&sa_srv, &sa_len));
+    reactor->udpport = ntohs(sa_srv.sin_port);
+    _set_nonblocking(reactor->udpsock);
+}
+
+void fuzzy_server_create(int port, char * keyout)
+{
+    uuid_t key;
+    int i;
+
+    if (ServerBackend == FUZZY_SERVER_BACKEND_URING && ! fuzzy_uring_probe()) {
+        fuzzy_warning("io_uring is not supported, using epoll");
+        ServerBackend = FUZZY_SERVER_BACKEND_EPOLL;
+    }
+
+    uuid_generate_random(key);
+    uuid_unparse_upper(key, ServerKey);
+    fuzzy_debug(fuzzy_sformat("Server key: %s", ServerKey));
+
+    ServerReactors = fuzzy_newarr(FuzzyReactor, ServerReactorsCount);
+    for (i = 0; i < ServerReactorsCount; i++)
+        _reactor_init(&ServerReactors[i], i, port);
+    fuzzy_debug(fuzzy_sformat("Server listening on port %i, %d reactors", port, ServerReactorsCount));
+    if (ServerUnixAddress.len > 0)
+        fuzzy_debug(fuzzy_sformat("Server listening on %s", ServerUnixAddress.addr.un.sun_path));
+
+    if (ServerJournalPath) {
+        ServerJournal = fuzzy_journal_open(ServerJournalPath, ServerReactorsCount, ServerTickRate);
+        fuzzy_debug(fuzzy_sformat("Server journal on %s", ServerJournalPath));
+    }
+
+    strncpy(keyout, ServerKey, FUZZY_SERVERKEY_LEN);
+}
+
+static void _reactor_destroy(FuzzyReactor * reactor)
+{
+    FuzzyClient * client;
+    int i;
+
+    Reactor = reactor;
+    for (i = 0; i < reactor->clients_size; i++)
+        if (reactor->clients[i] != NULL)
+            _server_client_close(reactor->clients[i]);
+    free(reactor->clients);
+    free(reactor->pending);
+    free(reactor->dirty);
+    free(reactor->locals);
+    free(reactor->rooms);
+
+    /* clients still travelling between reactors */
+    while (reactor->mailbox) {
+        client = reactor->mailbox;
+        fuzzy_list_next(reactor->mailbox);
+        _client_hangup(client->socket, client->link);
+        _client_free(client);
+    }
+
+    pthread_mutex_destroy(&reactor->mailbox_lock);
+    close(reactor->wakefd);
+    close(reactor->tickfd);
+    close(reactor->udpsock);
+    close(reactor->socket);
+    if (reactor->unixsock >= 0) {
+        close(reactor->unixsock);
+        unlink(ServerUnixAddress.addr.un.sun_path);
+    }
+    Reactor = NULL;
+}
+
+void fuzzy_server_destroy()
+{
+    int i;
+
+    if (ServerReactors == NULL) {
+        fuzzy_error("Server not running");
+    } else {
+        for (i = 0; i < ServerReactorsCount; i++)
+            _reactor_destroy(&ServerReactors[i]);
+        free(ServerReactors);
+        ServerReactors = NULL;
+
+        /* with the leaves of the last clients */
+        if (ServerJournal) {
+            fuzzy_journal_close(ServerJournal);
+            ServerJournal = NULL;
+        }
+
+        /* rooms went away with their owners */
+        free(ServerRoomSlots);
+        ServerRoomSlots = NULL;
+        ServerRoomSlotsSize = 0;
+        ServerRoomsFree = ServerRoomsFreeTail = -1;
+        fuzzy_debug("Server shutdown completed");
+    }
+}
+
+/* a new non blocking connection from one of the listening sockets */
+static FuzzyClient * _server_accepted(int lsock, int clsock, FuzzyAddress * address)
+{
+    FuzzyClient * client;
+    int yes = 1;
+
+    /* frames are already coalesced by the out queue, Nagle would only hold
+        back the replies until the client acks the previous ones */
+    if (lsock == Reactor->socket)
+        fuzzy_lz_perror(setsockopt(clsock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)));
+    client = _client_connected(clsock, address);
+    fuzzy_debug(fuzzy_sformat("Client %s:%d connected -> socket #%d", client->ip, client->port, client->socket));
+    return client;
+}
+
+static FuzzyClient * _server_accept(int lsock)
+{
+    int clsock;
+    FuzzyAddress address;
+
+    _stats_add(syscalls, 1);
+    address.len = sizeof(address.addr);
+    clsock = accept(lsock, &address.addr.sa, &address.len);
+    if (clsock < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return NULL;
+        fuzzy_critical(fuzzy_strerror(errno));
+    }
+
+    _set_nonblocking(clsock);
+    return _server_accepted(lsock, clsock, &address);
+}
+
+/* the eventfd only woke the reactor, the requests are processed by
+    _server_poll_locals at the end of the round */
+static bool _server_local_readable(FuzzyClient * client)
+{
+    FuzzyLocalLink * link = client->link;
+    eventfd_t count;
+
+    if (eventfd_read(link->wakefd, &count) < 0 && errno != EAGAIN)
+        fuzzy_critical(fuzzy_strerror(errno));
+    return ! __atomic_load_n(&link->closed, __ATOMIC_RELAXED);
+}
+
+/* the links queue their requests without signaling while the reactor is
+    awake */
+static void _server_wake_locals()
+{
+    int i;
+
+    for (i = 0; i < Reactor->locals_count; i++)
+        __atomic_store_n(&Reactor->clients[Reactor->locals[i]]->link->server_awake, true, __ATOMIC_SEQ_CST);
+}
+
+/* processes the messages queued by the in-process clients, freeing them.
+    Before sleeping the flag is cleared and the queue checked again: a
+    message queued meanwhile is either processed here or signaled */
+static void _server_poll_locals()
+{
+    FuzzyClient * client;
+    FuzzyLocalLink * link;
+    FuzzyMessage * msg;
+    int i;
+
+    for (i = 0; i < Reactor->locals_count && _server_running(); i++) {
+        client = Reactor->clients[Reactor->locals[i]];
+        link = client->link;
+        do {
+            while (_client_active(client) && _server_running() &&
+              (msg = (FuzzyMessage *) fuzzy_queue_pop(&link->requests)) != NULL) {
+                _fuzzy_process_message(msg, client);
+                fuzzy_message_del(msg);
+            }
+            __atomic_store_n(&link->server_awake, false, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        } while (_client_active(client) && _server_running() && ! fuzzy_queue_empty(&link->requests));
+    }
+}
+
+/* processes the messages io_uring received into the client ring, then makes
+    sure the next ones are being received */
+static bool _server_uring_readable(FuzzyClient * client, FuzzyMessage * msg)
+{
+    FUZZY_FRAME_STATUS frame = FUZZY_FRAME_PARTIAL;
+
+    while (! client->throttled && _client_active(client) &&
+      (frame = fuzzy_message_extract(&client->inbuf, msg)) == FUZZY_FRAME_READY) {
+        _fuzzy_process_message(msg, client);
+        if (! _server_running())
+            return true;
+    }
+
+    if (frame == FUZZY_FRAME_INVALID) {
+        fuzzy_warning(fuzzy_sformat("Invalid frame from socket %d", client->socket));
+        return false;
+    }
+    if (! client->throttled && _client_active(client))
+        _uring_recv(client);
+    return ! client->uring->eof;
+}
+
+/* reads any available data and processes the complete messages.
+    Throttled clients are not read: their data waits inside the socket.
+
+    \retval TRUE client is still connected
+    \retval FALSE client disconnected
+ */
+static bool _server_client_readable(FuzzyClient * client, FuzzyMessage * msg)
+{
+    FUZZY_RECV_STATUS status = FUZZY_RECV_MORE;
+    FUZZY_FRAME_STATUS frame = FUZZY_FRAME_PARTIAL;
+
+    if (client->link)
+        return _server_local_readable(client);
+    if (client->uring)
+        return _server_uring_readable(client, msg);
+
+    while (true) {
+        /* a single read can hold many pipelined messages */
+        while (! client->throttled && _client_active(client) &&
+          (frame = fuzzy_message_extract(&client->inbuf, msg)) == FUZZY_FRAME_READY) {
+            _fuzzy_process_message(msg, client);
+            if (! _server_running())
+                return true;
+        }
+
+        if (frame == FUZZY_FRAME_INVALID) {
+            fuzzy_warning(fuzzy_sformat("Invalid frame from socket %d", client->socket));
+            return false;
+        }
+        /* a joining client is read again by the room reactor */
+        if (client->throttled || ! _client_active(client) || status != FUZZY_RECV_MORE)
+            break;
+
+        _stats_add(syscalls, 1);
+        status = fuzzy_ring_recv(client->socket, &client->inbuf);
+    }
+
+    return status != FUZZY_RECV_CLOSED;
+}
+
+/* queues and relays the player actions of valid channel datagrams, taking the
+    state acks. Unknown senders and datagrams older than the last accepted one
+    are dropped. */
+static void _server_channel_readable(FuzzyMessage * msg)
+{
+    struct sockaddr_in addr;
+    FuzzyClient * client;
+    FuzzyClientChannel * ch;
+    FuzzyCommand cmd;
+    ubyte32 id, key, seq;
+
+    while (fuzzy_message_recvfrom(Reactor->udpsock, msg, &addr) == FUZZY_RECV_MORE) {
+        _stats_add(datagrams_in, 1);
+        if (msg->cursor < FUZZY_CHANNEL_HEADER_SIZE)
+            continue;
+
+        id = fuzzy_message_pop32(msg);
+        key = fuzzy_message_pop32(msg);
+        seq = fuzzy_message_pop32(msg);
+        if (id >= Reactor->clients_size || (client = Reactor->clients[id]) == NULL)
+            continue;
+        if ((ch = client->channel) == NULL || ch->key != key || ! _client_active(client))
+            continue;
+        if (! fuzzy_protocol_seq_after(seq, ch->seq_in)) {
+            _stats_add(datagrams_stale, 1);
+            continue;
+        }
+        ch->seq_in = seq;
+        ch->addr = addr;
+        ch->bound = true;
+
+        while (msg->cursor > 0 && client->room) {
+            if (! fuzzy_protocol_decode_message(msg, &cmd))
+                break;
+            if (cmd.type == FUZZY_COMMAND_STATE_ACK) {
+                _room_ack(client, cmd.data.state.tick, false);
+                continue;
+            }
+            if (! fuzzy_protocol_is_player_action(cmd.type))
+                break;
+            Reactor->out_type = cmd.type;
+            _room_intent(client->room, client, cmd.type, &cmd.data.player);
+            _room_relay(client->room, client, cmd.type, &cmd.data.player);
+        }
+    }
+}
+
+/* flushes pending data, resuming throttled clients once drained */
+static void _server_client_writable(FuzzyClient * client, FuzzyMessage * msg)
+{
+    _client_flush(client);
+
+    if (client->throttled && ! client->closing && client->outq.bytes <= ServerHighWater / 2) {
+        fuzzy_debug(fuzzy_sformat("Resuming client %d", client->socket));
+        client->throttled = false;
+        if (ServerBackend == FUZZY_SERVER_BACKEND_SELECT && client->outq.bytes == 0)
+            FD_CLR(client->socket, &Reactor->writeset);
+        if (! _server_client_readable(client, msg))
+            _client_kill(client);
+    }
+}
+
+/* registers a client socket with the current reactor loop */
+static void _server_watch(FuzzyClient * client)
+{
+    struct epoll_event ev;
+
+    if (ServerBackend == FUZZY_SERVER_BACKEND_SELECT) {
+        FD_SET(client->socket, &Reactor->readset);
+        if (client->outq.bytes > 0 || client->throttled)
+            FD_SET(client->socket, &Reactor->writeset);
+    } else if (ServerBackend == FUZZY_SERVER_BACKEND_URING) {
+        if (client->uring == NULL) {
+            client->uring = fuzzy_new(FuzzyClientUring);
+            bzero(client->uring, sizeof(FuzzyClientUring));
+        }
+        if (! client->throttled)
+            _uring_recv(client);
+        if (! client->link)
+            _client_flush(client);
+    } else {
+        /* write edges only fire when a blocked socket drains. A local link
+            is never written to */
+        bzero(&ev, sizeof(ev));
+        ev.events = client->link ? EPOLLIN | EPOLLET : EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = client->socket;
+        fuzzy_lz_perror(epoll_ctl(Reactor->epfd, EPOLL_CTL_ADD, client->socket, &ev));
+    }
+}
+
+/* takes in the clients handed off by other reactors and the new in-process
+    clients */
+static void _server_read_mailbox(FuzzyMessage * msg)
+{
+    FuzzyClient * client;
+    FuzzyClient * arrived;
+    eventfd_t count;
+
+    if (eventfd_read(Reactor->wakefd, &count) < 0 && errno != EAGAIN)
+        fuzzy_critical(fuzzy_strerror(errno));
+
+    fuzzy_nz_rerror(pthread_mutex_lock(&Reactor->mailbox_lock));
+    arrived = Reactor->mailbox;
+    Reactor->mailbox = NULL;
+    fuzzy_nz_rerror(pthread_mutex_unlock(&Reactor->mailbox_lock));
+
+    while (arrived && _server_running()) {
+        client = arrived;
+        fuzzy_list_next(arrived);
+        fuzzy_list_null(client);
+
+        _client_attach(client);
+        _server_watch(client);
+        if (client->joining) {
+            Reactor->out_type = FUZZY_COMMAND_GAME_JOIN;
+            _room_join(msg, client, client->joining);
+            client->joining = 0;
+        } else {
+            fuzzy_debug(fuzzy_sformat("Local client connected -> #%d", client->socket));
+        }
+
+        /* messages pipelined after the join were left for us */
+        if (! _server_client_readable(client, msg))
+            _client_kill(client);
+    }
+
+    /* put back what was not taken on shutdown */
+    if (arrived) {
+        fuzzy_nz_rerror(pthread_mutex_lock(&Reactor->mailbox_lock));
+        client = arrived;
+        while (fuzzy_list_next_ptr(client))
+            fuzzy_list_next(client);
+        fuzzy_list_next_ptr(client) = Reactor->mailbox;
+        Reactor->mailbox = arrived;
+        fuzzy_nz_rerror(pthread_mutex_unlock(&Reactor->mailbox_lock));
+    }
+}
+
+/* Legacy select based loop: visits every descriptor on each wakeup */
+static void _server_loop_select(FuzzyMessage * msg)
+{
+    int i;
+    fd_set read_fd_set, write_fd_set;
+    FuzzyClient * client;
+
+    if (Reactor->socket >= FD_SETSIZE || Reactor->wakefd >= FD_SETSIZE || Reactor->udpsock >= FD_SETSIZE
+      || Reactor->tickfd >= FD_SETSIZE || Reactor->unixsock >= FD_SETSIZE)
+        fuzzy_critical("Server socket does not fit select set");
+
+    /* Initialize the set of active sockets */
+    FD_ZERO(&Reactor->readset);
+    FD_ZERO(&Reactor->writeset);
+    FD_SET(Reactor->socket, &Reactor->readset);
+    FD_SET(Reactor->wakefd, &Reactor->readset);
+    FD_SET(Reactor->udpsock, &Reactor->readset);
+    FD_SET(Reactor->tickfd, &Reactor->readset);
+    if (Reactor->unixsock >= 0)
+        FD_SET(Reactor->unixsock, &Reactor->readset);
+
+    while(_server_running()) {
+        read_fd_set = Reactor->readset;
+        write_fd_set = Reactor->writeset;
+        _stats_add(syscalls, 1);
+        if (select(FD_SETSIZE, &read_fd_set, &write_fd_set, NULL, NULL) < 0) {
+            if (errno == EINTR)
+                continue;
+            fuzzy_critical(fuzzy_strerror(errno));
+        }
+        _server_wake_locals();
+
+        for (i = 0; i<FD_SETSIZE && _server_running(); ++i) {
+            if (FD_ISSET(i, &read_fd_set)) {
+                if (i == Reactor->socket || i == Reactor->unixsock) {
+                    /* connection request */
+                    if ((client = _server_accept(i)) == NULL)
+                        continue;
+
+                    if (client->socket >= FD_SETSIZE) {
+                        fuzzy_warning(fuzzy_sformat("Socket #%d exceeds select limit", client->socket));
+                        _server_client_close(client);
+                    } else {
+                        FD_SET(client->socket, &Reactor->readset);
+                    }
+                } else if (i == Reactor->wakefd) {
+                    _server_read_mailbox(msg);
+                } else if (i == Reactor->udpsock) {
+                    _server_channel_readable(msg);
+                } else if (i == Reactor->tickfd) {
+                    _server_tick();
+                } else {
+                    client = _get_client_by_socket(i);
+                    if (_client_active(client) && ! _server_client_readable(client, msg))
+                        _client_kill(client);
+                }
+            }
+            if (FD_ISSET(i, &write_fd_set) && i < Reactor->clients_size && Reactor->clients[i] != NULL
+              && _client_active(Reactor->clients[i]))
+                _server_client_writable(Reactor->clients[i], msg);
+        }
+
+        _server_poll_locals();
+        _server_end_round();
+    }
+}
+
+/* Edge triggered epoll loop: only ready sockets are visited */
+static void _server_loop_epoll(FuzzyMessage * msg)
+{
+    struct epoll_event ev;
+    struct epoll_event events[FUZZY_SERVER_MAX_EVENTS];
+    int nready, i, fd;
+    FuzzyClient * client;
+
+    fuzzy_lz_perror(Reactor->epfd = epoll_create1(EPOLL_CLOEXEC));
+    _set_nonblocking(Reactor->socket);
+
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = Reactor->socket;
+    fuzzy_lz_perror(epoll_ctl(Reactor->epfd, EPOLL_CTL_ADD, Reactor->socket, &ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = Reactor->wakefd;
+    fuzzy_lz_perror(epoll_ctl(Reactor->epfd, EPOLL_CTL_ADD, Reactor->wakefd, &ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = Reactor->udpsock;
+    fuzzy_lz_perror(epoll_ctl(Reactor->epfd, EPOLL_CTL_ADD, Reactor->udpsock, &ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = Reactor->tickfd;
+    fuzzy_lz_perror(epoll_ctl(Reactor->epfd, EPOLL_CTL_ADD, Reactor->tickfd, &ev));
+    if (Reactor->unixsock >= 0) {
+        _set_nonblocking(Reactor->unixsock);
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = Reactor->unixsock;
+        fuzzy_lz_perror(epoll_ctl(Reactor->epfd, EPOLL_CTL_ADD, Reactor->unixsock, &ev));
+    }
+
+    while(_server_running()) {
+        _stats_add(syscalls, 1);
+        nready = epoll_wait(Reactor->epfd, events, FUZZY_SERVER_MAX_EVENTS, -1);
+        if (nready < 0) {
+            if (errno == EINTR)
+                continue;
+            fuzzy_critical(fuzzy_strerror(errno));
+        }
+        _server_wake_locals();
+
+        for (i = 0; i < nready && _server_running(); i++) {
+            fd = events[i].data.fd;
+
+            if (fd == Reactor->socket || fd == Reactor->unixsock) {
+                /* edge triggered: drain the accept queue */
+                while ((client = _server_accept(fd)) != NULL)
+                    _server_watch(client);
+            } else if (fd == Reactor->wakefd) {
+                _server_read_mailbox(msg);
+            } else if (fd == Reactor->udpsock) {
+                _server_channel_readable(msg);
+            } else if (fd == Reactor->tickfd) {
+                _server_tick();
+            } else {
+                client = _get_client_by_socket(fd);
+                if (! _client_active(client))
+                    continue;
+
+                if (events[i].events & EPOLLOUT)
+                    _server_client_writable(client, msg);
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    if (! _server_client_readable(client, msg))
+                        _client_kill(client);
+            }
+        }
+
+        /* close also removes the sockets from the epoll set */
+        _server_poll_locals();
+        _server_end_round();
+    }
+
+    close(Reactor->epfd);
+    Reactor->epfd = -1;
+}
+
+/* a connection from the multishot accept, its address is asked apart */
+static void _uring_accepted(int lsock, int res, uint flags)
+{
+    FuzzyAddress address;
+
+    if (! _server_running()) {
+        if (res >= 0)
+            close(res);
+        return;
+    }
+    if (! (flags & IORING_CQE_F_MORE))
+        _uring_accept(lsock);
+    if (res < 0) {
+        if (res == -EINTR || res == -EAGAIN || res == -ECANCELED)
+            return;
+        fuzzy_critical(fuzzy_strerror(-res));
+    }
+
+    /* the peer can be gone already */
+    address.len = sizeof(address.addr);
+    if (getpeername(res, &address.addr.sa, &address.len) < 0) {
+        close(res);
+        return;
+    }
+    _server_watch(_server_accepted(lsock, res, &address));
+}
+
+static void _uring_polled(int fd, int res, uint flags, FuzzyMessage * msg)
+{
+    if (! _server_running())
+        return;
+    if (! (flags & IORING_CQE_F_MORE))
+        _uring_poll(fd, ((ulong) fd << 3) | URING_POLL);
+    if (res < 0)
+        return;
+
+    if (fd == Reactor->wakefd)
+        _server_read_mailbox(msg);
+    else if (fd == Reactor->udpsock)
+        _server_channel_readable(msg);
+    else if (fd == Reactor->tickfd)
+        _server_tick();
+}
+
+/* data in a provided buffer is moved to the client ring, giving the buffer
+    back at once. Local links only get their eventfd readiness */
+static void _uring_received(FuzzyClient * client, int res, uint flags, FuzzyMessage * msg)
+{
+    FuzzyClientUring * cu = client->uring;
+    unsigned id;
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        id = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0)
+            fuzzy_ring_write(&client->inbuf, fuzzy_uring_buffer(Reactor->uring, id), res);
+        fuzzy_uring_buffer_return(Reactor->uring, id);
+    }
+    /* ENOBUFS only stops the multishot receive, it is armed again below */
+    if (! client->link && (res == 0 || (res < 0 && res != -ECANCELED && res != -ENOBUFS)))
+        cu->eof = true;
+    if (! (flags & IORING_CQE_F_MORE)) {
+        cu->receiving = false;
+        _uring_done(client);
+    }
+
+    if (! _server_running() || ! _client_active(client))
+        return;
+    if (! _server_client_readable(client, msg))
+        _client_kill(client);
+    else if (! client->throttled)
+        _uring_recv(client);
+}
+
+static void _uring_sent(FuzzyClient * client, int res, FuzzyMessage * msg)
+{
+    FuzzyClientUring * cu = client->uring;
+
+    cu->sending = false;
+    if (res >= 0) {
+        fuzzy_outqueue_consume(&client->outq, res);
+        _stats_sub(queued_bytes, res);
+        if ((size_t)res < cu->inflight)
+            _stats_add(stalls, 1);
+    } else {
+        /* EPIPE, ECONNRESET, or cancelled by the close */
+        _client_kill(client);
+    }
+    _uring_done(client);
+
+    /* the next batch, and throttled clients resume */
+    if (_server_running() && _client_active(client))
+        _server_client_writable(client, msg);
+}
+
+static void _uring_complete(struct io_uring_cqe * cqe, FuzzyMessage * msg)
+{
+    ulong data = cqe->user_data;
+    int res = cqe->res;
+    uint flags = cqe->flags;
+    FuzzyClient * client = (FuzzyClient *) (data & ~(ulong) URING_TAGS);
+
+    /* the handlers can fill the completion queue again */
+    fuzzy_uring_cqe_seen(Reactor->uring);
+
+    switch (data & URING_TAGS) {
+        case URING_ACCEPT:
+            _uring_accepted(data >> 3, res, flags);
+            break;
+        case URING_POLL:
+            _uring_polled(data >> 3, res, flags, msg);
+            break;
+        case URING_RECV:
+            _uring_received(client, res, flags, msg);
+            break;
+        case URING_SEND:
+            _uring_sent(client, res, msg);
+            break;
+    }
+}
+
+/* Completion loop: a single io_uring_enter submits the requests queued by
+    the previous round and waits for the next completions */
+static void _server_loop_uring(FuzzyMessage * msg)
+{
+    FuzzyUring ring;
+    struct io_uring_cqe * cqe;
+    struct io_uring_sqe * sqe;
+    ulong enters = 0;
+
+    fuzzy_uring_init(&ring, FUZZY_URING_ENTRIES);
+    fuzzy_uring_buffers(&ring, FUZZY_URING_BUFFERS, FUZZY_URING_BUFFER_SIZE);
+    Reactor->uring = &ring;
+
+    _uring_accept(Reactor->socket);
+    if (Reactor->unixsock >= 0)
+        _uring_accept(Reactor->unixsock);
+    _uring_poll(Reactor->wakefd, ((ulong) Reactor->wakefd << 3) | URING_POLL);
+    _uring_poll(Reactor->udpsock, ((ulong) Reactor->udpsock << 3) | URING_POLL);
+    _uring_poll(Reactor->tickfd, ((ulong) Reactor->tickfd << 3) | URING_POLL);
+
+    while (_server_running()) {
+        fuzzy_uring_enter(&ring, 1);
+        _stats_add(syscalls, ring.enters - enters);
+        enters = ring.enters;
+        _server_wake_locals();
+
+        while (_server_running() && (cqe = fuzzy_uring_cqe(&ring)) != NULL)
+            _uring_complete(cqe, msg);
+        _server_poll_locals();
+        _server_end_round();
+    }
+
+    /* the frames and buffers must outlive the client requests */
+    sqe = _uring_sqe(-1, IORING_OP_ASYNC_CANCEL, URING_CANCEL);
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    while (Reactor->uring_ops > 0) {
+        fuzzy_uring_enter(&ring, 1);
+        while ((cqe = fuzzy_uring_cqe(&ring)) != NULL)
+            _uring_complete(cqe, msg);
+    }
+
+    fuzzy_uring_free(&ring);
+    Reactor->uring = NULL;
+}
+
+void fuzzy_server_set_highwater(size_t bytes)
+{
+    ServerHighWater = bytes;
+}
+
+void fuzzy_server_set_tick_rate(int hz)
+{
+    ServerTickRate = hz;
+}
+
+void fuzzy_server_set_journal(char * path)
+{
+    ServerJournalPath = path;
+}
+
+void fuzzy_server_set_idle_timeout(int seconds)
+{
+    ServerIdleTimeout = seconds;
+}
+
+void fuzzy_server_set_backend(FuzzyServerBackend backend)
+{
+    ServerBackend = backend;
+}
+
+void fuzzy_server_set_reactors(int count)
+{
+    if (ServerReactors != NULL)
+        fuzzy_critical("Reactors must be set before server creation");
+    ServerReactorsCount = fuzzy_max(1, fuzzy_min(count, FUZZY_SERVER_MAX_REACTORS));
+}
+
+static void _unix_address(FuzzyAddress * address, char * path)
+{
+    if (strlen(path) >= sizeof(address->addr.un.sun_path))
+        fuzzy_critical(fuzzy_sformat("Unix socket path too long: %s", path));
+    address->addr.un.sun_family = AF_UNIX;
+    strcpy(address->addr.un.sun_path, path);
+    address->len = sizeof(struct sockaddr_un);
+}
+
+/* also listen on a unix socket, beside the TCP port */
+void fuzzy_server_set_unix_path(char * path)
+{
+    if (ServerReactors != NULL)
+        fuzzy_critical("Unix path must be set before server creation");
+    bzero(&ServerUnixAddress, sizeof(ServerUnixAddress));
+    _unix_address(&ServerUnixAddress, path);
+}
+
+static void * _reactor_loop(void * args)
+{
+    FuzzyMessage * msg;
+
+    Reactor = (FuzzyReactor *) args;
+    msg = fuzzy_message_new();
+    Reactor->dgram = fuzzy_message_new();
+    Reactor->state = fuzzy_message_new();
+
+    switch (ServerBackend) {
+        case FUZZY_SERVER_BACKEND_SELECT:
+            fuzzy_debug(fuzzy_sformat("Reactor %d backend: select", Reactor->id));
+            _server_loop_select(msg);
+            break;
+        case FUZZY_SERVER_BACKEND_EPOLL:
+            fuzzy_debug(fuzzy_sformat("Reactor %d backend: epoll", Reactor->id));
+            _server_loop_epoll(msg);
+            break;
+        case FUZZY_SERVER_BACKEND_URING:
+            fuzzy_debug(fuzzy_sformat("Reactor %d backend: io_uring", Reactor->id));
+            _server_loop_uring(msg);
+            break;
+    }
+
+    fuzzy_message_del(msg);
+    fuzzy_message_del(Reactor->dgram);
+    fuzzy_message_del(Reactor->state);
+    Reactor->dgram = NULL;
+    Reactor->state = NULL;
+    fuzzy_message_pool_clear();
+    Reactor = NULL;
+    return 0;
+}
+
+/* runs the first reactor in the calling thread, the others on their own threads */
+void * fuzzy_server_loop(void * args)
+{
+    int i;
+
+    if (ServerReactors == NULL)
+        fuzzy_critical("Server not running");
+
+    __atomic_store_n(&ServerRun, true, __ATOMIC_RELAXED);
+    for (i = 1; i < ServerReactorsCount; i++)
+        fuzzy_nz_rerror(pthread_create(&ServerReactors[i].thread, NULL, _reactor_loop, &ServerReactors[i]));
+
+    _reactor_loop(&ServerReactors[0]);
+
+    for (i = 1; i < ServerReactorsCount; i++)
+        fuzzy_nz_rerror(pthread_join(ServerReactors[i].thread, NULL));
+    return 0;
+}
+
+void fuzzy_server_address(FuzzyAddress * address, char * host, int port)
+{
+    bzero(address, sizeof(FuzzyAddress));
+    if (strncmp(host, FUZZY_UNIX_PREFIX, strlen(FUZZY_UNIX_PREFIX)) == 0) {
+        _unix_address(address, host + strlen(FUZZY_UNIX_PREFIX));
+    } else {
+        fuzzy_iz_perror(inet_aton(host, &address->addr.in.sin_addr));
+        address->addr.in.sin_family = AF_INET;
+        address->addr.in.sin_port = htons(port);
+        address->len = sizeof(struct sockaddr_in);
+    }
+}
+
+int fuzzy_server_connect_address(FuzzyAddress * address)
+{
+    int sock;
+
+    fuzzy_lz_perror(sock = socket(address->addr.sa.sa_family, SOCK_STREAM, 0));
+    fuzzy_lz_perror(connect(sock, &address->addr.sa, address->len));
+    return sock;
+}
+
+int fuzzy_server_connect(char * host, int port)
+{
+    FuzzyAddress address;
+    int sock;
+
+    fuzzy_server_address(&address, host, port);
+    sock = fuzzy_server_connect_address(&address);
+    if (address.addr.sa.sa_family == AF_UNIX)
+        fuzzy_debug(fuzzy_sformat("Connected to server %s", host));
+    else
+        fuzzy_debug(fuzzy_sformat("Connected to server %s:%d", host, port));
+
+    return sock;
+}
+
+/* an authenticated client inside this process, on the next reactor. The
+    server must exist, its loop can start later */
+FuzzyLocalLink * fuzzy_server_local_connect(void (*notify)(void * data), void * data)
+{
+    FuzzyLocalLink * link;
+    FuzzyClient * client;
+    int reactor;
+
+    if (ServerReactors == NULL)
+        fuzzy_critical("Server not running");
+
+    link = fuzzy_new(FuzzyLocalLink);
+    bzero(link, sizeof(FuzzyLocalLink));
+    fuzzy_lz_perror(link->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+    fuzzy_queue_init(&link->requests, FUZZY_LOCAL_QUEUE_SIZE);
+    fuzzy_queue_init(&link->replies, FUZZY_LOCAL_QUEUE_SIZE);
+    link->notify = notify;
+    link->notify_data = data;
+    link->refs = 2;
+
+    client = _client_new(link->wakefd);
+    strcpy(client->ip, "local");
+    client->auth = true;
+    client->version = FUZZY_PROTOCOL_VERSION;
+    client->caps = client->offer = HOST_CAPS;
+    client->link = link;
+
+    reactor = __atomic_fetch_add(&ServerLocalNext, 1, __ATOMIC_RELAXED) % ServerReactorsCount;
+    _reactor_post(&ServerReactors[reactor], client);
+    return link;
+}
+
+bool fuzzy_server_local_send(FuzzyLocalLink * link, FuzzyMessage * msg)
+{
+    if (! fuzzy_queue_push(&link->requests, msg))
+        return false;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (! __atomic_exchange_n(&link->server_awake, true, __ATOMIC_SEQ_CST))
+        fuzzy_lz_perror(eventfd_write(link->wakefd, 1));
+    return true;
+}
+
+/* on an empty queue the flag is cleared, then the queue checked again: a
+    reply queued meanwhile is either returned here or notified again */
+FuzzyFrame * fuzzy_server_local_recv(FuzzyLocalLink * link)
+{
+    FuzzyFrame * frame;
+
+    if ((frame = (FuzzyFrame *) fuzzy_queue_pop(&link->replies)) == NULL) {
+        __atomic_store_n(&link->client_signaled, false, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        frame = (FuzzyFrame *) fuzzy_queue_pop(&link->replies);
+    }
+    /* frames of local clients are never compressed, they are read in place */
+    return frame;
+}
+
+bool fuzzy_server_local_closed(FuzzyLocalLink * link)
+{
+    return __atomic_load_n(&link->closed, __ATOMIC_SEQ_CST);
+}
+
+/* the link must not be used anymore */
+void fuzzy_server_local_close(FuzzyLocalLink * link)
+{
+    __atomic_store_n(&link->closed, true, __ATOMIC_SEQ_CST);
+    fuzzy_lz_perror(eventfd_write(link->wakefd, 1));
+    _local_release(link);
 }
@@ -20,20 +20,90 @@
 
 #include "fuzzy.h"
 #include "list.h"
+#include "network.h"
+#include <sys/un.h>
 
 #define FUZZY_DEFAULT_SERVER_PORT 7557
 #define FUZZY_DEFAULT_SERVER_ADDRESS "127.0.0.1"
-#define FUZZY_SERVER_BACKLOG 1
+#define FUZZY_SERVER_BACKLOG 128
+#define FUZZY_SERVER_MAX_EVENTS 64
+#define FUZZY_SERVER_CLIENTS_INITIAL 64
+#define FUZZY_SERVER_MAX_REACTORS 64
+#define FUZZY_SERVER_HIGHWATER (256*1024)   // throttle clients above this queue size
+#define FUZZY_SERVER_DROP_FACTOR 4          // drop clients above highwater times this
+#define FUZZY_SERVER_TICK_RATE 20           // room game ticks per second
+#define FUZZY_ROOM_MAX_INTENTS 256          // player actions queued for a tick, others are dropped
+#define FUZZY_SERVER_IDLE_TIMEOUT 60        // seconds without messages before a client is closed
 #define FUZZY_SERVERKEY_LEN 37
 #define FUZZY_NET_ROOM_LEN 64
+#define FUZZY_ROOM_SLOT_BITS 20             // room ids: 12 bits generation, 20 bits slot
+#define FUZZY_ROOM_MAX_SLOTS (1 << FUZZY_ROOM_SLOT_BITS)
+#define FUZZY_ROOM_MAX_GENERATION ((1 << (32 - FUZZY_ROOM_SLOT_BITS)) - 1)
+#define FUZZY_LOCAL_QUEUE_SIZE 4096         // messages each way on in-process links
+#define FUZZY_UNIX_PREFIX "unix:"           // endpoints on a unix domain socket
+
+/* Server event loop implementations */
+typedef enum FuzzyServerBackend {
+    FUZZY_SERVER_BACKEND_EPOLL,         // edge triggered epoll, default
+    FUZZY_SERVER_BACKEND_SELECT,        // legacy select loop, limited to FD_SETSIZE
+    FUZZY_SERVER_BACKEND_URING          // io_uring, epoll if the kernel lacks it
+} FuzzyServerBackend;
+
+/* In-process connection: a client thread and a reactor exchange messages
+   through single producer, single consumer queues, without sockets. Requests
+   are handed over as they are, replies as references to the frames the other
+   clients get, read in place. The reactor polls its links at the end of each
+   round, so a client only signals the eventfd while the reactor sleeps. The
+   eventfd also stands for the client socket inside the reactor. The reactor
+   notifies the client once until it drains. */
+typedef struct FuzzyLocalLink {
+    int wakefd;
+    FuzzyQueue requests;                // FuzzyMessage, client to server
+    FuzzyQueue replies;                 // FuzzyFrame, server to client
+    void (*notify)(void * data);        // called by the reactor when replies are ready
+    void * notify_data;
+    bool server_awake;                  // the reactor polls, no signal needed
+    bool client_signaled;
+    bool closed;                        // by either side
+    int refs;                           // client and server
+} FuzzyLocalLink;
+
+/* A stream endpoint: an IPv4 address and port, or a unix socket path */
+typedef struct FuzzyAddress {
+    socklen_t len;
+    union {
+        struct sockaddr sa;
+        struct sockaddr_in in;
+        struct sockaddr_un un;
+    } addr;
+}FuzzyAddress;
 
 typedef struct FuzzyClient {
     char ip[16];
     ubyte port;
     int socket;
     bool auth;
+    ubyte8 version;                     // negotiated protocol revision
+    ubyte32 caps;                       // negotiated capabilities
+    ubyte32 offer;                      // capabilities of its transport
+    ubyte32 reqid;                      // id of the request being served, 0 if untagged
+    FuzzyLocalLink * link;              // in-process client, NULL on sockets
+    struct FuzzyClientUring * uring;    // io_uring backend only
     struct FuzzyRoom * room;
+    ulong joining;                      // room to join on another reactor
+    int handoff;                        // reactor owning the joining room
+    struct FuzzyClientChannel * channel; // udp channel, NULL if not open
+    struct FuzzyPlayer * player;        // game player while inside a room
+    bool replicated;                    // receives the room state
+    ubyte32 acked;                      // last room state the client has
+    FuzzyRingBuffer inbuf;
+    FuzzyOutQueue outq;
+    bool throttled;                     // not read until its queue drains
+    bool closing;                       // will be closed after current events
+    ulong seen;                         // reactor tick of its last message
+    FuzzyTimer idle;                    // closes it when silent, armed while attached
 
+    /* room members or reactor mailbox link */
     fuzzy_list_link(struct FuzzyClient);
 }FuzzyClient;
 
@@ -42,13 +112,73 @@ typedef struct FuzzyRoom {
     char name[FUZZY_NET_ROOM_LEN];
     FuzzyClient * owner;
     FuzzyClient * clients;
+    int reactor;                        // only this reactor touches the clients
+    struct FuzzyRoomState * state;      // authoritative game state
     fuzzy_list_link(struct FuzzyRoom);
 }FuzzyRoom;
 
+#define FUZZY_STATS_COMMANDS 32             // command types with their own counters
+
+/* stream messages by command type. Replies and notifications are counted
+    under the command which caused them, states under FUZZY_COMMAND_STATE */
+typedef struct FuzzyCommandStats {
+    ulong messages_in;
+    size_t bytes_in;
+    ulong messages_out;
+    size_t bytes_out;
+    FuzzyHistogram latency;             // processing time, in ns
+}FuzzyCommandStats;
+
+typedef struct FuzzyServerStats {
+    ulong clients;
+    ulong rooms;
+    size_t queued_bytes;                // bytes waiting on client queues
+    ulong stalls;                       // flushes stopped by a full socket
+    ulong throttles;                    // clients throttled over highwater
+    ulong drops;                        // clients dropped for being too slow
+    ulong handoffs;                     // clients moved to another reactor
+    ulong datagrams_in;
+    ulong datagrams_out;
+    ulong datagrams_stale;              // channel datagrams older than the last one
+    ulong states;                       // room states sent to clients
+    size_t state_bytes;                 // bytes of the sent room states
+    ulong deflated;                     // frames sent compressed
+    size_t deflate_saved;               // bytes saved by compression
+    ulong ticks;
+    ulong ticks_late;                   // ticks missed because the reactor was busy
+    ulong tick_ns;                      // time spent running the room ticks
+    ulong tick_max_ns;                  // slowest tick
+    ulong intents_dropped;              // player actions over the tick queue limit
+    ulong decode_errors;                // malformed stream messages
+    ulong syscalls;                     // event waits and stream socket calls
+    ulong timeouts;                     // clients closed for being silent
+    FuzzyCommandStats commands[FUZZY_STATS_COMMANDS];
+}FuzzyServerStats;
+
 void fuzzy_server_create(int port, char * keyout);
 void fuzzy_server_destroy();
+void fuzzy_server_set_backend(FuzzyServerBackend backend);
+void fuzzy_server_set_highwater(size_t bytes);
+void fuzzy_server_set_reactors(int count);
+void fuzzy_server_set_tick_rate(int hz);
+// 0 never closes silent clients. In-process clients are never closed for it
+void fuzzy_server_set_idle_timeout(int seconds);
+// Appends the room commands to path, see journal.h. NULL for none
+void fuzzy_server_set_journal(char * path);
+void fuzzy_server_set_unix_path(char * path);
+void fuzzy_server_get_stats(FuzzyServerStats * stats);
 void * fuzzy_server_loop(void * args);
-int fuzzy_server_connect(char * addr, int port);
+// host is an IPv4 address or unix:/path, port is only used by the former
+void fuzzy_server_address(FuzzyAddress * address, char * host, int port);
+int fuzzy_server_connect_address(FuzzyAddress * address);
+int fuzzy_server_connect(char * host, int port);
+FuzzyLocalLink * fuzzy_server_local_connect(void (*notify)(void * data), void * data);
+// Takes msg, false if the queue is full and msg is still owned by the caller
+bool fuzzy_server_local_send(FuzzyLocalLink * link, FuzzyMessage * msg);
+// Next server frame or NULL, read through fuzzy_frame_view. The caller unrefs it
+FuzzyFrame * fuzzy_server_local_recv(FuzzyLocalLink * link);
+bool fuzzy_server_local_closed(FuzzyLocalLink * link);
+void fuzzy_server_local_close(FuzzyLocalLink * link);
 void fuzzy_server_stop(int svsock);
 
 #endif
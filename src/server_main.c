@@ -15,12 +15,60 @@
  *
  */
 
+#include <unistd.h>
 #include "fuzzy.h"
 #include "server.h"
 
-int main()
+static void _usage(char * prog)
+{
+    fprintf(stderr, "Usage: %s [-b epoll|select|uring] [-w highwater_bytes] [-t reactors] [-r tick_rate]\n"
+      "    [-u unix_socket] [-i idle_seconds] [-j journal]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char * argv[])
 {
     char srvkey[FUZZY_SERVERKEY_LEN];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:w:t:r:u:i:j:")) != -1) {
+        switch (opt) {
+            case 'b':
+                if (strcmp(optarg, "epoll") == 0)
+                    fuzzy_server_set_backend(FUZZY_SERVER_BACKEND_EPOLL);
+                else if (strcmp(optarg, "select") == 0)
+                    fuzzy_server_set_backend(FUZZY_SERVER_BACKEND_SELECT);
+                else if (strcmp(optarg, "uring") == 0)
+                    fuzzy_server_set_backend(FUZZY_SERVER_BACKEND_URING);
+                else
+                    _usage(argv[0]);
+                break;
+            case 'w':
+                fuzzy_server_set_highwater(atol(optarg));
+                break;
+            case 't':
+                fuzzy_server_set_reactors(atoi(optarg));
+                break;
+            case 'r':
+                if (atoi(optarg) <= 0)
+                    _usage(argv[0]);
+                fuzzy_server_set_tick_rate(atoi(optarg));
+                break;
+            case 'u':
+                fuzzy_server_set_unix_path(optarg);
+                break;
+            case 'i':
+                if (atoi(optarg) < 0)
+                    _usage(argv[0]);
+                fuzzy_server_set_idle_timeout(atoi(optarg));
+                break;
+            case 'j':
+                fuzzy_server_set_journal(optarg);
+                break;
+            default:
+                _usage(argv[0]);
+        }
+    }
 
     fuzzy_server_create(FUZZY_DEFAULT_SERVER_PORT, srvkey);
     fuzzy_server_loop(NULL);
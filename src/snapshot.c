@@ -0,0 +1,366 @@
+/*
+ * Emanuele Faranda         black.silver@hotmail.it
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+#include "fuzzy.h"
+#include "network.h"
+#include "game.h"
+#include "snapshot.h"
+
+/* Op kinds, low bits of the op byte. The changed fields mask follows. */
+#define OP_ADD 0
+#define OP_UPDATE 1
+#define OP_REMOVE 2
+#define OP_BITS 2
+#define OP_MASK ((1 << OP_BITS) - 1)
+
+#define PLAYER_SOUL (1 << 0)
+#define PLAYER_NAME (1 << 1)
+
+#define CHESS_X (1 << 0)
+#define CHESS_Y (1 << 1)
+#define CHESS_AREA (1 << 2)
+#define CHESS_OWNER (1 << 3)
+
+static const FuzzySnapshot EmptySnapshot;
+
+void fuzzy_snapshot_init(FuzzySnapshot * snap)
+{
+    bzero(snap, sizeof(FuzzySnapshot));
+}
+
+void fuzzy_snapshot_free(FuzzySnapshot * snap)
+{
+    free(snap->players);
+    free(snap->chess);
+    fuzzy_snapshot_init(snap);
+}
+
+/* grows the arrays to hold at least nplayers and nchess entries */
+static void _snapshot_fit(FuzzySnapshot * snap, int nplayers, int nchess)
+{
+    if (nplayers > snap->players_size) {
+        snap->players_size = fuzzy_max(nplayers, snap->players_size * 2);
+        fuzzy_iz_perror(snap->players = (FuzzySnapshotPlayer *) realloc(snap->players, snap->players_size * sizeof(FuzzySnapshotPlayer)));
+    }
+    if (nchess > snap->chess_size) {
+        snap->chess_size = fuzzy_max(nchess, snap->chess_size * 2);
+        fuzzy_iz_perror(snap->chess = (FuzzySnapshotChess *) realloc(snap->chess, snap->chess_size * sizeof(FuzzySnapshotChess)));
+    }
+}
+
+static int _player_cmp(const void * a, const void * b)
+{
+    const FuzzySnapshotPlayer * pa = a, * pb = b;
+
+    return (pa->id > pb->id) - (pa->id < pb->id);
+}
+
+static int _chess_cmp(const void * a, const void * b)
+{
+    const FuzzySnapshotChess * ca = a, * cb = b;
+
+    return (ca->id > cb->id) - (ca->id < cb->id);
+}
+
+void fuzzy_snapshot_take(FuzzySnapshot * snap, FuzzyGame * game, ubyte32 tick)
+{
+    FuzzyPlayer * player;
+    FuzzyChess * chess;
+    FuzzySnapshotPlayer * sp;
+    FuzzySnapshotChess * sc;
+    int nplayers = 0, nchess = 0;
+
+    for (player = game->players; player; fuzzy_list_next(player)) {
+        nplayers++;
+        for (chess = player->chess_l; chess; fuzzy_list_next(chess))
+            nchess++;
+    }
+    _snapshot_fit(snap, nplayers, nchess);
+    snap->players_count = nplayers;
+    snap->chess_count = nchess;
+    snap->tick = tick;
+
+    sp = snap->players;
+    sc = snap->chess;
+    for (player = game->players; player; fuzzy_list_next(player)) {
+        bzero(sp, sizeof(FuzzySnapshotPlayer));
+        sp->id = player->id;
+        sp->soul_points = player->soul_points;
+        memcpy(sp->name, player->name, strnlen(player->name, sizeof(sp->name) - 1));
+        sp++;
+
+        for (chess = player->chess_l; chess; fuzzy_list_next(chess)) {
+            sc->id = chess->id;
+            sc->x = chess->x;
+            sc->y = chess->y;
+            sc->owner = player->id;
+            sc->area = chess->atkarea == &FuzzyRangedMan ? FUZZY_SNAPSHOT_AREA_RANGED : FUZZY_SNAPSHOT_AREA_MELEE;
+            sc++;
+        }
+    }
+
+    /* lists keep the insertion order, ids are only sorted per player */
+    if (nplayers > 0)
+        qsort(snap->players, nplayers, sizeof(FuzzySnapshotPlayer), _player_cmp);
+    if (nchess > 0)
+        qsort(snap->chess, nchess, sizeof(FuzzySnapshotChess), _chess_cmp);
+}
+
+static void _push_op(FuzzyMessage * msg, int op, int mask, ubyte32 id)
+{
+    fuzzy_message_pushvar(msg, id);
+    fuzzy_message_push8(msg, op | (mask << OP_BITS));
+}
+
+static int _push_player(FuzzyMessage * msg, const FuzzySnapshotPlayer * old, const FuzzySnapshotPlayer * cur)
+{
+    int mask = 0;
+
+    if (old == NULL) {
+        fuzzy_message_pushvarstr(msg, cur->name, FUZZY_SNAPSHOT_NAME_LEN-1);
+        fuzzy_message_pushvar(msg, cur->soul_points);
+        _push_op(msg, OP_ADD, 0, cur->id);
+        return 1;
+    }
+
+    if (strncmp(old->name, cur->name, FUZZY_SNAPSHOT_NAME_LEN) != 0) {
+        fuzzy_message_pushvarstr(msg, cur->name, FUZZY_SNAPSHOT_NAME_LEN-1);
+        mask |= PLAYER_NAME;
+    }
+    if (old->soul_points != cur->soul_points) {
+        fuzzy_message_pushvar(msg, cur->soul_points);
+        mask |= PLAYER_SOUL;
+    }
+    if (! mask)
+        return 0;
+
+    _push_op(msg, OP_UPDATE, mask, cur->id);
+    return 1;
+}
+
+static int _push_chess(FuzzyMessage * msg, const FuzzySnapshotChess * old, const FuzzySnapshotChess * cur)
+{
+    int mask = 0;
+
+    if (old == NULL) {
+        fuzzy_message_pushvar(msg, cur->y);
+        fuzzy_message_pushvar(msg, cur->x);
+        fuzzy_message_push8(msg, cur->area);
+        fuzzy_message_push8(msg, cur->owner);
+        _push_op(msg, OP_ADD, 0, cur->id);
+        return 1;
+    }
+
+    if (old->owner != cur->owner) {
+        fuzzy_message_push8(msg, cur->owner);
+        mask |= CHESS_OWNER;
+    }
+    if (old->area != cur->area) {
+        fuzzy_message_push8(msg, cur->area);
+        mask |= CHESS_AREA;
+    }
+    if (old->y != cur->y) {
+        fuzzy_message_pushsvar(msg, (int32_t)(cur->y - old->y));
+        mask |= CHESS_Y;
+    }
+    if (old->x != cur->x) {
+        fuzzy_message_pushsvar(msg, (int32_t)(cur->x - old->x));
+        mask |= CHESS_X;
+    }
+    if (! mask)
+        return 0;
+
+    _push_op(msg, OP_UPDATE, mask, cur->id);
+    return 1;
+}
+
+/* Both arrays are walked from the highest id, so the ops are popped in
+    increasing id order. The count goes last, to be popped first. */
+#define _push_section(msg, base_arr, base_count, cur_arr, cur_count, push_entry)\
+do{\
+    int _i = (base_count) - 1, _j = (cur_count) - 1, _n = 0;\
+    while (_i >= 0 || _j >= 0) {\
+        if (_j < 0 || (_i >= 0 && (base_arr)[_i].id > (cur_arr)[_j].id)) {\
+            _push_op(msg, OP_REMOVE, 0, (base_arr)[_i].id);\
+            _n++;\
+            _i--;\
+        } else if (_i < 0 || (cur_arr)[_j].id > (base_arr)[_i].id) {\
+            _n += push_entry(msg, NULL, &(cur_arr)[_j]);\
+            _j--;\
+        } else {\
+            _n += push_entry(msg, &(base_arr)[_i], &(cur_arr)[_j]);\
+            _i--;\
+            _j--;\
+        }\
+    }\
+    fuzzy_message_pushvar(msg, _n);\
+}while(0)
+
+void fuzzy_snapshot_push_delta(FuzzyMessage * msg, const FuzzySnapshot * base, const FuzzySnapshot * snap)
+{
+    _push_section(msg, base->chess, base->chess_count, snap->chess, snap->chess_count, _push_chess);
+    _push_section(msg, base->players, base->players_count, snap->players, snap->players_count, _push_player);
+}
+
+static bool _pop8(FuzzyMessage * msg, ubyte8 * out)
+{
+    if (msg->cursor < 1)
+        return false;
+    *out = fuzzy_message_pop8(msg);
+    return true;
+}
+
+static bool _pop_op(FuzzyMessage * msg, int * op, int * mask, ubyte32 * id)
+{
+    ubyte8 byte;
+
+    if (! _pop8(msg, &byte) || ! fuzzy_message_popvar(msg, id))
+        return false;
+    *op = byte & OP_MASK;
+    *mask = byte >> OP_BITS;
+    return true;
+}
+
+static bool _pop_player(FuzzyMessage * msg, int op, int mask, FuzzySnapshotPlayer * entry)
+{
+    if (op == OP_ADD)
+        mask = PLAYER_SOUL | PLAYER_NAME;
+
+    if ((mask & PLAYER_SOUL) && ! fuzzy_message_popvar(msg, &entry->soul_points))
+        return false;
+    if ((mask & PLAYER_NAME) && ! fuzzy_message_popvarstr(msg, entry->name, FUZZY_SNAPSHOT_NAME_LEN))
+        return false;
+    return true;
+}
+
+static bool _pop_chess(FuzzyMessage * msg, int op, int mask, FuzzySnapshotChess * entry)
+{
+    int32_t diff;
+
+    if (op == OP_ADD)
+        return _pop8(msg, &entry->owner) && _pop8(msg, &entry->area) &&
+            fuzzy_message_popvar(msg, &entry->x) && fuzzy_message_popvar(msg, &entry->y);
+
+    if (mask & CHESS_X) {
+        if (! fuzzy_message_popsvar(msg, &diff))
+            return false;
+        entry->x += diff;
+    }
+    if (mask & CHESS_Y) {
+        if (! fuzzy_message_popsvar(msg, &diff))
+            return false;
+        entry->y += diff;
+    }
+    if ((mask & CHESS_AREA) && ! _pop8(msg, &entry->area))
+        return false;
+    if ((mask & CHESS_OWNER) && ! _pop8(msg, &entry->owner))
+        return false;
+    return true;
+}
+
+/* Merges the base entries with the ops, which must come in increasing id
+    order. Entries without op are copied as they are. */
+#define _pop_section(msg, type, base_arr, base_count, out_arr, out_count, fit, pop_entry)\
+do{\
+    ubyte32 _nops, _id, _last = 0;\
+    int _i = 0, _op, _mask;\
+    bool _first = true;\
+    \
+    out_count = 0;\
+    if (! fuzzy_message_popvar(msg, &_nops) || _nops > msg->cursor)\
+        return false;\
+    for (; _nops > 0; _nops--) {\
+        if (! _pop_op(msg, &_op, &_mask, &_id) || _op > OP_REMOVE)\
+            return false;\
+        if (! _first && _id <= _last)\
+            return false;\
+        _first = false;\
+        _last = _id;\
+        while (_i < (base_count) && (base_arr)[_i].id < _id) {\
+            fit(out_count + 1);\
+            (out_arr)[out_count++] = (base_arr)[_i++];\
+        }\
+        if ((_i < (base_count) && (base_arr)[_i].id == _id) != (_op != OP_ADD))\
+            return false;\
+        if (_op == OP_REMOVE) {\
+            _i++;\
+            continue;\
+        }\
+        fit(out_count + 1);\
+        if (_op == OP_ADD)\
+            bzero(&(out_arr)[out_count], sizeof(type));\
+        else\
+            (out_arr)[out_count] = (base_arr)[_i++];\
+        (out_arr)[out_count].id = _id;\
+        if (! pop_entry(msg, _op, _mask, &(out_arr)[out_count]))\
+            return false;\
+        out_count++;\
+    }\
+    while (_i < (base_count)) {\
+        fit(out_count + 1);\
+        (out_arr)[out_count++] = (base_arr)[_i++];\
+    }\
+}while(0)
+
+bool fuzzy_snapshot_pop_delta(FuzzyMessage * msg, const FuzzySnapshot * base, FuzzySnapshot * out)
+{
+    #define _fit_players(n) _snapshot_fit(out, n, 0)
+    #define _fit_chess(n) _snapshot_fit(out, 0, n)
+
+    if (out == base)
+        fuzzy_critical("Delta output cannot be its base");
+
+    _pop_section(msg, FuzzySnapshotPlayer, base->players, base->players_count,
+        out->players, out->players_count, _fit_players, _pop_player);
+    _pop_section(msg, FuzzySnapshotChess, base->chess, base->chess_count,
+        out->chess, out->chess_count, _fit_chess, _pop_chess);
+    return true;
+}
+
+void fuzzy_snapshot_history_init(FuzzySnapshotHistory * history)
+{
+    int i;
+
+    for (i = 0; i < FUZZY_SNAPSHOT_HISTORY; i++)
+        fuzzy_snapshot_init(&history->snaps[i]);
+}
+
+void fuzzy_snapshot_history_free(FuzzySnapshotHistory * history)
+{
+    int i;
+
+    for (i = 0; i < FUZZY_SNAPSHOT_HISTORY; i++)
+        fuzzy_snapshot_free(&history->snaps[i]);
+}
+
+const FuzzySnapshot * fuzzy_snapshot_history_get(FuzzySnapshotHistory * history, ubyte32 tick)
+{
+    FuzzySnapshot * snap = &history->snaps[tick & (FUZZY_SNAPSHOT_HISTORY-1)];
+
+    if (tick == 0 || snap->tick != tick)
+        return &EmptySnapshot;
+    return snap;
+}
+
+FuzzySnapshot * fuzzy_snapshot_history_slot(FuzzySnapshotHistory * history, ubyte32 tick)
+{
+    FuzzySnapshot * snap = &history->snaps[tick & (FUZZY_SNAPSHOT_HISTORY-1)];
+
+    snap->tick = 0;
+    return snap;
+}
@@ -0,0 +1,100 @@
+/*
+ * Emanuele Faranda         black.silver@hotmail.it
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+    Game state replication.
+
+    SNAPSHOT: a flat copy of the replicated game state at a given tick:
+        players with their soul points, chess with position, owner and
+        attack area. Entries are sorted by id.
+    DELTA: the changes from a base snapshot to a newer one, field by field.
+        Unchanged entries take no bytes, so the size follows the changes,
+        not the game size. The base with tick 0 is the empty state.
+    HISTORY: the last snapshots, indexed by tick. A delta can only be
+        decoded against the same base it was encoded with.
+
+    Delta wire format, in pop order: players count, player ops, chess count,
+    chess ops. An op is a byte holding the kind and the changed fields mask,
+    followed by the entry id and the changed fields. Positions are sent as
+    the difference from the base.
+ */
+
+#ifndef __FUZZY_SNAPSHOT_H
+#define __FUZZY_SNAPSHOT_H
+
+#include "network.h"
+#include "game.h"
+
+#define FUZZY_SNAPSHOT_HISTORY 32               // snapshots kept, power of 2
+#define FUZZY_SNAPSHOT_NAME_LEN 32
+
+/* attack areas by wire index */
+typedef enum FUZZY_SNAPSHOT_AREA {
+    FUZZY_SNAPSHOT_AREA_MELEE,
+    FUZZY_SNAPSHOT_AREA_RANGED
+} FUZZY_SNAPSHOT_AREA;
+
+typedef struct FuzzySnapshotPlayer {
+    ubyte32 id;
+    ubyte32 soul_points;
+    char name[FUZZY_SNAPSHOT_NAME_LEN];
+}FuzzySnapshotPlayer;
+
+typedef struct FuzzySnapshotChess {
+    ubyte32 id;
+    ubyte32 x;
+    ubyte32 y;
+    ubyte8 owner;                       // player id
+    ubyte8 area;                        // FUZZY_SNAPSHOT_AREA
+}FuzzySnapshotChess;
+
+typedef struct FuzzySnapshot {
+    ubyte32 tick;                       // 0 for the empty state
+    FuzzySnapshotPlayer * players;
+    int players_count;
+    int players_size;
+    FuzzySnapshotChess * chess;
+    int chess_count;
+    int chess_size;
+}FuzzySnapshot;
+
+typedef struct FuzzySnapshotHistory {
+    FuzzySnapshot snaps[FUZZY_SNAPSHOT_HISTORY];
+}FuzzySnapshotHistory;
+
+void fuzzy_snapshot_init(FuzzySnapshot * snap);
+void fuzzy_snapshot_free(FuzzySnapshot * snap);
+void fuzzy_snapshot_take(FuzzySnapshot * snap, FuzzyGame * game, ubyte32 tick);
+
+/* Encodes the changes from base to snap */
+void fuzzy_snapshot_push_delta(FuzzyMessage * msg, const FuzzySnapshot * base, const FuzzySnapshot * snap);
+
+/* Applies the delta to base, storing the result into out. The tick is left
+    to the caller. Returns false on malformed delta. */
+bool fuzzy_snapshot_pop_delta(FuzzyMessage * msg, const FuzzySnapshot * base, FuzzySnapshot * out);
+
+void fuzzy_snapshot_history_init(FuzzySnapshotHistory * history);
+void fuzzy_snapshot_history_free(FuzzySnapshotHistory * history);
+
+/* The snapshot of tick, or the empty state if it is not in history */
+const FuzzySnapshot * fuzzy_snapshot_history_get(FuzzySnapshotHistory * history, ubyte32 tick);
+
+/* The storage for tick, it replaces an old snapshot. Its tick is cleared
+    until the caller fills it. */
+FuzzySnapshot * fuzzy_snapshot_history_slot(FuzzySnapshotHistory * history, ubyte32 tick);
+
+#endif
@@ -0,0 +1,146 @@
+/*
+ * Emanuele Faranda         black.silver@hotmail.it
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Microbenchmarks for fuzzy network library
+ *
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include "fuzzy.h"
+#include "network.h"
+#include "protocol.h"
+
+#define BENCH_VALUES 4096
+#define BENCH_ROUNDS 20000
+
+static ubyte16 Values16[BENCH_VALUES];
+static ubyte32 Values32[BENCH_VALUES];
+
+static double _now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define bench_report(name, start)\
+    printf("  %-28s %8.3f ns/value\n", name, (_now() - start) * 1e9 / ((double)BENCH_ROUNDS * BENCH_VALUES))
+
+static void _bench_scalar(FuzzyMessage * msg)
+{
+    double start;
+    int r, i;
+
+    start = _now();
+    for (r = 0; r < BENCH_ROUNDS; r++) {
+        fuzzy_message_clear(msg);
+        for (i = 0; i < BENCH_VALUES; i++)
+            fuzzy_message_push16(msg, Values16[i]);
+        for (i = BENCH_VALUES-1; i >= 0; i--)
+            Values16[i] = fuzzy_message_pop16(msg);
+    }
+    bench_report("push16/pop16 loop", start);
+
+    start = _now();
+    for (r = 0; r < BENCH_ROUNDS; r++) {
+        fuzzy_message_clear(msg);
+        for (i = 0; i < BENCH_VALUES; i++)
+            fuzzy_message_push32(msg, Values32[i]);
+        for (i = BENCH_VALUES-1; i >= 0; i--)
+            Values32[i] = fuzzy_message_pop32(msg);
+    }
+    bench_report("push32/pop32 loop", start);
+}
+
+static void _bench_arrays(FuzzyMessage * msg, FUZZY_SIMD_LEVEL level)
+{
+    char name[64];
+    double start;
+    int r;
+
+    if (fuzzy_message_simd_limit(level) != level)
+        return;
+
+    start = _now();
+    for (r = 0; r < BENCH_ROUNDS; r++) {
+        fuzzy_message_clear(msg);
+        fuzzy_message_push16_array(msg, Values16, BENCH_VALUES);
+        fuzzy_message_pop16_array(msg, Values16, BENCH_VALUES);
+    }
+    snprintf(name, sizeof(name), "16 bit array, level %d", level);
+    bench_report(name, start);
+
+    start = _now();
+    for (r = 0; r < BENCH_ROUNDS; r++) {
+        fuzzy_message_clear(msg);
+        fuzzy_message_push32_array(msg, Values32, BENCH_VALUES);
+        fuzzy_message_pop32_array(msg, Values32, BENCH_VALUES);
+    }
+    snprintf(name, sizeof(name), "32 bit array, level %d", level);
+    bench_report(name, start);
+}
+
+/* commands back to back, as in a channel datagram */
+static void _bench_commands(FuzzyMessage * msg)
+{
+    struct FuzzyCommandPlayer player;
+    FuzzyCommand cmd;
+    double start;
+    int r, i;
+
+    start = _now();
+    for (r = 0; r < BENCH_ROUNDS; r++) {
+        fuzzy_message_clear(msg);
+        for (i = 0; i < BENCH_VALUES; i++) {
+            player.x = i & 63;
+            player.y = Values16[i] & 1023;
+            player.dx = 1;
+            player.dy = -(i & 3);
+            fuzzy_protocol_push_player_action(msg, FUZZY_COMMAND_PLAYER_MOVE, &player);
+        }
+        for (i = 0; i < BENCH_VALUES; i++)
+            if (! fuzzy_protocol_decode_message(msg, &cmd))
+                fuzzy_critical("Bad player action");
+    }
+    bench_report("player action encode/decode", start);
+}
+
+int main()
+{
+    FuzzyMessage * msg;
+    FUZZY_SIMD_LEVEL level;
+    int i;
+
+    for (i = 0; i < BENCH_VALUES; i++) {
+        Values16[i] = i;
+        Values32[i] = i * 65537;
+    }
+
+    msg = fuzzy_message_new();
+    fuzzy_message_reserve(msg, BENCH_VALUES * 4);
+
+    printf("=== Push and pop of %d values (levels: 0 scalar, 1 sse2, 2 avx2) ===\n", BENCH_VALUES);
+    _bench_scalar(msg);
+    for (level = FUZZY_SIMD_NONE; level <= FUZZY_SIMD_AVX2; level++)
+        _bench_arrays(msg, level);
+    printf("=== Encode and decode of %d commands ===\n", BENCH_VALUES);
+    _bench_commands(msg);
+
+    fuzzy_message_del(msg);
+    fuzzy_message_pool_clear();
+    return EXIT_SUCCESS;
+}
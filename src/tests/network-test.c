@@ -21,13 +21,23 @@
 #include <string.h>
 #include <mcheck.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
 #include <sys/socket.h>
 #include <linux/limits.h>
 #include <sys/un.h>
+#include <pthread.h>
+#include <poll.h>
 #include "fuzzy.h"
 #include "network.h"
+#include "protocol.h"
+#include "netthread.h"
+#include "journal.h"
+#include "uring.h"
 
 #define TEST_STRING "TEST STRING !!!"
+#define TEST_UNIX_PATH "fuzzy_test.sock"
+#define ARRAY_VALUES 37                     // not a multiple of any vector width
 
 #define push_n_pop(pfunc, popfunc, val)\
 do{\
@@ -52,16 +62,81 @@ do{\
         fuzzy_critical(fuzzy_sformat("Test for function '%s' failed", fuzzy_str(fn)));\
 } while(0)
 
+static FuzzyTimerWheel Wheel;
+static int Fired = 0;
+
 static void _bogus_push(FuzzyMessage * msg, uint data) {}
 
+static void _timer_fired(FuzzyTimer * timer)
+{
+    if (timer->expires != Wheel.now)
+        fuzzy_critical(fuzzy_sformat("Timer for tick %lu fired on %lu", timer->expires, Wheel.now));
+    Fired++;
+}
+
+static void _replay_closed(FuzzyReplay * replay, FuzzyReplayRoom * room, void * data)
+{
+    FuzzyPlayer * owner = fuzzy_player_by_id(room->game, room->owner);
+
+    if (owner && fuzzy_chess_at(room->game, owner, 2, 2) && owner->soul_points > 0)
+        (*(int *) data)++;
+}
+
+static void _count_notify(void * data)
+{
+    __atomic_add_fetch((int *) data, 1, __ATOMIC_RELAXED);
+}
+
+static void _pop_too_many(FuzzyMessage * msg)
+{
+    ubyte16 out[1];
+
+    fuzzy_message_pop16_array(msg, out, 1);
+}
+
 int main()
 {
     FuzzyMessage * msg;
     char teststr[FUZZY_DEFAULT_MESSAGE_SIZE*2];
     char template[] = "fuzzy_XXXXXX";
     struct sockaddr_un address;
-    int fd, svfd, clfd;
+    int fd, svfd, clfd, unixfd, jfd, i;
     socklen_t addrlen;
+    FuzzyRingBuffer ring;
+    FUZZY_RECV_STATUS status;
+    ubyte32 header;
+    FuzzyFrame * frame;
+    FuzzyOutQueue queues[2];
+    FuzzyPoolStats pstats, pstats2;
+    ubyte32 varints[] = {0, 1, 127, 128, 300, 16383, 16384, 2147483647, 2147483648U, 4294967295U};
+    ubyte32 uval = 0;
+    int32_t sval = 0;
+    ubyte16 a16[ARRAY_VALUES], b16[ARRAY_VALUES];
+    ubyte32 a32[ARRAY_VALUES], b32[ARRAY_VALUES];
+    int level;
+    int dgfd[2];
+    FuzzyChannelBatch batch;
+    struct FuzzyCommandPlayer player;
+    FuzzyCommand cmd;
+    FuzzyServerStats * stats, * stats2;
+    FuzzyNetThread * nt;
+    FuzzyMessage * msg2, view;
+    int notified = 0;
+    FuzzyLocalLink * link, * quiet;
+    FuzzyUring uring;
+    struct io_uring_sqe * sqe;
+    struct io_uring_cqe * cqe;
+    pthread_t thread;
+    FuzzyAddress endpoint;
+    ulong delays[] = {1, 2, 63, 64, 65, 4095, 4096, 4097, 262143, 262144, 300000};
+    FuzzyTimer timers[sizeof(delays) / sizeof(delays[0])];
+    struct pollfd pfd;
+    char jpath[] = "/tmp/fuzzy_journal_XXXXXX";
+    FuzzyJournal * journal = NULL;
+    FuzzyJournalRecord record;
+    FuzzyJournalMap map;
+    FuzzyReplay replay;
+    int closed = 0;
     mtrace();
     
     strncpy(teststr, TEST_STRING, sizeof(teststr));
@@ -102,6 +177,100 @@ int main()
     push_n_pop(_bogus_push, fuzzy_message_pop8, 7);
     fuzzy_message_del(msg);
     
+    /* Varints and zigzag */
+    msg = fuzzy_message_new();
+    for (i = 0; i < sizeof(varints)/sizeof(varints[0]); i++) {
+        fuzzy_message_pushvar(msg, varints[i]);
+        if (! fuzzy_message_popvar(msg, &uval) || uval != varints[i] || msg->cursor != 0)
+            fuzzy_critical(fuzzy_sformat("Varint %u popped as %u", varints[i], uval));
+        fuzzy_message_pushsvar(msg, (int32_t)varints[i]);
+        if (! fuzzy_message_popsvar(msg, &sval) || sval != (int32_t)varints[i] || msg->cursor != 0)
+            fuzzy_critical(fuzzy_sformat("Zigzag %d popped as %d", (int32_t)varints[i], sval));
+    }
+    fuzzy_message_pushsvar(msg, -1);
+    fuzzy_message_pushvar(msg, 127);
+    if (msg->cursor != 2)
+        fuzzy_critical("Small values do not fit a byte");
+    fuzzy_message_clear(msg);
+
+    /* bad varints: truncated, then over 32 bits */
+    fuzzy_message_push8(msg, 0x80);
+    if (fuzzy_message_popvar(msg, &uval) || msg->cursor != 1)
+        fuzzy_critical("Truncated varint popped");
+    fuzzy_message_clear(msg);
+    fuzzy_message_push8(msg, 0x1f);
+    for (i = 0; i < 4; i++)
+        fuzzy_message_push8(msg, 0xff);
+    if (fuzzy_message_popvar(msg, &uval))
+        fuzzy_critical("Overflowing varint popped");
+    fuzzy_message_del(msg);
+
+    /* Scalars keep the version 1 layout: htonl, then shifts */
+    msg = fuzzy_message_new();
+    fuzzy_message_push32(msg, 0x01020304);
+    uval = htonl(0x01020304);
+    if (msg->buffer[0] != (uval >> 24) || msg->buffer[3] != (uval & 0xff))
+        fuzzy_critical("Scalar layout changed");
+    fuzzy_message_del(msg);
+
+    /* Arrays, for every kernel: big endian, all the values in order */
+    for (i = 0; i < ARRAY_VALUES; i++) {
+        a16[i] = i * 257 + 1;
+        a32[i] = i * 16843009U + 3;
+    }
+    for (level = FUZZY_SIMD_NONE; level <= FUZZY_SIMD_AVX2; level++) {
+        if (fuzzy_message_simd_limit(level) != level)
+            continue;
+
+        msg = fuzzy_message_new();
+        fuzzy_message_push16_array(msg, a16, ARRAY_VALUES);
+        fuzzy_message_push32_array(msg, a32, ARRAY_VALUES);
+        for (i = 0; i < ARRAY_VALUES; i++)
+            if (msg->buffer[i*2] != (a16[i] >> 8) || msg->buffer[ARRAY_VALUES*2 + i*4 + 3] != (a32[i] & 0xff))
+                fuzzy_critical(fuzzy_sformat("Array kernel %d not big endian", level));
+        fuzzy_message_pop32_array(msg, b32, ARRAY_VALUES);
+        fuzzy_message_pop16_array(msg, b16, ARRAY_VALUES);
+        if (memcmp(a16, b16, sizeof(a16)) || memcmp(a32, b32, sizeof(a32)))
+            fuzzy_critical(fuzzy_sformat("Array kernel %d mismatch", level));
+        test_message_function(_pop_too_many);
+        fuzzy_message_del(msg);
+    }
+    fuzzy_message_simd_limit(FUZZY_SIMD_AVX2);
+
+    /* Length prefixed strings */
+    msg = fuzzy_message_new();
+    fuzzy_message_push8uint(msg, 7);
+    fuzzy_message_pushvarstr(msg, teststr, sizeof(teststr));
+    if (msg->cursor != 1 + 1 + strlen(TEST_STRING))
+        fuzzy_critical(fuzzy_sformat("Varstr takes %zd bytes", msg->cursor));
+    bzero(teststr, sizeof(teststr));
+    if (! fuzzy_message_popvarstr(msg, teststr, sizeof(teststr)))
+        fuzzy_critical("Varstr pop failed");
+    if (strcmp(teststr, TEST_STRING) != 0)
+        fuzzy_critical(fuzzy_sformat("Strings differ: sent '%s' but got '%s'", TEST_STRING, teststr));
+    if (fuzzy_message_popvarstr(msg, teststr, sizeof(teststr)))
+        fuzzy_critical("Varstr pop over a truncated string");
+    fuzzy_message_del(msg);
+
+    /* Pool recycling and reserve */
+    msg = fuzzy_message_new();
+    fuzzy_message_reserve(msg, FUZZY_DEFAULT_MESSAGE_SIZE * 3);
+    if (msg->buflen < FUZZY_DEFAULT_MESSAGE_SIZE * 3)
+        fuzzy_critical("Message reserve failed");
+    fuzzy_message_del(msg);
+    for (i = 0; i < 10; i++) {
+        msg = fuzzy_message_new();
+        fuzzy_message_pushstr(msg, teststr, sizeof(teststr));
+        fuzzy_message_pushstr(msg, teststr, sizeof(teststr));
+        fuzzy_message_del(msg);
+        if (i == 0)
+            /* steady state from now on */
+            fuzzy_message_pool_stats(&pstats);
+    }
+    fuzzy_message_pool_stats(&pstats2);
+    if (pstats2.misses != pstats.misses)
+        fuzzy_critical(fuzzy_sformat("Pool missed %lu times", pstats2.misses - pstats.misses));
+
     /* Socket send/receive */
     fuzzy_lz_perror(fd = socket(AF_UNIX, SOCK_STREAM, 0));
     memset(&address, 0, sizeof(struct sockaddr_un));
@@ -132,7 +301,478 @@ int main()
     pop_n_cmpstr(teststr);
     push_n_pop(_bogus_push, fuzzy_message_pop16, 123);
     fuzzy_message_del(msg);
+
+    /* Non blocking reassembly: pipelined and fragmented frames */
+    fuzzy_lz_perror(fcntl(clfd, F_SETFL, fcntl(clfd, F_GETFL, 0) | O_NONBLOCK));
+    fuzzy_ring_init(&ring, 16);                 // small ring to force wrapping and growth
+    msg = fuzzy_message_new();
+    for (i = 0; i < 3; i++) {
+        fuzzy_message_clear(msg);
+        fuzzy_message_push32uint(msg, 1000 + i);
+        fuzzy_message_send(svfd, msg);
+    }
+    fuzzy_message_clear(msg);
+    fuzzy_message_pushstr(msg, teststr, sizeof(teststr));
+    fuzzy_message_push16uint(msg, 321);
+    header = htonl(msg->cursor);
+    fuzzy_lz_perror(write(svfd, &header, sizeof(header)));
+    fuzzy_lz_perror(write(svfd, msg->buffer, 10));
+
+    for (i = 0; i < 3; ) {
+        status = fuzzy_ring_recv(clfd, &ring);
+        while (fuzzy_message_extract(&ring, msg) == FUZZY_FRAME_READY) {
+            push_n_pop(_bogus_push, fuzzy_message_pop32, 1000 + i);
+            i++;
+        }
+        if (status == FUZZY_RECV_CLOSED)
+            fuzzy_critical("Unexpected ring close");
+    }
+    while (fuzzy_ring_recv(clfd, &ring) == FUZZY_RECV_MORE)
+        if (fuzzy_message_extract(&ring, msg) == FUZZY_FRAME_READY)
+            fuzzy_critical("Partial frame extracted");
+    if (fuzzy_message_extract(&ring, msg) != FUZZY_FRAME_PARTIAL)
+        fuzzy_critical("Partial frame extracted");
+
+    fuzzy_message_clear(msg);
+    fuzzy_message_pushstr(msg, teststr, sizeof(teststr));
+    fuzzy_message_push16uint(msg, 321);
+    fuzzy_lz_perror(write(svfd, msg->buffer + 10, msg->cursor - 10));
+    do {
+        status = fuzzy_ring_recv(clfd, &ring);
+    } while (fuzzy_message_extract(&ring, msg) != FUZZY_FRAME_READY);
+    push_n_pop(_bogus_push, fuzzy_message_pop16, 321);
+    pop_n_cmpstr(teststr);
+
+    /* a huge size header alone does not grow the ring */
+    header = htonl(FUZZY_MESSAGE_MAX_SIZE);
+    fuzzy_ring_write(&ring, &header, sizeof(header));
+    fuzzy_ring_write(&ring, teststr, 100);
+    if (fuzzy_message_extract(&ring, msg) != FUZZY_FRAME_PARTIAL || ring.size > 1024)
+        fuzzy_critical(fuzzy_sformat("Ring grown to %zu bytes for a header", ring.size));
+    fuzzy_ring_free(&ring);
+    fuzzy_ring_init(&ring, 16);
+
+    /* Shared frame on many queues */
+    fuzzy_message_clear(msg);
+    fuzzy_message_push32uint(msg, 5555);
+    frame = fuzzy_frame_new(msg);
+    fuzzy_outqueue_init(&queues[0]);
+    fuzzy_outqueue_init(&queues[1]);
+    fuzzy_outqueue_push(&queues[0], fuzzy_frame_ref(frame));
+    fuzzy_outqueue_push(&queues[1], fuzzy_frame_ref(frame));
+    fuzzy_frame_unref(frame);
+    for (i = 0; i < 2; i++) {
+        if (fuzzy_outqueue_flush(svfd, &queues[i]) != FUZZY_SEND_DONE || queues[i].bytes != 0)
+            fuzzy_critical("Queue flush failed");
+        fuzzy_outqueue_free(&queues[i]);
+    }
+    for (i = 0; i < 2; ) {
+        fuzzy_ring_recv(clfd, &ring);
+        while (fuzzy_message_extract(&ring, msg) == FUZZY_FRAME_READY) {
+            push_n_pop(_bogus_push, fuzzy_message_pop32, 5555);
+            i++;
+        }
+    }
+
+    /* Compressed frames: big messages shrink, small ones are left alone */
+    fuzzy_message_clear(msg);
+    fuzzy_message_pushstr(msg, teststr, sizeof(teststr));
+    fuzzy_message_pushstr(msg, teststr, sizeof(teststr));
+    frame = fuzzy_frame_new_compressed(msg);
+    if (frame->len >= FUZZY_FRAME_HEADER_SIZE + msg->cursor)
+        fuzzy_critical(fuzzy_sformat("Frame not compressed: %zu bytes", frame->len));
+
+    /* not negotiated: rejected */
+    fuzzy_ring_write(&ring, frame->data, frame->len);
+    if (fuzzy_message_extract(&ring, msg) != FUZZY_FRAME_INVALID)
+        fuzzy_critical("Compressed frame accepted without negotiation");
+    fuzzy_ring_free(&ring);
+    fuzzy_ring_init(&ring, 16);
+    ring.inflate = true;
+
+    /* a few bytes cannot claim a huge inflated size */
+    header = htonl(8 | FUZZY_FRAME_COMPRESSED);
+    fuzzy_ring_write(&ring, &header, sizeof(header));
+    header = htonl(FUZZY_MESSAGE_MAX_SIZE);
+    fuzzy_ring_write(&ring, &header, sizeof(header));
+    fuzzy_ring_write(&ring, teststr, 4);
+    fuzzy_message_del(msg);
+    msg = fuzzy_message_new();
+    if (fuzzy_message_extract(&ring, msg) != FUZZY_FRAME_INVALID || msg->buflen > 1024)
+        fuzzy_critical(fuzzy_sformat("Inflate bomb accepted, %zd bytes reserved", msg->buflen));
+    fuzzy_ring_free(&ring);
+    fuzzy_ring_init(&ring, 16);
+    ring.inflate = true;
+
+    fuzzy_outqueue_init(&queues[0]);
+    fuzzy_outqueue_push(&queues[0], frame);
+    fuzzy_message_clear(msg);
+    fuzzy_message_push32uint(msg, 6666);
+    frame = fuzzy_frame_new_compressed(msg);
+    if (frame->len != FUZZY_FRAME_HEADER_SIZE + msg->cursor)
+        fuzzy_critical("Small frame compressed");
+    fuzzy_outqueue_push(&queues[0], frame);
+    if (fuzzy_outqueue_flush(svfd, &queues[0]) != FUZZY_SEND_DONE)
+        fuzzy_critical("Queue flush failed");
+    fuzzy_outqueue_free(&queues[0]);
+    for (i = 0; i < 2; ) {
+        fuzzy_ring_recv(clfd, &ring);
+        while (fuzzy_message_extract(&ring, msg) == FUZZY_FRAME_READY) {
+            if (i++ == 0) {
+                pop_n_cmpstr(teststr);
+                pop_n_cmpstr(teststr);
+                if (msg->cursor != 0)
+                    fuzzy_critical("Compressed frame differs");
+            } else {
+                push_n_pop(_bogus_push, fuzzy_message_pop32, 6666);
+            }
+        }
+    }
+
+    /* Channel datagrams: batched actions keep their order */
+    fuzzy_lz_perror(socketpair(AF_UNIX, SOCK_DGRAM, 0, dgfd));
+    batch.count = 0;
+    for (i = 0; i < FUZZY_CHANNEL_BATCH; i++) {
+        player.x = i;
+        player.y = i * 3;
+        player.dx = -i;
+        player.dy = 1;
+        if (fuzzy_protocol_batch_add(&batch, FUZZY_COMMAND_PLAYER_STEP, &player) != (i == FUZZY_CHANNEL_BATCH-1))
+            fuzzy_critical("Batch full at wrong size");
+    }
+    fuzzy_message_clear(msg);
+    fuzzy_protocol_push_batch(msg, &batch);
+    fuzzy_message_push32(msg, 77);
+    if (batch.count != 0 || msg->cursor > FUZZY_DATAGRAM_MAX_SIZE)
+        fuzzy_critical(fuzzy_sformat("Bad batch datagram: %zd bytes", msg->cursor));
+    if (! fuzzy_message_sendto(dgfd[0], msg, NULL))
+        fuzzy_critical("Datagram not sent");
+    if (fuzzy_message_recvfrom(dgfd[1], msg, NULL) != FUZZY_RECV_MORE)
+        fuzzy_critical("Datagram not received");
+    push_n_pop(_bogus_push, fuzzy_message_pop32, 77);
+    for (i = 0; i < FUZZY_CHANNEL_BATCH; i++) {
+        if (! fuzzy_protocol_decode_message(msg, &cmd) || cmd.data.player.x != i || cmd.data.player.dx != -i)
+            fuzzy_critical(fuzzy_sformat("Batched action %d out of order", i));
+    }
+    if (msg->cursor != 0 || fuzzy_message_recvfrom(dgfd[1], msg, NULL) != FUZZY_RECV_DRAINED)
+        fuzzy_critical("Unexpected datagram data");
+    close(dgfd[0]);
+    close(dgfd[1]);
+
+    /* sequence numbers wrap */
+    if (! fuzzy_protocol_seq_after(1, 0xFFFFFFFF) || fuzzy_protocol_seq_after(5, 5) || fuzzy_protocol_seq_after(4, 5))
+        fuzzy_critical("Wrong sequence comparison");
+
+    /* Network thread: more messages than the queue holds, in order both ways */
+    fuzzy_lz_perror(socketpair(AF_UNIX, SOCK_STREAM, 0, dgfd));
+    nt = fuzzy_netthread_start(dgfd[0], _count_notify, &notified);
+    for (i = 0; i < FUZZY_NETTHREAD_QUEUE_SIZE * 2; i++) {
+        fuzzy_message_clear(msg);
+        fuzzy_message_push32(msg, i);
+        fuzzy_message_send(dgfd[1], msg);
+    }
+    for (i = 0; i < FUZZY_NETTHREAD_QUEUE_SIZE * 2; i++) {
+        while ((msg2 = fuzzy_netthread_recv(nt)) == NULL)
+            usleep(100);
+        if (fuzzy_message_pop32(msg2) != i)
+            fuzzy_critical("Network thread message out of order");
+        fuzzy_message_del(msg2);
+
+        msg2 = fuzzy_message_new();
+        fuzzy_message_push32(msg2, i);
+        while (! fuzzy_netthread_send(nt, msg2))
+            usleep(100);
+        if (! fuzzy_message_recv(dgfd[1], msg) || fuzzy_message_pop32(msg) != i)
+            fuzzy_critical("Network thread message not sent");
+    }
+    if (__atomic_load_n(&notified, __ATOMIC_RELAXED) == 0)
+        fuzzy_critical("Network thread did not notify");
+    close(dgfd[1]);
+    while (! fuzzy_netthread_closed(nt))
+        usleep(100);
+    fuzzy_netthread_stop(nt);
+    close(dgfd[0]);
+
+    /* Timer wheel: timers on every level fire on their tick, once. The wheel
+        starts off a level boundary, cancelled and rearmed timers too */
+    fuzzy_wheel_init(&Wheel);
+    fuzzy_wheel_advance(&Wheel, 4000, _timer_fired);
+    for (i = 0; i < (int)(sizeof(delays) / sizeof(delays[0])); i++) {
+        fuzzy_timer_init(&timers[i], NULL);
+        fuzzy_timer_arm(&Wheel, &timers[i], Wheel.now + delays[i]);
+    }
+    fuzzy_timer_cancel(&timers[1]);
+    fuzzy_timer_arm(&Wheel, &timers[2], Wheel.now + 70);
+    fuzzy_wheel_advance(&Wheel, 300000, _timer_fired);
+    if (Fired != (int)(sizeof(delays) / sizeof(delays[0])) - 1 || fuzzy_timer_armed(&timers[1]))
+        fuzzy_critical(fuzzy_sformat("%d timers fired", Fired));
+
+    /* Journal: more records than a batch, over two sessions, read back in
+        order. A record cut by a crash is dropped on the next open */
+    fuzzy_lz_perror(jfd = mkstemp(jpath));
+    close(jfd);
+    bzero(&record, sizeof(record));
+    for (i = 0; i < FUZZY_JOURNAL_BATCH * 3; i++) {
+        if (i == FUZZY_JOURNAL_BATCH * 2) {
+            fuzzy_journal_close(journal);
+            fuzzy_lz_perror(jfd = open(jpath, O_WRONLY | O_APPEND));
+            fuzzy_lz_perror(write(jfd, &record, sizeof(record) / 2));
+            close(jfd);
+        }
+        if (i % (FUZZY_JOURNAL_BATCH * 2) == 0)
+            journal = fuzzy_journal_open(jpath, 1, FUZZY_SERVER_TICK_RATE);
+        record.steps = i;
+        fuzzy_journal_append(journal, 0, &record);
+        if (i % 100 == 99)
+            fuzzy_journal_flush(journal, 0);
+    }
+    fuzzy_journal_close(journal);
+    if (! fuzzy_journal_map(&map, jpath) || map.count != FUZZY_JOURNAL_BATCH * 3)
+        fuzzy_critical("Journal records lost");
+    for (i = 0; i < (int)map.count; i++)
+        if (map.records[i].steps != (uint64_t)i)
+            fuzzy_critical(fuzzy_sformat("Journal record %d out of order", i));
+    fuzzy_journal_unmap(&map);
+    unlink(jpath);
+
+    /* Replay: the owner moves a chess once it has the soul points, the room
+        closes when it leaves */
+    fuzzy_replay_init(&replay, FUZZY_SERVER_TICK_RATE);
+    replay.on_close = _replay_closed;
+    replay.close_data = &closed;
+    record.room = 1;
+    record.steps = 0;
+    record.player = 0;
+    record.type = FUZZY_COMMAND_GAME_CREATE;
+    fuzzy_replay_record(&replay, &record);
+    record.player = 1;
+    record.type = FUZZY_COMMAND_GAME_JOIN;
+    fuzzy_replay_record(&replay, &record);
+    record.type = FUZZY_COMMAND_GAME_START;
+    fuzzy_replay_record(&replay, &record);
+    record.steps = FUZZY_SERVER_TICK_RATE * 60;
+    record.player = 0;
+    record.type = FUZZY_COMMAND_PLAYER_MOVE;
+    record.x = record.y = 1;
+    record.dx = record.dy = 1;
+    fuzzy_replay_record(&replay, &record);
+    record.type = FUZZY_COMMAND_GAME_LEAVE;
+    fuzzy_replay_record(&replay, &record);
+    fuzzy_replay_finish(&replay);
+    if (closed != 1 || replay.mismatches != 0 || replay.actions != 1)
+        fuzzy_critical(fuzzy_sformat("Replay: %d rooms closed, %lu mismatches", closed, replay.mismatches));
+
+    /* Tagged requests: the id does not count for the size checks */
+    fuzzy_message_clear(msg);
+    fuzzy_message_pushvar(msg, 300);
+    fuzzy_message_push8(msg, FUZZY_COMMAND_GAME_START | FUZZY_COMMAND_FLAG_REQID);
+    if (! fuzzy_protocol_decode_message(msg, &cmd) || cmd.type != FUZZY_COMMAND_GAME_START || cmd.reqid != 300)
+        fuzzy_critical("Tagged request not decoded");
+    fuzzy_message_push8(msg, FUZZY_COMMAND_GAME_START);
+    if (! fuzzy_protocol_decode_message(msg, &cmd) || cmd.reqid != 0)
+        fuzzy_critical("Untagged request has an id");
+
+    /* Command schema: length prefixed names on tagged requests, keys from
+        version 0 clients, truncated and inconsistent commands */
+    fuzzy_message_clear(msg);
+    cmd.type = FUZZY_COMMAND_GAME_CREATE;
+    cmd.reqid = 7;
+    strcpy(cmd.data.room.name, "schema");
+    fuzzy_protocol_push_command(msg, &cmd, FUZZY_CAP_VARSTR);
+    bzero(&cmd, sizeof(cmd));
+    if (msg->cursor != 9 || ! fuzzy_protocol_decode_message(msg, &cmd) || cmd.reqid != 7 || strcmp(cmd.data.room.name, "schema") != 0)
+        fuzzy_critical("Length prefixed name not decoded");
+    fuzzy_message_pushstr(msg, teststr, FUZZY_SERVERKEY_LEN);
+    fuzzy_message_push8(msg, FUZZY_COMMAND_AUTHENTICATE);
+    if (! fuzzy_protocol_decode_message(msg, &cmd) || cmd.data.auth.version != 0 || cmd.data.auth.caps != 0 || msg->cursor != 0)
+        fuzzy_critical("Version 0 authentication not decoded");
+    fuzzy_message_push32(msg, 0x01020304);
+    fuzzy_message_push8(msg, FUZZY_COMMAND_GAME_JOIN);
+    if (! fuzzy_protocol_decode_message(msg, &cmd) || cmd.data.room.id != 0x01020304)
+        fuzzy_critical("Join room id not decoded as pushed");
+    fuzzy_message_push16(msg, 1);
+    fuzzy_message_push8(msg, FUZZY_COMMAND_GAME_JOIN);
+    if (fuzzy_protocol_decode_message(msg, &cmd))
+        fuzzy_critical("Truncated join decoded");
+    fuzzy_message_clear(msg);
+    fuzzy_message_pushvar(msg, 10);
+    fuzzy_message_pushvar(msg, 9);
+    fuzzy_message_push8(msg, FUZZY_COMMAND_STATE);
+    if (fuzzy_protocol_decode_message(msg, &cmd))
+        fuzzy_critical("State against a newer base decoded");
+    fuzzy_message_clear(msg);
+    if (strcmp(fuzzy_protocol_command_name(FUZZY_COMMAND_PING), "PING") != 0)
+        fuzzy_critical("Bad command name");
+
+    /* Server stats: 64 bit counters and sparse histograms */
+    stats = fuzzy_new(FuzzyServerStats);
+    stats2 = fuzzy_new(FuzzyServerStats);
+    bzero(stats, sizeof(FuzzyServerStats));
+    stats->clients = 3;
+    stats->decode_errors = 5000000000UL;
+    stats->commands[FUZZY_COMMAND_GAME_JOIN].messages_in = 2;
+    stats->commands[FUZZY_COMMAND_GAME_JOIN].bytes_out = 1UL << 40;
+    fuzzy_histogram_add(&stats->commands[FUZZY_COMMAND_GAME_JOIN].latency, 900);
+    fuzzy_histogram_add(&stats->commands[FUZZY_COMMAND_GAME_JOIN].latency, 120000);
+    fuzzy_message_clear(msg);
+    fuzzy_protocol_push_stats(msg, stats);
+    if (! fuzzy_protocol_pop_stats(msg, stats2) || msg->cursor != 0 || memcmp(stats, stats2, sizeof(FuzzyServerStats)) != 0)
+        fuzzy_critical("Stats roundtrip failed");
+    if (fuzzy_histogram_percentile(&stats2->commands[FUZZY_COMMAND_GAME_JOIN].latency, 50) < 900 ||
+      fuzzy_histogram_percentile(&stats2->commands[FUZZY_COMMAND_GAME_JOIN].latency, 100) != 120000)
+        fuzzy_critical("Bad stats percentiles");
+    free(stats);
+    free(stats2);
+
+    /* Endpoints: unix paths and IPv4 addresses */
+    fuzzy_server_address(&endpoint, FUZZY_UNIX_PREFIX TEST_UNIX_PATH, 0);
+    if (endpoint.addr.sa.sa_family != AF_UNIX || strcmp(endpoint.addr.un.sun_path, TEST_UNIX_PATH) != 0)
+        fuzzy_critical("Bad unix endpoint");
+    fuzzy_server_address(&endpoint, "127.0.0.1", FUZZY_DEFAULT_SERVER_PORT);
+    if (endpoint.addr.sa.sa_family != AF_INET || ntohs(endpoint.addr.in.sin_port) != FUZZY_DEFAULT_SERVER_PORT)
+        fuzzy_critical("Bad TCP endpoint");
+
+    /* Uring: submissions go on with the completion queue overflowed, the
+        completions keep their order */
+    if (fuzzy_uring_probe()) {
+        fuzzy_uring_init(&uring, 4);
+        for (i = 0; i < 64; i++) {
+            sqe = fuzzy_uring_sqe(&uring);
+            sqe->opcode = IORING_OP_NOP;
+            sqe->user_data = i;
+        }
+        for (i = 0; i < 64; ) {
+            fuzzy_uring_enter(&uring, 1);
+            while ((cqe = fuzzy_uring_cqe(&uring)) != NULL) {
+                if (cqe->user_data != (ulong) i++)
+                    fuzzy_critical(fuzzy_sformat("Completion %d out of order", i - 1));
+                fuzzy_uring_cqe_seen(&uring);
+            }
+        }
+        fuzzy_uring_free(&uring);
+    }
+
+    /* In-process server: requests and replies through the link, then the
+        shutdown. Messages sent before the loop starts wait on the link. The
+        io_uring backend falls back to epoll where missing */
+    fuzzy_server_set_backend(FUZZY_SERVER_BACKEND_URING);
+    fuzzy_server_set_unix_path(TEST_UNIX_PATH);
+    fuzzy_server_set_idle_timeout(1);
+    fuzzy_server_create(0, teststr);
+    notified = 0;
+    link = fuzzy_server_local_connect(_count_notify, &notified);
+    msg2 = fuzzy_message_new();
+    fuzzy_message_pushvarstr(msg2, "local", FUZZY_NET_ROOM_LEN-1);
+    fuzzy_message_push8(msg2, FUZZY_COMMAND_GAME_CREATE | FUZZY_COMMAND_FLAG_VARSTR);
+    if (! fuzzy_server_local_send(link, msg2))
+        fuzzy_critical("Local link is full");
+    fuzzy_nz_rerror(pthread_create(&thread, NULL, fuzzy_server_loop, NULL));
+    while ((frame = fuzzy_server_local_recv(link)) == NULL)
+        usleep(100);
+    fuzzy_frame_view(frame, &view);
+    if (fuzzy_message_pop8(&view) != FUZZY_NETCODE_OK || fuzzy_message_pop32(&view) == 0)
+        fuzzy_critical("Local room not created");
+    fuzzy_frame_unref(frame);
+
+    /* pipelined requests are polled by the reactor */
+    for (i = 0; i < 20; i++) {
+        msg2 = fuzzy_message_new();
+        fuzzy_message_push8(msg2, FUZZY_COMMAND_PING);
+        if (! fuzzy_server_local_send(link, msg2))
+            fuzzy_critical("Local link is full");
+    }
+    for (i = 0; i < 20; ) {
+        if ((frame = fuzzy_server_local_recv(link)) == NULL) {
+            usleep(100);
+            continue;
+        }
+        fuzzy_frame_view(frame, &view);
+        if (fuzzy_message_pop8(&view) != FUZZY_COMMAND_PING || view.cursor != 0)
+            fuzzy_critical(fuzzy_sformat("Bad local reply %d", i));
+        fuzzy_frame_unref(frame);
+        i++;
+    }
+
+    /* the unix listener at the same time, no udp channels on it */
+    unixfd = fuzzy_server_connect(FUZZY_UNIX_PREFIX TEST_UNIX_PATH, 0);
+    fuzzy_message_clear(msg);
+    if (! fuzzy_protocol_authenticate(unixfd, msg, teststr) || (fuzzy_protocol_peer_caps(unixfd) & FUZZY_CAP_CHANNEL))
+        fuzzy_critical("Unix client not authenticated");
+    fuzzy_message_clear(msg);
+    if (! fuzzy_protocol_ping(unixfd, msg))
+        fuzzy_critical("Ping not echoed");
+
+    /* server to client commands get an error, the server goes on */
+    fuzzy_message_clear(msg);
+    fuzzy_message_pushvar(msg, 0);
+    fuzzy_message_pushvar(msg, 1);
+    fuzzy_message_push8(msg, FUZZY_COMMAND_STATE);
+    fuzzy_message_send(unixfd, msg);
+    if (! fuzzy_message_recv(unixfd, msg) || fuzzy_message_pop8(msg) == FUZZY_NETCODE_OK)
+        fuzzy_critical("State from a client accepted");
+    fuzzy_message_clear(msg);
+    if (! fuzzy_protocol_ping(unixfd, msg))
+        fuzzy_critical("Server down after a client state");
+
+    /* the silent unix client is closed, the link keeps pinging. A silent
+        link is left alone */
+    quiet = fuzzy_server_local_connect(_count_notify, &notified);
+    pfd.fd = unixfd;
+    pfd.events = POLLIN;
+    for (i = 0; i < 100 && poll(&pfd, 1, 50) == 0; i++) {
+        msg2 = fuzzy_message_new();
+        fuzzy_message_push8(msg2, FUZZY_COMMAND_PING);
+        fuzzy_server_local_send(link, msg2);
+        while ((frame = fuzzy_server_local_recv(link)) == NULL)
+            usleep(100);
+        fuzzy_frame_view(frame, &view);
+        if (fuzzy_message_pop8(&view) != FUZZY_COMMAND_PING)
+            fuzzy_critical("Local ping not echoed");
+        fuzzy_frame_unref(frame);
+    }
+    if (fuzzy_message_recv(unixfd, msg))
+        fuzzy_critical("Silent client not closed");
+    close(unixfd);
+    msg2 = fuzzy_message_new();
+    fuzzy_message_push8(msg2, FUZZY_COMMAND_PING);
+    fuzzy_server_local_send(quiet, msg2);
+    for (i = 0; i < 1000 && (frame = fuzzy_server_local_recv(quiet)) == NULL; i++)
+        usleep(1000);
+    if (fuzzy_server_local_closed(quiet) || frame == NULL)
+        fuzzy_critical("Silent local link closed");
+    fuzzy_frame_view(frame, &view);
+    if (fuzzy_message_pop8(&view) != FUZZY_COMMAND_PING)
+        fuzzy_critical("Silent local link not echoed");
+    fuzzy_frame_unref(frame);
+    fuzzy_server_local_close(quiet);
+
+    msg2 = fuzzy_message_new();
+    fuzzy_message_push8(msg2, FUZZY_COMMAND_SHUTDOWN);
+    fuzzy_server_local_send(link, msg2);
+    fuzzy_nz_rerror(pthread_join(thread, NULL));
+    if ((frame = fuzzy_server_local_recv(link)) == NULL)
+        fuzzy_critical("Local shutdown not acknowledged");
+    fuzzy_frame_view(frame, &view);
+    if (fuzzy_message_pop8(&view) != FUZZY_NETCODE_OK)
+        fuzzy_critical("Local shutdown failed");
+    fuzzy_frame_unref(frame);
+    if (__atomic_load_n(&notified, __ATOMIC_RELAXED) == 0)
+        fuzzy_critical("Local link did not notify");
+    fuzzy_server_destroy();
+    if (! fuzzy_server_local_closed(link))
+        fuzzy_critical("Local link not closed with the server");
+    if (access(TEST_UNIX_PATH, F_OK) == 0)
+        fuzzy_critical("Unix socket left behind");
+    fuzzy_server_local_close(link);
+    fuzzy_message_del(msg);
+
+    close(svfd);
+    if (fuzzy_ring_recv(clfd, &ring) != FUZZY_RECV_CLOSED)
+        fuzzy_critical("Ring did not detect disconnection");
+    fuzzy_ring_free(&ring);
+    close(clfd);
     close(fd);
-    
+
+    fuzzy_message_pool_clear();
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,140 @@
+/*
+ * Emanuele Faranda         black.silver@hotmail.it
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * A test for game state snapshots and deltas
+ *
+ */
+
+#include <mcheck.h>
+#include <string.h>
+#include "fuzzy.h"
+#include "network.h"
+#include "game.h"
+#include "snapshot.h"
+
+static bool _snapshot_equal(const FuzzySnapshot * a, const FuzzySnapshot * b)
+{
+    int i;
+
+    if (a->players_count != b->players_count || a->chess_count != b->chess_count)
+        return false;
+    for (i = 0; i < a->players_count; i++)
+        if (a->players[i].id != b->players[i].id || a->players[i].soul_points != b->players[i].soul_points ||
+          strcmp(a->players[i].name, b->players[i].name) != 0)
+            return false;
+    for (i = 0; i < a->chess_count; i++)
+        if (a->chess[i].id != b->chess[i].id || a->chess[i].x != b->chess[i].x || a->chess[i].y != b->chess[i].y ||
+          a->chess[i].owner != b->chess[i].owner || a->chess[i].area != b->chess[i].area)
+            return false;
+    return true;
+}
+
+/* encodes base to snap, decodes it back and compares. Returns the delta size */
+static ssize_t _delta_roundtrip(FuzzyMessage * msg, const FuzzySnapshot * base, const FuzzySnapshot * snap)
+{
+    FuzzySnapshot out;
+    ssize_t len;
+
+    fuzzy_snapshot_init(&out);
+    fuzzy_message_clear(msg);
+    fuzzy_snapshot_push_delta(msg, base, snap);
+    len = msg->cursor;
+
+    if (! fuzzy_snapshot_pop_delta(msg, base, &out) || msg->cursor != 0)
+        fuzzy_critical(fuzzy_sformat("Delta from tick %u to %u not decoded", base->tick, snap->tick));
+    if (! _snapshot_equal(&out, snap))
+        fuzzy_critical(fuzzy_sformat("Delta from tick %u to %u differs", base->tick, snap->tick));
+    fuzzy_snapshot_free(&out);
+    return len;
+}
+
+int main()
+{
+    FuzzyMessage * msg;
+    FuzzyGame * game;
+    FuzzyPlayer * p1, * p2, * p3;
+    FuzzyChess * chess;
+    FuzzySnapshotHistory history;
+    FuzzySnapshot * s1, * s2, * s3;
+    FuzzySnapshot out;
+    ssize_t full, len;
+
+    mtrace();
+    msg = fuzzy_message_new();
+    fuzzy_snapshot_history_init(&history);
+
+    /* headless game */
+    game = fuzzy_game_new(NULL);
+    p1 = fuzzy_player_new(game, FUZZY_PLAYER_REMOTE, "first");
+    p2 = fuzzy_player_new(game, FUZZY_PLAYER_REMOTE, "second");
+    chess = fuzzy_chess_add(game, p1, FUZZY_FOO_LINK, 1, 1);
+    fuzzy_chess_add(game, p2, FUZZY_FOO_LINK, 1, 3);
+    fuzzy_chess_add(game, p1, FUZZY_FOO_LINK, 3, 1);
+    if (fuzzy_chess_move(game, chess, 1, 3))
+        fuzzy_critical("Headless collision not detected");
+
+    s1 = fuzzy_snapshot_history_slot(&history, 1);
+    fuzzy_snapshot_take(s1, game, 1);
+    if (s1->players_count != 2 || s1->chess_count != 3 || s1->chess[1].owner != p2->id)
+        fuzzy_critical("Bad snapshot content");
+    full = _delta_roundtrip(msg, fuzzy_snapshot_history_get(&history, 0), s1);
+
+    /* a single move takes a few bytes */
+    if (! fuzzy_chess_local_move(game, p1, chess, 2, 1))
+        fuzzy_critical("Move failed");
+    s2 = fuzzy_snapshot_history_slot(&history, 2);
+    fuzzy_snapshot_take(s2, game, 2);
+    len = _delta_roundtrip(msg, s1, s2);
+    if (len > 8 || len >= full)
+        fuzzy_critical(fuzzy_sformat("Move delta takes %zd bytes, full state %zd", len, full));
+
+    /* nothing changed */
+    if (_delta_roundtrip(msg, s2, s2) != 2)
+        fuzzy_critical("Empty delta is not empty");
+
+    /* players and chess come and go */
+    p3 = fuzzy_player_new(game, FUZZY_PLAYER_REMOTE, "third");
+    fuzzy_chess_add(game, p3, FUZZY_FOO_LINK, 5, 5);
+    fuzzy_player_free(game, p2);
+    s3 = fuzzy_snapshot_history_slot(&history, 3);
+    fuzzy_snapshot_take(s3, game, 3);
+    _delta_roundtrip(msg, s1, s3);
+    _delta_roundtrip(msg, s2, s3);
+    _delta_roundtrip(msg, s3, s1);
+
+    /* history keeps the recent ticks only */
+    if (fuzzy_snapshot_history_get(&history, 2) != s2 || fuzzy_snapshot_history_get(&history, 2 + FUZZY_SNAPSHOT_HISTORY)->tick != 0)
+        fuzzy_critical("Bad history lookup");
+
+    /* truncated and mismatching deltas are refused */
+    fuzzy_snapshot_init(&out);
+    fuzzy_message_clear(msg);
+    fuzzy_snapshot_push_delta(msg, s1, s3);
+    memmove(msg->buffer, msg->buffer + 3, msg->cursor - 3);
+    msg->cursor -= 3;
+    if (fuzzy_snapshot_pop_delta(msg, s1, &out))
+        fuzzy_critical("Truncated delta decoded");
+    fuzzy_message_clear(msg);
+    fuzzy_snapshot_push_delta(msg, s1, s3);
+    if (fuzzy_snapshot_pop_delta(msg, fuzzy_snapshot_history_get(&history, 0), &out))
+        fuzzy_critical("Delta decoded on the wrong base");
+    fuzzy_snapshot_free(&out);
+
+    fuzzy_snapshot_history_free(&history);
+    fuzzy_game_free(game);
+    fuzzy_message_del(msg);
+    fuzzy_message_pool_clear();
+    return EXIT_SUCCESS;
+}
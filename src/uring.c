@@ -0,0 +1,252 @@
+/*
+ * Emanuele Faranda         black.silver@hotmail.it
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "fuzzy.h"
+#include "network.h"
+#include "uring.h"
+
+#define URING_PROBE_OPS 256
+
+static int _uring_setup(unsigned entries, struct io_uring_params * params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int _uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int _uring_register(int fd, unsigned opcode, void * arg, unsigned nargs)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+/* multishot receives came with zero copy sends (linux 6.0), which the probe
+    can see. Buffer rings and single mappings are older */
+bool fuzzy_uring_probe()
+{
+    static const ubyte8 ops[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG,
+      IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL, IORING_OP_SEND_ZC};
+    struct io_uring_params params;
+    struct io_uring_probe * probe;
+    size_t psize = sizeof(struct io_uring_probe) + URING_PROBE_OPS * sizeof(struct io_uring_probe_op);
+    bool ok;
+    int fd;
+    uint i;
+
+    /* ENOSYS, or disabled by a security policy */
+    bzero(&params, sizeof(params));
+    if ((fd = _uring_setup(4, &params)) < 0)
+        return false;
+
+    probe = fuzzy_alloc(psize);
+    bzero(probe, psize);
+    ok = (params.features & IORING_FEAT_SINGLE_MMAP) && (params.features & IORING_FEAT_NODROP)
+      && _uring_register(fd, IORING_REGISTER_PROBE, probe, URING_PROBE_OPS) == 0;
+    for (i = 0; ok && i < sizeof(ops); i++)
+        if (ops[i] > probe->last_op || ! (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+            ok = false;
+
+    free(probe);
+    close(fd);
+    return ok;
+}
+
+void fuzzy_uring_init(FuzzyUring * ring, unsigned entries)
+{
+    struct io_uring_params params;
+    ubyte8 * rings;
+    unsigned i;
+
+    bzero(ring, sizeof(FuzzyUring));
+    bzero(&params, sizeof(params));
+    /* completions run when the owner thread enters the ring. Multishot
+        requests post many completions for one submission */
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+    fuzzy_lz_perror(ring->fd = _uring_setup(entries, &params));
+
+    /* both queues share a mapping, the submissions have their own */
+    ring->sq_ring_size = fuzzy_max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    rings = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED)
+        fuzzy_critical(fuzzy_strerror(errno));
+    ring->sq_ring = rings;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        fuzzy_critical(fuzzy_strerror(errno));
+
+    ring->sq_head = (unsigned *) (rings + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (rings + params.sq_off.tail);
+    ring->sq_array = (unsigned *) (rings + params.sq_off.array);
+    ring->sq_mask = *(unsigned *) (rings + params.sq_off.ring_mask);
+    ring->sq_local = *ring->sq_tail;
+    ring->cq_head = (unsigned *) (rings + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (rings + params.cq_off.tail);
+    ring->cqes = (struct io_uring_cqe *) (rings + params.cq_off.cqes);
+    ring->cq_mask = *(unsigned *) (rings + params.cq_off.ring_mask);
+
+    /* each submission keeps its own slot */
+    for (i = 0; i < params.sq_entries; i++)
+        ring->sq_array[i] = i;
+}
+
+/* closing the ring cancels its requests */
+void fuzzy_uring_free(FuzzyUring * ring)
+{
+    close(ring->fd);
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->bufs) {
+        munmap(ring->bufs, ring->bufs_size);
+        free(ring->bufmem);
+    }
+    free(ring->backlog);
+    ring->fd = -1;
+}
+
+/* moves the posted completions to the backlog, freeing their slots for the
+    overflowed ones. Returns the number of moved completions */
+static unsigned _uring_cq_stash(FuzzyUring * ring)
+{
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    unsigned count = tail - head;
+
+    if (ring->backlog_count + count > ring->backlog_size) {
+        ring->backlog_size = fuzzy_max(ring->backlog_size * 2, ring->backlog_count + count);
+        fuzzy_iz_perror(ring->backlog = (struct io_uring_cqe *) realloc(ring->backlog,
+          ring->backlog_size * sizeof(struct io_uring_cqe)));
+    }
+    for (; head != tail; head++)
+        ring->backlog[ring->backlog_count++] = ring->cqes[head & ring->cq_mask];
+
+    __atomic_store_n(ring->cq_head, tail, __ATOMIC_RELEASE);
+    return count;
+}
+
+struct io_uring_sqe * fuzzy_uring_sqe(FuzzyUring * ring)
+{
+    struct io_uring_sqe * sqe;
+
+    while (ring->sq_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > ring->sq_mask) {
+        if (fuzzy_uring_enter(ring, 0))
+            continue;
+        /* EBUSY: nothing is submitted until the overflow is flushed */
+        if (errno == EBUSY && _uring_cq_stash(ring) == 0)
+            fuzzy_critical("Completion queue overflow cannot be flushed");
+    }
+
+    sqe = &ring->sqes[ring->sq_local & ring->sq_mask];
+    ring->sq_local++;
+    bzero(sqe, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+bool fuzzy_uring_enter(FuzzyUring * ring, unsigned wait)
+{
+    unsigned submit = ring->sq_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    /* the backlog is reaped before waiting */
+    if (ring->backlog_head < ring->backlog_count)
+        wait = 0;
+    if (submit == 0 && wait == 0)
+        return true;
+
+    /* the release store publishes the submissions */
+    __atomic_store_n(ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+    ring->enters++;
+    if (_uring_enter(ring->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0) < 0) {
+        /* EBUSY: completions must be reaped before more submissions */
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            return false;
+        fuzzy_critical(fuzzy_strerror(errno));
+    }
+    return true;
+}
+
+struct io_uring_cqe * fuzzy_uring_cqe(FuzzyUring * ring)
+{
+    unsigned head = *ring->cq_head;
+
+    /* older than the queued ones */
+    if (ring->backlog_head < ring->backlog_count)
+        return &ring->backlog[ring->backlog_head];
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+/* the release store gives the slot back to the kernel */
+void fuzzy_uring_cqe_seen(FuzzyUring * ring)
+{
+    if (ring->backlog_head < ring->backlog_count) {
+        if (++ring->backlog_head == ring->backlog_count)
+            ring->backlog_head = ring->backlog_count = 0;
+        return;
+    }
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void fuzzy_uring_buffers(FuzzyUring * ring, unsigned count, size_t size)
+{
+    struct io_uring_buf_reg reg;
+    unsigned i;
+
+    if (count & (count - 1))
+        fuzzy_critical("Buffers count is not a power of 2");
+
+    ring->bufs_size = count * sizeof(struct io_uring_buf);
+    ring->bufs = mmap(NULL, ring->bufs_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->bufs == MAP_FAILED)
+        fuzzy_critical(fuzzy_strerror(errno));
+    ring->bufmem = fuzzy_alloc(count * size);
+    ring->nbufs = count;
+    ring->bufsize = size;
+
+    bzero(&reg, sizeof(reg));
+    reg.ring_addr = (ulong) ring->bufs;
+    reg.ring_entries = count;
+    reg.bgid = 0;
+    fuzzy_lz_perror(_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1));
+
+    for (i = 0; i < count; i++)
+        fuzzy_uring_buffer_return(ring, i);
+}
+
+ubyte8 * fuzzy_uring_buffer(FuzzyUring * ring, unsigned id)
+{
+    return &ring->bufmem[id * ring->bufsize];
+}
+
+/* the release store publishes the buffer to the kernel */
+void fuzzy_uring_buffer_return(FuzzyUring * ring, unsigned id)
+{
+    unsigned short tail = ring->bufs->tail;
+    struct io_uring_buf * buf = &ring->bufs->bufs[tail & (ring->nbufs - 1)];
+
+    buf->addr = (ulong) fuzzy_uring_buffer(ring, id);
+    buf->len = ring->bufsize;
+    buf->bid = id;
+    __atomic_store_n(&ring->bufs->tail, tail + 1, __ATOMIC_RELEASE);
+}
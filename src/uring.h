@@ -0,0 +1,89 @@
+/*
+ * Emanuele Faranda         black.silver@hotmail.it
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+    Minimal io_uring wrapper, over the raw system calls.
+
+    A ring belongs to a single thread. Submissions are queued with
+    fuzzy_uring_sqe and handed to the kernel by fuzzy_uring_enter, which can
+    also wait for completions: a loop pays one system call for all the
+    requests it queued and all the completions it reaps.
+
+    BACKLOG: when the completion queue overflows, the kernel refuses new
+        submissions until its slots are freed. A full submission queue then
+        moves the posted completions to the backlog, which is reaped first.
+
+    BUFFERS: a ring of provided buffers, group 0. Receives with
+        IOSQE_BUFFER_SELECT pick a free buffer, which is given back with
+        fuzzy_uring_buffer_return once its data has been consumed.
+ */
+
+#ifndef __FUZZY_URING_H
+#define __FUZZY_URING_H
+
+#include <linux/io_uring.h>
+#include "fuzzy.h"
+#include "network.h"
+
+#define FUZZY_URING_ENTRIES 1024
+#define FUZZY_URING_BUFFERS 512             // provided buffers, a power of 2
+#define FUZZY_URING_BUFFER_SIZE 4096
+
+typedef struct FuzzyUring {
+    int fd;
+    void * sq_ring;
+    size_t sq_ring_size;
+    struct io_uring_sqe * sqes;
+    size_t sqes_size;
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned * sq_array;
+    unsigned sq_mask;
+    unsigned sq_local;                  // tail of the queued submissions
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    struct io_uring_cqe * cqes;
+    unsigned cq_mask;
+    struct io_uring_buf_ring * bufs;    // NULL until fuzzy_uring_buffers
+    ubyte8 * bufmem;
+    size_t bufs_size;
+    unsigned nbufs;
+    size_t bufsize;
+    struct io_uring_cqe * backlog;      // completions moved out of a full queue
+    unsigned backlog_head;
+    unsigned backlog_count;
+    unsigned backlog_size;
+    ulong enters;                       // io_uring_enter calls
+} FuzzyUring;
+
+// true if the kernel has everything the server loop needs
+bool fuzzy_uring_probe();
+void fuzzy_uring_init(FuzzyUring * ring, unsigned entries);
+void fuzzy_uring_free(FuzzyUring * ring);
+// A cleared submission, the queue is submitted first if full. May move
+// completions to the backlog: the caller must not hold a cqe
+struct io_uring_sqe * fuzzy_uring_sqe(FuzzyUring * ring);
+// Submits the queued requests, waiting for wait completions. False on EINTR
+bool fuzzy_uring_enter(FuzzyUring * ring, unsigned wait);
+// Next completion or NULL, fuzzy_uring_cqe_seen frees its slot
+struct io_uring_cqe * fuzzy_uring_cqe(FuzzyUring * ring);
+void fuzzy_uring_cqe_seen(FuzzyUring * ring);
+void fuzzy_uring_buffers(FuzzyUring * ring, unsigned count, size_t size);
+ubyte8 * fuzzy_uring_buffer(FuzzyUring * ring, unsigned id);
+void fuzzy_uring_buffer_return(FuzzyUring * ring, unsigned id);
+
+#endif